@@ -9,9 +9,117 @@ typedef enum {
 	PNG,
 	TIFF0,
 	JPG,
-	JPEG
+	JPEG,
+	QOI
 }g_save_type;
 
+/* how the pixels were fetched from the server */
+typedef enum {
+	G_CAPTURE_XGETIMAGE,
+	G_CAPTURE_XSHM
+}g_capture_path;
+
+/* byte layout of a pixel in GPixbuf.pixels */
+typedef enum {
+	G_PIXEL_RGB,
+	G_PIXEL_RGBA,
+	G_PIXEL_BGRX,	/* little endian 0xXXRRGGBB, as 24/32 bit TrueColor servers send it */
+	G_PIXEL_BGRA
+}g_pixel_format;
+
+typedef enum {
+	G_JPEG_SUBSAMPLE_420,
+	G_JPEG_SUBSAMPLE_422,
+	G_JPEG_SUBSAMPLE_444
+}g_jpeg_subsampling;
+
+typedef enum {
+	G_JPEG_DCT_ISLOW,	/* accurate integer, the libjpeg default */
+	G_JPEG_DCT_IFAST,
+	G_JPEG_DCT_FLOAT
+}g_jpeg_dct;
+
+/* PNG row filters that may be tried, or'ed together */
+typedef enum {
+	G_PNG_FILTER_NONE = 0x08,
+	G_PNG_FILTER_SUB = 0x10,
+	G_PNG_FILTER_UP = 0x20,
+	G_PNG_FILTER_AVG = 0x40,
+	G_PNG_FILTER_PAETH = 0x80,
+	G_PNG_FILTER_ALL = 0xf8
+}g_png_filter;
+
+typedef enum {
+	G_PNG_STRATEGY_AUTO,	/* filtered when filters are on, like libpng */
+	G_PNG_STRATEGY_DEFAULT,
+	G_PNG_STRATEGY_FILTERED,
+	G_PNG_STRATEGY_HUFFMAN_ONLY,
+	G_PNG_STRATEGY_RLE	/* only byte runs, pair with a filter */
+}g_png_strategy;
+
+typedef enum {
+	G_TIFF_COMPRESSION_NONE,
+	G_TIFF_COMPRESSION_LZW,
+	G_TIFF_COMPRESSION_DEFLATE,
+	G_TIFF_COMPRESSION_PACKBITS
+}g_tiff_compression;
+
+typedef enum {
+	G_SAVE_PRESET_DEFAULT,	/* what g_pixbuf_save() does */
+	G_SAVE_PRESET_FAST,	/* speed over size, for UI screenshots */
+	G_SAVE_PRESET_SMALL	/* size over speed */
+}g_save_preset;
+
+/* encoder settings, fill with g_save_options_init() before changing fields */
+typedef struct _GSaveOptions {
+	struct {
+		int quality;		/* 1..100 */
+		g_jpeg_subsampling subsampling;
+		g_jpeg_dct dct;
+		unsigned int optimize : 1;	/* optimal huffman tables */
+		unsigned int progressive : 1;
+	}jpeg;
+	struct {
+		int level;		/* zlib level 0..9, -1 for zlib's default */
+		int filters;		/* g_png_filter bits */
+		g_png_strategy strategy;
+		/*
+		  indexed color when there are at most 256 colors, at the cost
+		  of a pass counting them; on in FAST and SMALL, off in DEFAULT
+		  so g_pixbuf_save() writes the same PNGs as before
+		*/
+		unsigned int palette : 1;
+	}png;
+	struct {
+		g_tiff_compression compression;
+		int rows_per_strip;	/* 0 for strips of about 1M */
+	}tiff;
+}GSaveOptions;
+
+/*
+  Where a saver puts its bytes. write stores all count bytes or fails
+  (0 / -1); flush (may be NULL) pushes out what the sink buffers; seek
+  (NULL for pure streams) works like lseek and returns the new offset or
+  -1. TIFF, and BMP from a capture, write in place when the sink can
+  seek. For a sink of your own, put a GSaveSink first in your struct.
+*/
+typedef struct _GSaveSink GSaveSink;
+struct _GSaveSink {
+	int (*write) (GSaveSink *sink, const void *buf, size_t count);
+	int (*flush) (GSaveSink *sink);
+	long long (*seek) (GSaveSink *sink, long long offset, int whence);
+	void (*destroy) (GSaveSink *sink);	/* used by g_save_sink_free() */
+};
+
+typedef struct _GShmSegment GShmSegment;
+
+typedef struct _GCaptureSession GCaptureSession;
+
+typedef struct _GRect {
+	int x, y;
+	int width, height;
+}GRect;
+
 
 typedef struct _GPixbuf {
 	int byte_order;
@@ -37,13 +145,121 @@ typedef struct _GPixbuf {
 
     /* Do we have an alpha channel? */
     unsigned int has_alpha : 1;
+
+    /* Pixel layout, RGB unless captured natively */
+    g_pixel_format format;
+
+    /* The pixels belong to a shared segment, not to the pixbuf */
+    unsigned int borrowed : 1;
 }GPixbuf;
 
 GPixbuf *g_pixbuf_new_from_data (const unsigned char *data, int depth, int b_order, int has_alpha, int bits_per_sample, int width, int height, int rowstride);
 GPixbuf *g_pixbuf_new (int depth, int b_order, int has_alpha, int bits_per_sample, int width, int height);
+void g_pixbuf_free (GPixbuf *pixbuf);
 GPixbuf *g_pixbuf_x_get_from_drawable (Display *dpy, Drawable src, int src_x, int src_y, int width, int height);
+GPixbuf *g_pixbuf_x_get_from_drawable_shm (Display *dpy, Drawable src, int src_x, int src_y, int width, int height, GShmSegment *shm, g_capture_path *path);
 int g_pixbuf_save(GPixbuf *pixbuf, FILE *fp, g_save_type type);
+void g_save_options_init (GSaveOptions *options, g_save_preset preset);
+
+/* like g_pixbuf_save(), options NULL means the defaults; BMP, ICO and QOI take none */
+int g_pixbuf_save_with_options (GPixbuf *pixbuf, FILE *fp, g_save_type type, const GSaveOptions *options);
+
+/*
+  Built-in sinks, released with g_save_sink_free(). A FILE or fd is not
+  closed; the fd sink gathers small writes until a flush. The buffer
+  sink grows as needed; its bytes stay valid until the next write, or
+  are handed over by g_save_sink_steal_buffer() (free() them).
+*/
+GSaveSink *g_save_sink_new_for_file (FILE *fp);
+GSaveSink *g_save_sink_new_for_fd (int fd);
+GSaveSink *g_save_sink_new_buffer (size_t size_hint);
+const unsigned char *g_save_sink_get_buffer (GSaveSink *sink, size_t *size);
+unsigned char *g_save_sink_steal_buffer (GSaveSink *sink, size_t *size);
+void g_save_sink_free (GSaveSink *sink);
+
+/* like g_pixbuf_save_with_options(), into a sink that is flushed at the end */
+int g_pixbuf_save_to_sink (GPixbuf *pixbuf, GSaveSink *sink, g_save_type type, const GSaveOptions *options);
+/* encode to memory; *data is malloc'ed, free() it */
+int g_pixbuf_save_to_buffer (GPixbuf *pixbuf, unsigned char **data, size_t *size, g_save_type type, const GSaveOptions *options);
+
+/* read a QOI image from fp into a new RGB(A) pixbuf, NULL on error */
+GPixbuf *g_pixbuf_new_from_qoi (FILE *fp);
+
+/*
+  Convert captures of at least min_pixels pixels in row bands on
+  n_threads threads (0 = one per processor, 1 = single threaded, the
+  default). A negative min_pixels keeps the current threshold. Call it
+  while no capture is running.
+*/
+void g_pixbuf_set_convert_threads (int n_threads, int min_pixels);
+
+/*
+  Encode PNGs, baseline JPEGs and compressed TIFFs of at least min_pixels
+  pixels in row stripes on n_threads threads, with the same meaning of
+  the arguments as above. PNGs stay one ordinary zlib stream but are not
+  byte for byte what libpng writes; JPEGs gain a restart marker per
+  stripe; TIFF strips are compressed side by side. Optimized or
+  progressive JPEGs are always written on one thread.
+*/
+void g_pixbuf_set_save_threads (int n_threads, int min_pixels);
+
+GShmSegment *g_shm_segment_new (Display *dpy);
+void g_shm_segment_free (GShmSegment *shm);
+
+/*
+  A capture session keeps the display connection, interned atoms, the
+  root visual/colormap and the shared segment alive across captures.
+  A session must only be used from one thread at a time. Attaching the
+  shared segment and each XShm capture swap the process-wide X error
+  handler for a moment, under a lock held by every session; other code
+  setting the handler at the same time is not covered.
+*/
+GCaptureSession *g_capture_session_new (const char *display_name);
+GCaptureSession *g_capture_session_new_for_display (Display *dpy);
+void g_capture_session_free (GCaptureSession *session);
+Display *g_capture_session_get_display (GCaptureSession *session);
+GPixbuf *g_capture_session_grab (GCaptureSession *session, Drawable src, const GRect *area, g_capture_path *path);
+
+/*
+  Like g_capture_session_grab(), but when the server sends little endian
+  0xRRGGBB pixels at 32 bits/pixel the fetched buffer itself becomes the
+  pixbuf (G_PIXEL_BGRX, or G_PIXEL_BGRA at depth 32) and nothing is
+  converted. Through XShm the pixels stay in the session's shared segment
+  and are only valid until the next capture on the session. Other
+  layouts come back converted to G_PIXEL_RGB. Release with g_pixbuf_free().
+*/
+GPixbuf *g_capture_session_grab_native (GCaptureSession *session, Drawable src, const GRect *area, g_capture_path *path);
+
+/*
+  Colormap contents are read once per session and re-read after a
+  ColormapNotify. Writable colormaps can change without one; call this
+  after changing their cells.
+*/
+void g_capture_session_invalidate_colormaps (GCaptureSession *session);
+
+/*
+  Capture and encode in horizontal bands of band_rows rows (0 picks a
+  default), so memory stays bounded by the band instead of the screen.
+  JPEG, PNG, TIFF, QOI and BMP only; BMP is written top-down when fp (or
+  the sink) cannot seek, and TIFF is then assembled in memory. Returns 0
+  on success, -1 on error.
+*/
+int g_capture_session_save (GCaptureSession *session, Drawable src, const GRect *area, FILE *fp, g_save_type type, int band_rows);
+int g_capture_session_save_to_sink (GCaptureSession *session, Drawable src, const GRect *area, GSaveSink *sink, g_save_type type, int band_rows);
+
+/*
+  Incremental capture: after g_capture_session_track_damage() (src None
+  for the root window) each g_capture_session_grab_damaged() re-fetches
+  only what XDamage reported as changed since the previous call. The
+  returned pixbuf mirrors the whole drawable and belongs to the session;
+  *dirty lists the rectangles that were refreshed and stays valid until
+  the next call. The first call refreshes everything.
+*/
+int g_capture_session_track_damage (GCaptureSession *session, Drawable src);
+void g_capture_session_untrack_damage (GCaptureSession *session);
+GPixbuf *g_capture_session_grab_damaged (GCaptureSession *session, const GRect **dirty, int *n_dirty);
 
 void grab_window(const char *fileName, g_save_type type);
+void grab_window_with_session(GCaptureSession *session, const char *fileName, g_save_type type);
 
 #endif
@@ -6,8 +6,62 @@ extern "C" {
 #endif /* __cplusplus */
 
 extern int jpg2bmp(const char *in, const char *out);
+/* scale_denom 1, 2, 4 or 8; topdown writes rows as they are decoded */
+extern int jpg2bmp_scaled(const char *in, const char *out, int scale_denom, int topdown);
 extern int bmp2png(char *in, char *out);
 extern int png2bmp(char *in, char *out);
+extern int qoi2png(char *in, char *out);
+extern int png2qoi(char *in, char *out);
+
+/*
+  Batch conversion: many files at once on a thread pool, see
+  src/util/batch. Inputs may be files, directories (every file with the
+  input extension) or glob patterns.
+*/
+typedef enum {
+	CONVERT_BMP2PNG,
+	CONVERT_PNG2BMP,
+	CONVERT_JPG2BMP
+} convert_type;
+
+/* one converted file, handed to the progress callback */
+typedef struct {
+	const char *in;
+	const char *out;
+	int status;			/* 0, -1 if the conversion failed, -2 if
+					   an earlier file writes out, -3 if
+					   out is in itself */
+	unsigned long long in_bytes;
+	unsigned long long out_bytes;
+	double ms;
+} convert_result;
+
+typedef struct {
+	int n_threads;			/* 0 for one per processor */
+	unsigned long long max_inflight;	/* decoded bytes in flight, 0 for 512M */
+	int complevel;			/* bmp2png zlib level, -1 for its default */
+	int stream;			/* bmp2png/png2bmp hold a few rows, see CONVCTX */
+	int topdown;			/* png2bmp/jpg2bmp write top-down BMPs */
+	int jpeg_scale;			/* jpg2bmp decodes at 1/jpeg_scale: 1, 2, 4 or 8 */
+	/* NULL to write next to each input; see convert_result.status */
+	const char *out_dir;
+	/* called once per file, never from two threads at a time */
+	void (*progress) (const convert_result *result, void *usr_data);
+	void *usr_data;
+} convert_batch_options;
+
+typedef struct {
+	int n_files;
+	int n_failed;
+	unsigned long long in_bytes;
+	unsigned long long out_bytes;
+	double ms;			/* wall clock for the whole batch */
+} convert_batch_stats;
+
+extern void convert_batch_options_init(convert_batch_options *options);
+/* returns the number of failed files, or -1 if the batch could not start */
+extern int convert_batch(convert_type type, char **inputs, int n_inputs,
+			 const convert_batch_options *options, convert_batch_stats *stats);
 
 
 
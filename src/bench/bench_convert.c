@@ -0,0 +1,111 @@
+/*
+  bench_convert --- row band conversion speedup
+
+  Converts a 32 bit TrueColor XImage, 7680x2160 unless given, the way a
+  capture does, on 1, 2, 4, 8 and 16 threads, and prints the best of a
+  few runs per count with its speedup over one thread. The bands must
+  come out as the single threaded image does.
+
+  usage: bench_convert [width height [runs]]
+*/
+
+#include "g_private.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const int thread_counts[] = { 1, 2, 4, 8, 16 };
+#define N_COUNTS ((int)(sizeof(thread_counts) / sizeof(thread_counts[0])))
+
+static double now_ms (void)
+{
+	struct timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+int main (int argc, char **argv)
+{
+	XImage image;
+	Visual visual;
+	xlib_colormap cmap;
+	unsigned char *src, *ref, *out;
+	int width = 7680, height = 2160, runs = 5;
+	int rowstride, i, j, failed = 0;
+	double t, best, base = 0;
+	size_t size, k;
+
+	if (argc >= 3) {
+		width = atoi (argv[1]);
+		height = atoi (argv[2]);
+	}
+	if (argc >= 4)
+		runs = atoi (argv[3]);
+	if (width < 1 || height < 1 || runs < 1) {
+		fprintf (stderr, "usage: bench_convert [width height [runs]]\n");
+		return 2;
+	}
+
+	size = (size_t)width * 4 * height;
+	rowstride = width * 3;
+	src = (unsigned char *)malloc(size);
+	ref = (unsigned char *)malloc((size_t)rowstride * height);
+	out = (unsigned char *)malloc((size_t)rowstride * height);
+	if (!src || !ref || !out) {
+		fprintf (stderr, "bench_convert: out of memory\n");
+		return 1;
+	}
+	for (k = 0; k < size; k++)
+		src[k] = rand () >> 7;
+
+	/* what a little endian depth 24 server sends */
+	memset (&visual, 0, sizeof(visual));
+	visual.class = TrueColor;
+	visual.red_mask = 0xff0000;
+	visual.green_mask = 0xff00;
+	visual.blue_mask = 0xff;
+	memset (&cmap, 0, sizeof(cmap));
+	cmap.visual = &visual;
+
+	memset (&image, 0, sizeof(image));
+	image.width = width;
+	image.height = height;
+	image.format = ZPixmap;
+	image.byte_order = LSBFirst;
+	image.depth = 24;
+	image.bits_per_pixel = 32;
+	image.bytes_per_line = width * 4;
+	image.data = (char *)src;
+
+	printf ("%dx%d, %d processors, best of %d\n", width, height, xss_get_num_processors (), runs);
+	printf ("threads        ms   speedup\n");
+	for (i = 0; i < N_COUNTS; i++) {
+		/* every size is big enough to be cut into bands */
+		g_pixbuf_set_convert_threads (thread_counts[i], 0);
+		best = -1;
+		for (j = 0; j < runs; j++) {
+			t = now_ms ();
+			_g_pixbuf_convert (&image, i ? out : ref, rowstride, 0, &cmap);
+			t = now_ms () - t;
+			if (best < 0 || t < best)
+				best = t;
+		}
+		if (!i)
+			base = best;
+		else if (memcmp (ref, out, (size_t)rowstride * height)) {
+			printf ("%7d  differs from one thread\n", thread_counts[i]);
+			failed = 1;
+			continue;
+		}
+		printf ("%7d %9.2f %8.2fx\n", thread_counts[i], best, best > 0 ? base / best : 0);
+	}
+	g_pixbuf_set_convert_threads (1, -1);
+
+	free (src);
+	free (ref);
+	free (out);
+	return failed;
+}
@@ -0,0 +1,177 @@
+/*
+  bench_png --- stripe PNG encoder scaling
+
+  Saves a screenshot-like RGB picture, 7680x2160 unless given, as PNG
+  on 1, 2, 4, 8 and 16 threads (one thread is the plain libpng path)
+  and prints the best of a few runs per count, its speedup over one
+  thread and the file size. Every file is read back with libpng and
+  must hold the same pixels.
+
+  usage: bench_png [width height [runs]]
+*/
+
+#include "g_pixbuf.h"
+#include "pool.h"
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const int thread_counts[] = { 1, 2, 4, 8, 16 };
+#define N_COUNTS ((int)(sizeof(thread_counts) / sizeof(thread_counts[0])))
+
+typedef struct {
+	const unsigned char *data;
+	size_t size, pos;
+} png_source;
+
+static double now_ms (void)
+{
+	struct timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+/* flat panels, gradients and a sprinkle of glyph-like noise */
+static void fill_screen (GPixbuf *pixbuf)
+{
+	unsigned char *p;
+	int x, y, panel;
+
+	for (y = 0; y < pixbuf->height; y++) {
+		p = pixbuf->pixels + y * pixbuf->rowstride;
+		for (x = 0; x < pixbuf->width; x++, p += 3) {
+			panel = (x / 640 + y / 360) % 3;
+			if (panel == 0) {
+				p[0] = 0xee; p[1] = 0xee; p[2] = 0xec;
+			} else if (panel == 1) {
+				p[0] = x & 0xff; p[1] = y & 0xff; p[2] = 0x80;
+			} else {
+				p[0] = 0x2e; p[1] = 0x34; p[2] = 0x36;
+			}
+			if ((y % 18) < 12 && (rand () & 7) == 0)
+				p[0] = p[1] = p[2] = rand () & 0xff;
+		}
+	}
+}
+
+static void read_source (png_structp png_ptr, png_bytep buf, png_size_t n)
+{
+	png_source *src = (png_source *)png_get_io_ptr (png_ptr);
+
+	if (n > src->size - src->pos)
+		png_error (png_ptr, "truncated");
+	memcpy (buf, src->data + src->pos, n);
+	src->pos += n;
+}
+
+/* 0 when data decodes to exactly the pixels of pixbuf */
+static int check_png (const unsigned char *data, size_t size, const GPixbuf *pixbuf)
+{
+	png_structp png_ptr;
+	png_infop info_ptr = NULL;
+	png_source src = { data, size, 0 };
+	unsigned char *volatile row = NULL;
+	volatile int ret = -1;
+	int y;
+
+	png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr)
+		return -1;
+	info_ptr = png_create_info_struct (png_ptr);
+	if (!info_ptr || setjmp (png_jmpbuf (png_ptr)))
+		goto done;
+
+	png_set_read_fn (png_ptr, &src, read_source);
+	png_read_info (png_ptr, info_ptr);
+	if ((int)png_get_image_width (png_ptr, info_ptr) != pixbuf->width
+	    || (int)png_get_image_height (png_ptr, info_ptr) != pixbuf->height)
+		goto done;
+	/* a palette or gray file must still come out as the same RGB */
+	png_set_expand (png_ptr);
+	png_set_gray_to_rgb (png_ptr);
+	png_set_strip_alpha (png_ptr);
+	png_set_strip_16 (png_ptr);
+	png_read_update_info (png_ptr, info_ptr);
+
+	row = (unsigned char *)malloc(png_get_rowbytes (png_ptr, info_ptr));
+	if (!row)
+		goto done;
+	for (y = 0; y < pixbuf->height; y++) {
+		png_read_row (png_ptr, row, NULL);
+		if (memcmp (row, pixbuf->pixels + y * pixbuf->rowstride, pixbuf->width * 3))
+			goto done;
+	}
+	png_read_end (png_ptr, NULL);
+	ret = 0;
+
+done:
+	png_destroy_read_struct (&png_ptr, info_ptr ? &info_ptr : NULL, NULL);
+	free (row);
+	return ret;
+}
+
+int main (int argc, char **argv)
+{
+	GPixbuf *pixbuf;
+	unsigned char *data;
+	size_t size = 0;
+	int width = 7680, height = 2160, runs = 3;
+	int i, j, failed = 0;
+	double t, best, base = 0;
+
+	if (argc >= 3) {
+		width = atoi (argv[1]);
+		height = atoi (argv[2]);
+	}
+	if (argc >= 4)
+		runs = atoi (argv[3]);
+	if (width < 1 || height < 1 || runs < 1) {
+		fprintf (stderr, "usage: bench_png [width height [runs]]\n");
+		return 2;
+	}
+
+	pixbuf = g_pixbuf_new (24, LSBFirst, 0, 8, width, height);
+	if (!pixbuf) {
+		fprintf (stderr, "bench_png: out of memory\n");
+		return 1;
+	}
+	fill_screen (pixbuf);
+
+	printf ("%dx%d, %d processors, best of %d\n", width, height, xss_get_num_processors (), runs);
+	printf ("threads        ms   speedup     bytes\n");
+	for (i = 0; i < N_COUNTS; i++) {
+		/* every size is big enough to be cut into stripes */
+		g_pixbuf_set_save_threads (thread_counts[i], 0);
+		best = -1;
+		data = NULL;
+		for (j = 0; j < runs; j++) {
+			free (data);
+			t = now_ms ();
+			if (g_pixbuf_save_to_buffer (pixbuf, &data, &size, PNG, NULL) < 0) {
+				data = NULL;
+				break;
+			}
+			t = now_ms () - t;
+			if (best < 0 || t < best)
+				best = t;
+		}
+		if (!data || check_png (data, size, pixbuf) < 0) {
+			printf ("%7d  %s\n", thread_counts[i], data ? "does not read back" : "save failed");
+			free (data);
+			failed = 1;
+			continue;
+		}
+		free (data);
+		if (!i)
+			base = best;
+		printf ("%7d %9.2f %8.2fx %9lu\n", thread_counts[i], best, best > 0 && base > 0 ? base / best : 0,
+			(unsigned long)size);
+	}
+	g_pixbuf_set_save_threads (1, -1);
+
+	g_pixbuf_free (pixbuf);
+	return failed;
+}
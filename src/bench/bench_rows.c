@@ -0,0 +1,304 @@
+/*
+  bench_rows --- feeding encoder rows in place
+
+  The JPEG and PNG savers used to copy every pixel into a scratch row
+  and hand the encoder one row at a time; they now pass row pointers
+  into the pixbuf, G_SAVE_BAND_ROWS at a call. On an RGB picture,
+  3840x2160 unless given, this times both feeds alone and through
+  libjpeg (quality 75) and libpng (zlib default), best of a few runs,
+  and checks both feeds encode to the same bytes.
+
+  usage: bench_rows [width height [runs]]
+*/
+
+#include "g_private.h"
+#include <jpeglib.h>
+#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OUT_CHUNK	65536
+
+typedef struct {
+	unsigned char *data;
+	size_t size, allocated;
+} out_buf;
+
+typedef struct {
+	struct jpeg_destination_mgr pub;
+	out_buf *out;
+	JOCTET chunk[OUT_CHUNK];
+} out_jpeg_dest;
+
+typedef struct {
+	GPixbuf *pixbuf;
+	unsigned char *scratch;	/* one packed row, for the old feed */
+	out_buf out;
+} bench;
+
+static double now_ms (void)
+{
+	struct timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static void out_append (out_buf *out, const void *data, size_t n)
+{
+	unsigned char *grown;
+	size_t allocated;
+
+	if (out->size + n > out->allocated) {
+		allocated = out->allocated ? out->allocated : OUT_CHUNK;
+		while (allocated < out->size + n)
+			allocated *= 2;
+		grown = (unsigned char *)realloc(out->data, allocated);
+		if (!grown) {
+			fprintf (stderr, "bench_rows: out of memory\n");
+			exit (1);
+		}
+		out->data = grown;
+		out->allocated = allocated;
+	}
+	memcpy (out->data + out->size, data, n);
+	out->size += n;
+}
+
+/* ------------------------------------------------------------------ */
+
+/* the scratch row loop of the old savers, one row */
+static unsigned char *scratch_row (bench *b, int y)
+{
+	const unsigned char *ptr = b->pixbuf->pixels + y * b->pixbuf->rowstride;
+	int x;
+
+	for (x = 0; x < b->pixbuf->width; x++)
+		memcpy (&b->scratch[x * 3], &ptr[x * 3], 3);
+	return b->scratch;
+}
+
+/* row pointers for rows y.. of a batch, as the savers set them up now */
+static int row_batch (bench *b, int y, unsigned char **rows)
+{
+	int i, n = b->pixbuf->height - y < G_SAVE_BAND_ROWS ? b->pixbuf->height - y : G_SAVE_BAND_ROWS;
+
+	for (i = 0; i < n; i++)
+		rows[i] = b->pixbuf->pixels + (y + i) * b->pixbuf->rowstride;
+	return n;
+}
+
+static void feed_only (bench *b, int in_place)
+{
+	unsigned char *rows[G_SAVE_BAND_ROWS];
+	volatile unsigned char sink = 0;
+	int y, n;
+
+	for (y = 0; y < b->pixbuf->height; y += n) {
+		if (in_place) {
+			n = row_batch (b, y, rows);
+			sink ^= rows[n - 1][0];
+		} else {
+			n = 1;
+			sink ^= scratch_row (b, y)[0];
+		}
+	}
+	(void)sink;
+}
+
+/* ------------------------------------------------------------------ */
+
+static void jpeg_dest_init (j_compress_ptr cinfo)
+{
+	out_jpeg_dest *dest = (out_jpeg_dest *)cinfo->dest;
+
+	dest->pub.next_output_byte = dest->chunk;
+	dest->pub.free_in_buffer = OUT_CHUNK;
+}
+
+static boolean jpeg_dest_empty (j_compress_ptr cinfo)
+{
+	out_jpeg_dest *dest = (out_jpeg_dest *)cinfo->dest;
+
+	out_append (dest->out, dest->chunk, OUT_CHUNK);
+	jpeg_dest_init (cinfo);
+	return TRUE;
+}
+
+static void jpeg_dest_term (j_compress_ptr cinfo)
+{
+	out_jpeg_dest *dest = (out_jpeg_dest *)cinfo->dest;
+
+	out_append (dest->out, dest->chunk, OUT_CHUNK - dest->pub.free_in_buffer);
+}
+
+static void feed_jpeg (bench *b, int in_place)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	out_jpeg_dest *dest;
+	unsigned char *rows[G_SAVE_BAND_ROWS];
+	JSAMPROW row;
+	int y = 0, n;
+
+	cinfo.err = jpeg_std_error (&jerr);
+	jpeg_create_compress (&cinfo);
+	dest = (out_jpeg_dest *)(*cinfo.mem->alloc_small) ((j_common_ptr)&cinfo, JPOOL_PERMANENT, sizeof(out_jpeg_dest));
+	dest->pub.init_destination = jpeg_dest_init;
+	dest->pub.empty_output_buffer = jpeg_dest_empty;
+	dest->pub.term_destination = jpeg_dest_term;
+	dest->out = &b->out;
+	cinfo.dest = &dest->pub;
+
+	cinfo.image_width = b->pixbuf->width;
+	cinfo.image_height = b->pixbuf->height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults (&cinfo);
+	jpeg_set_quality (&cinfo, 75, TRUE);
+	jpeg_start_compress (&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		if (in_place) {
+			n = row_batch (b, cinfo.next_scanline, rows);
+			jpeg_write_scanlines (&cinfo, (JSAMPARRAY)rows, n);
+		} else {
+			row = scratch_row (b, y++);
+			jpeg_write_scanlines (&cinfo, &row, 1);
+		}
+	}
+	jpeg_finish_compress (&cinfo);
+	jpeg_destroy_compress (&cinfo);
+}
+
+static void png_dest_write (png_structp png_ptr, png_bytep data, png_size_t n)
+{
+	out_append ((out_buf *)png_get_io_ptr (png_ptr), data, n);
+}
+
+static void png_dest_flush (png_structp png_ptr)
+{
+	(void)png_ptr;
+}
+
+static void feed_png (bench *b, int in_place)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	unsigned char *rows[G_SAVE_BAND_ROWS];
+	png_bytep row;
+	int y, n;
+
+	png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info_ptr = png_ptr ? png_create_info_struct (png_ptr) : NULL;
+	if (!info_ptr || setjmp (png_jmpbuf (png_ptr))) {
+		fprintf (stderr, "bench_rows: libpng failed\n");
+		exit (1);
+	}
+	png_set_write_fn (png_ptr, &b->out, png_dest_write, png_dest_flush);
+	png_set_IHDR (png_ptr, info_ptr, b->pixbuf->width, b->pixbuf->height, 8,
+		      PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+		      PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_write_info (png_ptr, info_ptr);
+	for (y = 0; y < b->pixbuf->height; y += n) {
+		if (in_place) {
+			n = row_batch (b, y, rows);
+			png_write_rows (png_ptr, (png_bytepp)rows, n);
+		} else {
+			n = 1;
+			row = scratch_row (b, y);
+			png_write_rows (png_ptr, &row, 1);
+		}
+	}
+	png_write_end (png_ptr, info_ptr);
+	png_destroy_write_struct (&png_ptr, &info_ptr);
+}
+
+/* ------------------------------------------------------------------ */
+
+/* best time of runs; what the last run wrote stays in b->out */
+static double time_feed (bench *b, void (*feed) (bench *b, int in_place), int in_place, int runs)
+{
+	double t, best = -1;
+	int i;
+
+	for (i = 0; i < runs; i++) {
+		b->out.size = 0;
+		t = now_ms ();
+		feed (b, in_place);
+		t = now_ms () - t;
+		if (best < 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+int main (int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		void (*feed) (bench *b, int in_place);
+	} feeds[] = {
+		{ "rows only", feed_only },
+		{ "jpeg q75", feed_jpeg },
+		{ "png", feed_png }
+	};
+	bench b;
+	out_buf scratch_out;
+	unsigned char *p;
+	int width = 3840, height = 2160, runs = 5;
+	int i, x, y, failed = 0;
+	double t_scratch, t_place;
+
+	if (argc >= 3) {
+		width = atoi (argv[1]);
+		height = atoi (argv[2]);
+	}
+	if (argc >= 4)
+		runs = atoi (argv[3]);
+	if (width < 1 || height < 1 || runs < 1) {
+		fprintf (stderr, "usage: bench_rows [width height [runs]]\n");
+		return 2;
+	}
+
+	memset (&b, 0, sizeof(b));
+	b.pixbuf = g_pixbuf_new (24, LSBFirst, 0, 8, width, height);
+	b.scratch = (unsigned char *)malloc(width * 3);
+	if (!b.pixbuf || !b.scratch) {
+		fprintf (stderr, "bench_rows: out of memory\n");
+		return 1;
+	}
+	/* gradients with some noise, neither trivial nor random to deflate */
+	for (y = 0; y < height; y++) {
+		p = b.pixbuf->pixels + y * b.pixbuf->rowstride;
+		for (x = 0; x < width; x++, p += 3) {
+			p[0] = x;
+			p[1] = y;
+			p[2] = (rand () & 15) ? 0x80 : rand ();
+		}
+	}
+
+	printf ("%dx%d RGB, best of %d\n", width, height, runs);
+	printf ("feed        scratch ms  in place ms\n");
+	for (i = 0; i < (int)(sizeof(feeds) / sizeof(feeds[0])); i++) {
+		t_scratch = time_feed (&b, feeds[i].feed, 0, runs);
+		scratch_out = b.out;
+		memset (&b.out, 0, sizeof(b.out));
+		t_place = time_feed (&b, feeds[i].feed, 1, runs);
+		printf ("%-10s %11.3f %12.3f", feeds[i].name, t_scratch, t_place);
+		if (scratch_out.size != b.out.size
+		    || (b.out.size && memcmp (scratch_out.data, b.out.data, b.out.size))) {
+			printf ("  output differs");
+			failed = 1;
+		}
+		printf ("\n");
+		free (scratch_out.data);
+		free (b.out.data);
+		memset (&b.out, 0, sizeof(b.out));
+	}
+
+	free (b.scratch);
+	g_pixbuf_free (b.pixbuf);
+	return failed;
+}
@@ -0,0 +1,882 @@
+/*
+  SSE2/SSSE3/AVX2 versions of the 24/32 bits/pixel TrueColor converters
+  (the rgb888*, bgr888* and rgb24* banks in pixbuf.c), and of the
+  BGRX -> YCbCr 4:2:0 kernel behind the raw JPEG feed in g_save.c.
+
+  Every kernel produces exactly the same bytes as its scalar reference;
+  pixels that do not fill a whole vector are done the scalar way.
+*/
+#include "g_private.h"
+
+/*
+  BGRX -> YCbCr 4:2:0 for the raw JPEG feed, with the jccolor.c constants
+  (16 bit fractions) and the h2v2 averaging of jcsample.c, so libjpeg
+  gets the same planes it would have made from packed RGB
+*/
+#define YCC_SHIFT	16
+#define YCC_HALF	(1 << (YCC_SHIFT - 1))
+#define YCC_CBCR_OFF	((128 << YCC_SHIFT) + YCC_HALF - 1)
+#define YCC_Y_R		19595	/* 0.29900 */
+#define YCC_Y_G		38470	/* 0.58700 */
+#define YCC_Y_B		7471	/* 0.11400 */
+#define YCC_CB_R	-11059	/* -0.16874 */
+#define YCC_CB_G	-21709	/* -0.33126 */
+#define YCC_CR_G	-27439	/* -0.41869 */
+#define YCC_CR_B	-5329	/* -0.08131 */
+/* Cb of B and Cr of R are 0.5, a shift by 15 */
+
+/* columns x .. 2 * c_cols - 1, past width the last pixel repeats */
+static void ycc420_tail (const unsigned char *s0, const unsigned char *s1, int width, unsigned char *y0, unsigned char *y1, unsigned char *cb, unsigned char *cr, int x, int c_cols)
+{
+	const unsigned char *p[4];
+	int i, r, g, b, sum_cb, sum_cr, x0, x1;
+
+	for (; x < 2 * c_cols; x += 2) {
+		x0 = x < width ? x : width - 1;
+		x1 = x + 1 < width ? x + 1 : width - 1;
+		p[0] = s0 + x0 * 4;
+		p[1] = s0 + x1 * 4;
+		p[2] = s1 + x0 * 4;
+		p[3] = s1 + x1 * 4;
+		sum_cb = sum_cr = 0;
+		for (i = 0; i < 4; i++) {
+			r = p[i][2];
+			g = p[i][1];
+			b = p[i][0];
+			(i < 2 ? y0 : y1)[x + (i & 1)] = (YCC_Y_R * r + YCC_Y_G * g + YCC_Y_B * b + YCC_HALF) >> YCC_SHIFT;
+			sum_cb += (YCC_CB_R * r + YCC_CB_G * g + (b << 15) + YCC_CBCR_OFF) >> YCC_SHIFT;
+			sum_cr += ((r << 15) + YCC_CR_G * g + YCC_CR_B * b + YCC_CBCR_OFF) >> YCC_SHIFT;
+		}
+		/* jcsample.c rounds with a bias of 1, 2, 1, 2 ... */
+		cb[x / 2] = (sum_cb + 1 + ((x >> 1) & 1)) >> 2;
+		cr[x / 2] = (sum_cr + 1 + ((x >> 1) & 1)) >> 2;
+	}
+}
+
+static void ycc420_c (const unsigned char *s0, const unsigned char *s1, int width, unsigned char *y0, unsigned char *y1, unsigned char *cb, unsigned char *cr, int c_cols)
+{
+	ycc420_tail (s0, s1, width, y0, y1, cb, cr, 0, c_cols);
+}
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <immintrin.h>
+
+#define HAVE_X86_SIMD
+
+/* pshufb masks, 0x80 clears the byte */
+#define LSB_RGB_MASK	2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, 0x80, 0x80, 0x80, 0x80
+#define MSB_RGB_MASK	1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, 0x80, 0x80, 0x80, 0x80
+#define LSB_RGBA_MASK	2, 1, 0, 0x80, 6, 5, 4, 0x80, 10, 9, 8, 0x80, 14, 13, 12, 0x80
+#define MSB_RGBA_MASK	1, 2, 3, 0x80, 5, 6, 7, 0x80, 9, 10, 11, 0x80, 13, 14, 15, 0x80
+#define LSB_BGR_MASK	0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 0x80, 0x80, 0x80, 0x80
+#define MSB_BGR_MASK	3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, 0x80, 0x80, 0x80, 0x80
+#define LSB_BGRA_MASK	0, 1, 2, 0x80, 4, 5, 6, 0x80, 8, 9, 10, 0x80, 12, 13, 14, 0x80
+#define MSB_BGRA_MASK	3, 2, 1, 0x80, 7, 6, 5, 0x80, 11, 10, 9, 0x80, 15, 14, 13, 0x80
+/* packed 24 bits/pixel, 4 pixels in the low 12 bytes */
+#define SWAP24_MASK	2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 0x80, 0x80, 0x80, 0x80
+#define SWAP24A_MASK	2, 1, 0, 0x80, 5, 4, 3, 0x80, 8, 7, 6, 0x80, 11, 10, 9, 0x80
+#define COPY24A_MASK	0, 1, 2, 0x80, 3, 4, 5, 0x80, 6, 7, 8, 0x80, 9, 10, 11, 0x80
+
+/* scalar tails, same as the reference converters */
+static inline void tail_lsb (const unsigned char *s, unsigned char *o, int n)
+{
+	for (; n > 0; n--, s += 4) {
+		*o++ = s[2];
+		*o++ = s[1];
+		*o++ = s[0];
+	}
+}
+
+static inline void tail_msb (const unsigned char *s, unsigned char *o, int n)
+{
+	for (; n > 0; n--, s += 4) {
+		*o++ = s[1];
+		*o++ = s[2];
+		*o++ = s[3];
+	}
+}
+
+static inline void tail_alsb (const unsigned char *s, unsigned char *o, int n)
+{
+	for (; n > 0; n--, s += 4) {
+		*o++ = s[2];
+		*o++ = s[1];
+		*o++ = s[0];
+		*o++ = 0xff;
+	}
+}
+
+static inline void tail_amsb (const unsigned char *s, unsigned char *o, int n)
+{
+	for (; n > 0; n--, s += 4) {
+		*o++ = s[1];
+		*o++ = s[2];
+		*o++ = s[3];
+		*o++ = 0xff;
+	}
+}
+
+/* any other byte order; step is 3 or 4 source bytes per pixel */
+static inline void tail_any (const unsigned char *s, unsigned char *o, int n, int step, int r, int g, int b, int alpha)
+{
+	for (; n > 0; n--, s += step) {
+		*o++ = s[r];
+		*o++ = s[g];
+		*o++ = s[b];
+		if (alpha)
+			*o++ = 0xff;
+	}
+}
+
+/*
+  four registers holding 12 valid bytes each (top 4 zero) -> 48 packed bytes
+*/
+#define STORE_4x12(o, a, b, c, d) do { \
+	_mm_storeu_si128 ((__m128i *)(o), _mm_or_si128 ((a), _mm_slli_si128 ((b), 12))); \
+	_mm_storeu_si128 ((__m128i *)((o) + 16), _mm_or_si128 (_mm_srli_si128 ((b), 4), _mm_slli_si128 ((c), 8))); \
+	_mm_storeu_si128 ((__m128i *)((o) + 32), _mm_or_si128 (_mm_srli_si128 ((c), 8), _mm_slli_si128 ((d), 4))); \
+} while (0)
+
+/* ---------------------------------------------------------------- SSE2 */
+
+/* 0x00BBGGRR in every dword -> 12 packed R,G,B bytes */
+__attribute__((target("sse2")))
+static inline __m128i sse2_pack_rgb (__m128i v)
+{
+	const __m128i even = _mm_set_epi32 (0, 0x00ffffff, 0, 0x00ffffff);
+	const __m128i odd = _mm_set_epi32 (0x00ffffff, 0, 0x00ffffff, 0);
+	const __m128i lo64 = _mm_set_epi32 (0, 0, -1, -1);
+
+	/* two pixels per 64 bit lane, 6 bytes each */
+	v = _mm_or_si128 (_mm_and_si128 (v, even), _mm_srli_epi64 (_mm_and_si128 (v, odd), 8));
+	/* close the 2 byte gap between the lanes */
+	return _mm_or_si128 (_mm_and_si128 (v, lo64), _mm_srli_si128 (_mm_andnot_si128 (lo64, v), 2));
+}
+
+/* BGRX as little endian dwords (0xXXRRGGBB) -> 0x00BBGGRR */
+__attribute__((target("sse2")))
+static inline __m128i sse2_swap_rb (__m128i v)
+{
+	const __m128i g = _mm_set1_epi32 (0x0000ff00);
+	const __m128i b = _mm_set1_epi32 (0x000000ff);
+
+	return _mm_or_si128 (_mm_or_si128 (_mm_and_si128 (_mm_srli_epi32 (v, 16), b), _mm_and_si128 (v, g)),
+			     _mm_slli_epi32 (_mm_and_si128 (v, b), 16));
+}
+
+__attribute__((target("sse2")))
+static void row_lsb_sse2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int xx;
+
+	for (xx = 0; xx + 16 <= width; xx += 16, s += 64, o += 48) {
+		__m128i a = sse2_pack_rgb (sse2_swap_rb (_mm_loadu_si128 ((const __m128i *)s)));
+		__m128i b = sse2_pack_rgb (sse2_swap_rb (_mm_loadu_si128 ((const __m128i *)(s + 16))));
+		__m128i c = sse2_pack_rgb (sse2_swap_rb (_mm_loadu_si128 ((const __m128i *)(s + 32))));
+		__m128i d = sse2_pack_rgb (sse2_swap_rb (_mm_loadu_si128 ((const __m128i *)(s + 48))));
+		STORE_4x12 (o, a, b, c, d);
+	}
+	tail_lsb (s, o, width - xx);
+}
+
+__attribute__((target("sse2")))
+static void row_msb_sse2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int xx;
+
+	/* X,R,G,B bytes are 0xBBGGRRXX dwords, one shift gives 0x00BBGGRR */
+	for (xx = 0; xx + 16 <= width; xx += 16, s += 64, o += 48) {
+		__m128i a = sse2_pack_rgb (_mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *)s), 8));
+		__m128i b = sse2_pack_rgb (_mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *)(s + 16)), 8));
+		__m128i c = sse2_pack_rgb (_mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *)(s + 32)), 8));
+		__m128i d = sse2_pack_rgb (_mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *)(s + 48)), 8));
+		STORE_4x12 (o, a, b, c, d);
+	}
+	tail_msb (s, o, width - xx);
+}
+
+__attribute__((target("sse2")))
+static void row_alsb_sse2 (const unsigned char *s, unsigned char *o, int width)
+{
+	const __m128i alpha = _mm_set1_epi32 (0xff000000);
+	int xx;
+
+	for (xx = 0; xx + 4 <= width; xx += 4, s += 16, o += 16)
+		_mm_storeu_si128 ((__m128i *)o, _mm_or_si128 (sse2_swap_rb (_mm_loadu_si128 ((const __m128i *)s)), alpha));
+	tail_alsb (s, o, width - xx);
+}
+
+__attribute__((target("sse2")))
+static void row_amsb_sse2 (const unsigned char *s, unsigned char *o, int width)
+{
+	const __m128i alpha = _mm_set1_epi32 (0xff000000);
+	int xx;
+
+	for (xx = 0; xx + 4 <= width; xx += 4, s += 16, o += 16)
+		_mm_storeu_si128 ((__m128i *)o, _mm_or_si128 (_mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *)s), 8), alpha));
+	tail_amsb (s, o, width - xx);
+}
+
+/* R,G,B,X bytes are 0xXXBBGGRR dwords already */
+__attribute__((target("sse2")))
+static void row_bgr_lsb_sse2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int xx;
+
+	for (xx = 0; xx + 16 <= width; xx += 16, s += 64, o += 48) {
+		__m128i a = sse2_pack_rgb (_mm_loadu_si128 ((const __m128i *)s));
+		__m128i b = sse2_pack_rgb (_mm_loadu_si128 ((const __m128i *)(s + 16)));
+		__m128i c = sse2_pack_rgb (_mm_loadu_si128 ((const __m128i *)(s + 32)));
+		__m128i d = sse2_pack_rgb (_mm_loadu_si128 ((const __m128i *)(s + 48)));
+		STORE_4x12 (o, a, b, c, d);
+	}
+	tail_any (s, o, width - xx, 4, 0, 1, 2, 0);
+}
+
+/* X,B,G,R bytes: shift down to 0x00RRGGBB, then swap */
+__attribute__((target("sse2")))
+static void row_bgr_msb_sse2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int xx;
+
+	for (xx = 0; xx + 16 <= width; xx += 16, s += 64, o += 48) {
+		__m128i a = sse2_pack_rgb (sse2_swap_rb (_mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *)s), 8)));
+		__m128i b = sse2_pack_rgb (sse2_swap_rb (_mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *)(s + 16)), 8)));
+		__m128i c = sse2_pack_rgb (sse2_swap_rb (_mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *)(s + 32)), 8)));
+		__m128i d = sse2_pack_rgb (sse2_swap_rb (_mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *)(s + 48)), 8)));
+		STORE_4x12 (o, a, b, c, d);
+	}
+	tail_any (s, o, width - xx, 4, 3, 2, 1, 0);
+}
+
+__attribute__((target("sse2")))
+static void row_bgr_alsb_sse2 (const unsigned char *s, unsigned char *o, int width)
+{
+	const __m128i alpha = _mm_set1_epi32 (0xff000000);
+	int xx;
+
+	for (xx = 0; xx + 4 <= width; xx += 4, s += 16, o += 16)
+		_mm_storeu_si128 ((__m128i *)o, _mm_or_si128 (_mm_loadu_si128 ((const __m128i *)s), alpha));
+	tail_any (s, o, width - xx, 4, 0, 1, 2, 1);
+}
+
+__attribute__((target("sse2")))
+static void row_bgr_amsb_sse2 (const unsigned char *s, unsigned char *o, int width)
+{
+	const __m128i alpha = _mm_set1_epi32 (0xff000000);
+	int xx;
+
+	for (xx = 0; xx + 4 <= width; xx += 4, s += 16, o += 16)
+		_mm_storeu_si128 ((__m128i *)o, _mm_or_si128 (sse2_swap_rb (_mm_srli_epi32 (_mm_loadu_si128 ((const __m128i *)s), 8)), alpha));
+	tail_any (s, o, width - xx, 4, 3, 2, 1, 1);
+}
+
+/* --------------------------------------------------------------- SSSE3 */
+
+__attribute__((target("ssse3")))
+static inline void ssse3_rgb (const unsigned char *s, unsigned char *o, int width, __m128i mask)
+{
+	int xx;
+
+	for (xx = 0; xx + 16 <= width; xx += 16, s += 64, o += 48) {
+		__m128i a = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)s), mask);
+		__m128i b = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(s + 16)), mask);
+		__m128i c = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(s + 32)), mask);
+		__m128i d = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(s + 48)), mask);
+		STORE_4x12 (o, a, b, c, d);
+	}
+}
+
+__attribute__((target("ssse3")))
+static inline void ssse3_rgba (const unsigned char *s, unsigned char *o, int width, __m128i mask)
+{
+	const __m128i alpha = _mm_set1_epi32 (0xff000000);
+	int xx;
+
+	for (xx = 0; xx + 4 <= width; xx += 4, s += 16, o += 16)
+		_mm_storeu_si128 ((__m128i *)o, _mm_or_si128 (_mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)s), mask), alpha));
+}
+
+__attribute__((target("ssse3")))
+static void row_lsb_ssse3 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~15;
+
+	ssse3_rgb (s, o, width, _mm_setr_epi8 (LSB_RGB_MASK));
+	tail_lsb (s + n * 4, o + n * 3, width - n);
+}
+
+__attribute__((target("ssse3")))
+static void row_msb_ssse3 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~15;
+
+	ssse3_rgb (s, o, width, _mm_setr_epi8 (MSB_RGB_MASK));
+	tail_msb (s + n * 4, o + n * 3, width - n);
+}
+
+__attribute__((target("ssse3")))
+static void row_alsb_ssse3 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~3;
+
+	ssse3_rgba (s, o, width, _mm_setr_epi8 (LSB_RGBA_MASK));
+	tail_alsb (s + n * 4, o + n * 4, width - n);
+}
+
+__attribute__((target("ssse3")))
+static void row_amsb_ssse3 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~3;
+
+	ssse3_rgba (s, o, width, _mm_setr_epi8 (MSB_RGBA_MASK));
+	tail_amsb (s + n * 4, o + n * 4, width - n);
+}
+
+__attribute__((target("ssse3")))
+static void row_bgr_lsb_ssse3 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~15;
+
+	ssse3_rgb (s, o, width, _mm_setr_epi8 (LSB_BGR_MASK));
+	tail_any (s + n * 4, o + n * 3, width - n, 4, 0, 1, 2, 0);
+}
+
+__attribute__((target("ssse3")))
+static void row_bgr_msb_ssse3 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~15;
+
+	ssse3_rgb (s, o, width, _mm_setr_epi8 (MSB_BGR_MASK));
+	tail_any (s + n * 4, o + n * 3, width - n, 4, 3, 2, 1, 0);
+}
+
+__attribute__((target("ssse3")))
+static void row_bgr_alsb_ssse3 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~3;
+
+	ssse3_rgba (s, o, width, _mm_setr_epi8 (LSB_BGRA_MASK));
+	tail_any (s + n * 4, o + n * 4, width - n, 4, 0, 1, 2, 1);
+}
+
+__attribute__((target("ssse3")))
+static void row_bgr_amsb_ssse3 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~3;
+
+	ssse3_rgba (s, o, width, _mm_setr_epi8 (MSB_BGRA_MASK));
+	tail_any (s + n * 4, o + n * 4, width - n, 4, 3, 2, 1, 1);
+}
+
+/*
+  packed 24 bit rows: every 16 byte load covers 4 pixels plus 4 bytes of
+  the next one, so the loops stop while a full load still fits in the row
+*/
+__attribute__((target("ssse3")))
+static void row_24swap_ssse3 (const unsigned char *s, unsigned char *o, int width)
+{
+	const __m128i mask = _mm_setr_epi8 (SWAP24_MASK);
+	int xx;
+
+	for (xx = 0; xx + 18 <= width; xx += 16, s += 48, o += 48) {
+		__m128i a = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)s), mask);
+		__m128i b = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(s + 12)), mask);
+		__m128i c = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(s + 24)), mask);
+		__m128i d = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)(s + 36)), mask);
+		STORE_4x12 (o, a, b, c, d);
+	}
+	tail_any (s, o, width - xx, 3, 2, 1, 0, 0);
+}
+
+__attribute__((target("ssse3")))
+static inline int ssse3_24a (const unsigned char *s, unsigned char *o, int width, __m128i mask)
+{
+	const __m128i alpha = _mm_set1_epi32 (0xff000000);
+	int xx;
+
+	for (xx = 0; xx + 6 <= width; xx += 4, s += 12, o += 16)
+		_mm_storeu_si128 ((__m128i *)o, _mm_or_si128 (_mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *)s), mask), alpha));
+	return xx;
+}
+
+__attribute__((target("ssse3")))
+static void row_24aswap_ssse3 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = ssse3_24a (s, o, width, _mm_setr_epi8 (SWAP24A_MASK));
+
+	tail_any (s + n * 3, o + n * 4, width - n, 3, 2, 1, 0, 1);
+}
+
+__attribute__((target("ssse3")))
+static void row_24acopy_ssse3 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = ssse3_24a (s, o, width, _mm_setr_epi8 (COPY24A_MASK));
+
+	tail_any (s + n * 3, o + n * 4, width - n, 3, 0, 1, 2, 1);
+}
+
+/* ---------------------------------------------------------------- AVX2 */
+
+__attribute__((target("avx2")))
+static inline void avx2_rgb (const unsigned char *s, unsigned char *o, int width, __m256i mask)
+{
+	/* pull the 12 valid bytes of both lanes together */
+	const __m256i pack = _mm256_setr_epi32 (0, 1, 2, 4, 5, 6, 3, 7);
+	int xx;
+
+	for (xx = 0; xx + 8 <= width; xx += 8, s += 32, o += 24) {
+		__m256i v = _mm256_shuffle_epi8 (_mm256_loadu_si256 ((const __m256i *)s), mask);
+		v = _mm256_permutevar8x32_epi32 (v, pack);
+		_mm_storeu_si128 ((__m128i *)o, _mm256_castsi256_si128 (v));
+		_mm_storel_epi64 ((__m128i *)(o + 16), _mm256_extracti128_si256 (v, 1));
+	}
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_rgba (const unsigned char *s, unsigned char *o, int width, __m256i mask)
+{
+	const __m256i alpha = _mm256_set1_epi32 (0xff000000);
+	int xx;
+
+	for (xx = 0; xx + 8 <= width; xx += 8, s += 32, o += 32)
+		_mm256_storeu_si256 ((__m256i *)o, _mm256_or_si256 (_mm256_shuffle_epi8 (_mm256_loadu_si256 ((const __m256i *)s), mask), alpha));
+}
+
+__attribute__((target("avx2")))
+static void row_lsb_avx2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~7;
+
+	avx2_rgb (s, o, width, _mm256_setr_epi8 (LSB_RGB_MASK, LSB_RGB_MASK));
+	tail_lsb (s + n * 4, o + n * 3, width - n);
+}
+
+__attribute__((target("avx2")))
+static void row_msb_avx2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~7;
+
+	avx2_rgb (s, o, width, _mm256_setr_epi8 (MSB_RGB_MASK, MSB_RGB_MASK));
+	tail_msb (s + n * 4, o + n * 3, width - n);
+}
+
+__attribute__((target("avx2")))
+static void row_alsb_avx2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~7;
+
+	avx2_rgba (s, o, width, _mm256_setr_epi8 (LSB_RGBA_MASK, LSB_RGBA_MASK));
+	tail_alsb (s + n * 4, o + n * 4, width - n);
+}
+
+__attribute__((target("avx2")))
+static void row_amsb_avx2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~7;
+
+	avx2_rgba (s, o, width, _mm256_setr_epi8 (MSB_RGBA_MASK, MSB_RGBA_MASK));
+	tail_amsb (s + n * 4, o + n * 4, width - n);
+}
+
+__attribute__((target("avx2")))
+static void row_bgr_lsb_avx2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~7;
+
+	avx2_rgb (s, o, width, _mm256_setr_epi8 (LSB_BGR_MASK, LSB_BGR_MASK));
+	tail_any (s + n * 4, o + n * 3, width - n, 4, 0, 1, 2, 0);
+}
+
+__attribute__((target("avx2")))
+static void row_bgr_msb_avx2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~7;
+
+	avx2_rgb (s, o, width, _mm256_setr_epi8 (MSB_BGR_MASK, MSB_BGR_MASK));
+	tail_any (s + n * 4, o + n * 3, width - n, 4, 3, 2, 1, 0);
+}
+
+__attribute__((target("avx2")))
+static void row_bgr_alsb_avx2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~7;
+
+	avx2_rgba (s, o, width, _mm256_setr_epi8 (LSB_BGRA_MASK, LSB_BGRA_MASK));
+	tail_any (s + n * 4, o + n * 4, width - n, 4, 0, 1, 2, 1);
+}
+
+__attribute__((target("avx2")))
+static void row_bgr_amsb_avx2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = width & ~7;
+
+	avx2_rgba (s, o, width, _mm256_setr_epi8 (MSB_BGRA_MASK, MSB_BGRA_MASK));
+	tail_any (s + n * 4, o + n * 4, width - n, 4, 3, 2, 1, 1);
+}
+
+/* 8 packed pixels, 4 in each lane; reads 28 bytes */
+__attribute__((target("avx2")))
+static inline __m256i avx2_load24 (const unsigned char *s)
+{
+	return _mm256_inserti128_si256 (_mm256_castsi128_si256 (_mm_loadu_si128 ((const __m128i *)s)),
+					_mm_loadu_si128 ((const __m128i *)(s + 12)), 1);
+}
+
+__attribute__((target("avx2")))
+static void row_24swap_avx2 (const unsigned char *s, unsigned char *o, int width)
+{
+	const __m256i mask = _mm256_setr_epi8 (SWAP24_MASK, SWAP24_MASK);
+	const __m256i pack = _mm256_setr_epi32 (0, 1, 2, 4, 5, 6, 3, 7);
+	int xx;
+
+	for (xx = 0; xx + 10 <= width; xx += 8, s += 24, o += 24) {
+		__m256i v = _mm256_permutevar8x32_epi32 (_mm256_shuffle_epi8 (avx2_load24 (s), mask), pack);
+		_mm_storeu_si128 ((__m128i *)o, _mm256_castsi256_si128 (v));
+		_mm_storel_epi64 ((__m128i *)(o + 16), _mm256_extracti128_si256 (v, 1));
+	}
+	tail_any (s, o, width - xx, 3, 2, 1, 0, 0);
+}
+
+__attribute__((target("avx2")))
+static inline int avx2_24a (const unsigned char *s, unsigned char *o, int width, __m256i mask)
+{
+	const __m256i alpha = _mm256_set1_epi32 (0xff000000);
+	int xx;
+
+	for (xx = 0; xx + 10 <= width; xx += 8, s += 24, o += 32)
+		_mm256_storeu_si256 ((__m256i *)o, _mm256_or_si256 (_mm256_shuffle_epi8 (avx2_load24 (s), mask), alpha));
+	return xx;
+}
+
+__attribute__((target("avx2")))
+static void row_24aswap_avx2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = avx2_24a (s, o, width, _mm256_setr_epi8 (SWAP24A_MASK, SWAP24A_MASK));
+
+	tail_any (s + n * 3, o + n * 4, width - n, 3, 2, 1, 0, 1);
+}
+
+__attribute__((target("avx2")))
+static void row_24acopy_avx2 (const unsigned char *s, unsigned char *o, int width)
+{
+	int n = avx2_24a (s, o, width, _mm256_setr_epi8 (COPY24A_MASK, COPY24A_MASK));
+
+	tail_any (s + n * 3, o + n * 4, width - n, 3, 0, 1, 2, 1);
+}
+
+/* ------------------------------------------------------------ YCbCr 4:2:0 */
+
+/* two 16 bit coefficients for pmaddwd, lo pairs with the low word */
+#define YCC_PAIR(lo, hi)	((int)(((unsigned int)(hi) << 16) | ((lo) & 0xffff)))
+
+/*
+  4 BGRX pixels -> Y, Cb, Cr as dwords. G sits in the high word of both
+  R,G and B,G, and its 38470 for Y, too big for a signed word, is split
+  into 22086 + 16384 across them
+*/
+__attribute__((target("sse2")))
+static inline void ycc4_sse2 (__m128i p, __m128i *y, __m128i *cb, __m128i *cr)
+{
+	const __m128i lo = _mm_set1_epi32 (0xff);
+	__m128i b = _mm_and_si128 (p, lo);
+	__m128i r = _mm_and_si128 (_mm_srli_epi32 (p, 16), lo);
+	__m128i g = _mm_slli_epi32 (_mm_and_si128 (p, _mm_set1_epi32 (0xff00)), 8);
+	__m128i rg = _mm_or_si128 (r, g), bg = _mm_or_si128 (b, g);
+	const __m128i off = _mm_set1_epi32 (YCC_CBCR_OFF);
+
+	*y = _mm_add_epi32 (_mm_madd_epi16 (rg, _mm_set1_epi32 (YCC_PAIR (YCC_Y_R, YCC_Y_G - 16384))),
+			    _mm_madd_epi16 (bg, _mm_set1_epi32 (YCC_PAIR (YCC_Y_B, 16384))));
+	*y = _mm_srli_epi32 (_mm_add_epi32 (*y, _mm_set1_epi32 (YCC_HALF)), YCC_SHIFT);
+	*cb = _mm_add_epi32 (_mm_madd_epi16 (rg, _mm_set1_epi32 (YCC_PAIR (YCC_CB_R, YCC_CB_G))), _mm_slli_epi32 (b, 15));
+	*cb = _mm_srli_epi32 (_mm_add_epi32 (*cb, off), YCC_SHIFT);
+	*cr = _mm_add_epi32 (_mm_madd_epi16 (bg, _mm_set1_epi32 (YCC_PAIR (YCC_CR_B, YCC_CR_G))), _mm_slli_epi32 (r, 15));
+	*cr = _mm_srli_epi32 (_mm_add_epi32 (*cr, off), YCC_SHIFT);
+}
+
+/* 16 pixels of one row: Y stored, Cb and Cr as words of pixels 0-7, 8-15 */
+__attribute__((target("sse2")))
+static inline void ycc16_sse2 (const unsigned char *s, unsigned char *yo, __m128i *cb, __m128i *cr)
+{
+	__m128i y[4], u[4], v[4];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		ycc4_sse2 (_mm_loadu_si128 ((const __m128i *)(s + i * 16)), &y[i], &u[i], &v[i]);
+	_mm_storeu_si128 ((__m128i *)yo, _mm_packus_epi16 (_mm_packs_epi32 (y[0], y[1]), _mm_packs_epi32 (y[2], y[3])));
+	cb[0] = _mm_packs_epi32 (u[0], u[1]);
+	cb[1] = _mm_packs_epi32 (u[2], u[3]);
+	cr[0] = _mm_packs_epi32 (v[0], v[1]);
+	cr[1] = _mm_packs_epi32 (v[2], v[3]);
+}
+
+/* 2x2 sums of two rows of 8 words, rounded like jcsample.c -> 4 dwords */
+__attribute__((target("sse2")))
+static inline __m128i ycc_down_sse2 (__m128i a, __m128i b)
+{
+	const __m128i bias = _mm_set_epi32 (2, 1, 2, 1);
+
+	return _mm_srli_epi32 (_mm_add_epi32 (_mm_madd_epi16 (_mm_add_epi16 (a, b), _mm_set1_epi16 (1)), bias), 2);
+}
+
+__attribute__((target("sse2")))
+static void ycc420_sse2 (const unsigned char *s0, const unsigned char *s1, int width, unsigned char *y0, unsigned char *y1, unsigned char *cb, unsigned char *cr, int c_cols)
+{
+	__m128i u0[2], v0[2], u1[2], v1[2], c;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		ycc16_sse2 (s0 + x * 4, y0 + x, u0, v0);
+		ycc16_sse2 (s1 + x * 4, y1 + x, u1, v1);
+		c = _mm_packs_epi32 (ycc_down_sse2 (u0[0], u1[0]), ycc_down_sse2 (u0[1], u1[1]));
+		_mm_storel_epi64 ((__m128i *)(cb + x / 2), _mm_packus_epi16 (c, c));
+		c = _mm_packs_epi32 (ycc_down_sse2 (v0[0], v1[0]), ycc_down_sse2 (v0[1], v1[1]));
+		_mm_storel_epi64 ((__m128i *)(cr + x / 2), _mm_packus_epi16 (c, c));
+	}
+	ycc420_tail (s0, s1, width, y0, y1, cb, cr, x, c_cols);
+}
+
+/* same as ycc4_sse2 on 8 pixels, with pshufb making the word pairs */
+__attribute__((target("avx2")))
+static inline void ycc8_avx2 (__m256i p, __m256i *y, __m256i *cb, __m256i *cr)
+{
+	const __m256i rg_mask = _mm256_setr_epi8 (2, 0x80, 1, 0x80, 6, 0x80, 5, 0x80, 10, 0x80, 9, 0x80, 14, 0x80, 13, 0x80,
+						  2, 0x80, 1, 0x80, 6, 0x80, 5, 0x80, 10, 0x80, 9, 0x80, 14, 0x80, 13, 0x80);
+	const __m256i bg_mask = _mm256_setr_epi8 (0, 0x80, 1, 0x80, 4, 0x80, 5, 0x80, 8, 0x80, 9, 0x80, 12, 0x80, 13, 0x80,
+						  0, 0x80, 1, 0x80, 4, 0x80, 5, 0x80, 8, 0x80, 9, 0x80, 12, 0x80, 13, 0x80);
+	__m256i rg = _mm256_shuffle_epi8 (p, rg_mask), bg = _mm256_shuffle_epi8 (p, bg_mask);
+	const __m256i off = _mm256_set1_epi32 (YCC_CBCR_OFF);
+
+	*y = _mm256_add_epi32 (_mm256_madd_epi16 (rg, _mm256_set1_epi32 (YCC_PAIR (YCC_Y_R, YCC_Y_G - 16384))),
+			       _mm256_madd_epi16 (bg, _mm256_set1_epi32 (YCC_PAIR (YCC_Y_B, 16384))));
+	*y = _mm256_srli_epi32 (_mm256_add_epi32 (*y, _mm256_set1_epi32 (YCC_HALF)), YCC_SHIFT);
+	/* the low word of a pair shifted up by 15 is 0.5 of it */
+	*cb = _mm256_add_epi32 (_mm256_madd_epi16 (rg, _mm256_set1_epi32 (YCC_PAIR (YCC_CB_R, YCC_CB_G))),
+				_mm256_srli_epi32 (_mm256_slli_epi32 (bg, 16), 1));
+	*cb = _mm256_srli_epi32 (_mm256_add_epi32 (*cb, off), YCC_SHIFT);
+	*cr = _mm256_add_epi32 (_mm256_madd_epi16 (bg, _mm256_set1_epi32 (YCC_PAIR (YCC_CR_B, YCC_CR_G))),
+				_mm256_srli_epi32 (_mm256_slli_epi32 (rg, 16), 1));
+	*cr = _mm256_srli_epi32 (_mm256_add_epi32 (*cr, off), YCC_SHIFT);
+}
+
+/* dwords of pixels 0-7 and 8-15 -> 16 words in pixel order */
+__attribute__((target("avx2")))
+static inline __m256i ycc_pack_avx2 (__m256i a, __m256i b)
+{
+	return _mm256_permute4x64_epi64 (_mm256_packs_epi32 (a, b), 0xd8);
+}
+
+/* 16 pixels of one row: Y stored, Cb and Cr as 16 words */
+__attribute__((target("avx2")))
+static inline void ycc16_avx2 (const unsigned char *s, unsigned char *yo, __m256i *cb, __m256i *cr)
+{
+	__m256i ya, yb, ua, ub, va, vb, y;
+
+	ycc8_avx2 (_mm256_loadu_si256 ((const __m256i *)s), &ya, &ua, &va);
+	ycc8_avx2 (_mm256_loadu_si256 ((const __m256i *)(s + 32)), &yb, &ub, &vb);
+	y = ycc_pack_avx2 (ya, yb);
+	_mm_storeu_si128 ((__m128i *)yo, _mm_packus_epi16 (_mm256_castsi256_si128 (y), _mm256_extracti128_si256 (y, 1)));
+	*cb = ycc_pack_avx2 (ua, ub);
+	*cr = ycc_pack_avx2 (va, vb);
+}
+
+/* 2x2 sums of two rows of 16 words, rounded -> 8 bytes */
+__attribute__((target("avx2")))
+static inline void ycc_down_avx2 (__m256i a, __m256i b, unsigned char *o)
+{
+	const __m256i bias = _mm256_set_epi32 (2, 1, 2, 1, 2, 1, 2, 1);
+	__m256i s = _mm256_srli_epi32 (_mm256_add_epi32 (_mm256_madd_epi16 (_mm256_add_epi16 (a, b), _mm256_set1_epi16 (1)), bias), 2);
+	__m128i c = _mm_packs_epi32 (_mm256_castsi256_si128 (s), _mm256_extracti128_si256 (s, 1));
+
+	_mm_storel_epi64 ((__m128i *)o, _mm_packus_epi16 (c, c));
+}
+
+__attribute__((target("avx2")))
+static void ycc420_avx2 (const unsigned char *s0, const unsigned char *s1, int width, unsigned char *y0, unsigned char *y1, unsigned char *cb, unsigned char *cr, int c_cols)
+{
+	__m256i u0, v0, u1, v1;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		ycc16_avx2 (s0 + x * 4, y0 + x, &u0, &v0);
+		ycc16_avx2 (s1 + x * 4, y1 + x, &u1, &v1);
+		ycc_down_avx2 (u0, u1, cb + x / 2);
+		ycc_down_avx2 (v0, v1, cr + x / 2);
+	}
+	ycc420_tail (s0, s1, width, y0, y1, cb, cr, x, c_cols);
+}
+
+/* ------------------------------------------------------------- wrappers */
+
+#define CONVERTER(name, rowfn) \
+static void name (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap) \
+{ \
+	unsigned char *srow = (unsigned char *)image->data, *orow = pixels; \
+	int yy; \
+\
+	for (yy = 0; yy < image->height; yy++) { \
+		rowfn (srow, orow, image->width); \
+		srow += image->bytes_per_line; \
+		orow += rowstride; \
+	} \
+}
+
+CONVERTER (rgb888lsb_sse2, row_lsb_sse2)
+CONVERTER (rgb888msb_sse2, row_msb_sse2)
+CONVERTER (rgb888alsb_sse2, row_alsb_sse2)
+CONVERTER (rgb888amsb_sse2, row_amsb_sse2)
+CONVERTER (rgb888lsb_ssse3, row_lsb_ssse3)
+CONVERTER (rgb888msb_ssse3, row_msb_ssse3)
+CONVERTER (rgb888alsb_ssse3, row_alsb_ssse3)
+CONVERTER (rgb888amsb_ssse3, row_amsb_ssse3)
+CONVERTER (rgb888lsb_avx2, row_lsb_avx2)
+CONVERTER (rgb888msb_avx2, row_msb_avx2)
+CONVERTER (rgb888alsb_avx2, row_alsb_avx2)
+CONVERTER (rgb888amsb_avx2, row_amsb_avx2)
+CONVERTER (bgr888lsb_sse2, row_bgr_lsb_sse2)
+CONVERTER (bgr888msb_sse2, row_bgr_msb_sse2)
+CONVERTER (bgr888alsb_sse2, row_bgr_alsb_sse2)
+CONVERTER (bgr888amsb_sse2, row_bgr_amsb_sse2)
+CONVERTER (bgr888lsb_ssse3, row_bgr_lsb_ssse3)
+CONVERTER (bgr888msb_ssse3, row_bgr_msb_ssse3)
+CONVERTER (bgr888alsb_ssse3, row_bgr_alsb_ssse3)
+CONVERTER (bgr888amsb_ssse3, row_bgr_amsb_ssse3)
+CONVERTER (bgr888lsb_avx2, row_bgr_lsb_avx2)
+CONVERTER (bgr888msb_avx2, row_bgr_msb_avx2)
+CONVERTER (bgr888alsb_avx2, row_bgr_alsb_avx2)
+CONVERTER (bgr888amsb_avx2, row_bgr_amsb_avx2)
+CONVERTER (rgb24lsb_ssse3, row_24swap_ssse3)
+CONVERTER (rgb24alsb_ssse3, row_24aswap_ssse3)
+CONVERTER (rgb24amsb_ssse3, row_24acopy_ssse3)
+CONVERTER (rgb24lsb_avx2, row_24swap_avx2)
+CONVERTER (rgb24alsb_avx2, row_24aswap_avx2)
+CONVERTER (rgb24amsb_avx2, row_24acopy_avx2)
+
+#endif /* x86 */
+
+/* best level this cpu runs, capped by XSS_SIMD=none|sse2|ssse3|avx2 */
+int _g_simd_level (void)
+{
+	int level = G_SIMD_NONE;
+	const char *env;
+
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("sse2"))
+		level = G_SIMD_SSE2;
+	if (__builtin_cpu_supports ("ssse3"))
+		level = G_SIMD_SSSE3;
+	if (__builtin_cpu_supports ("avx2"))
+		level = G_SIMD_AVX2;
+#endif
+
+	env = getenv ("XSS_SIMD");
+	if (env) {
+		int cap = G_SIMD_AVX2;
+
+		if (!strcmp (env, "none"))
+			cap = G_SIMD_NONE;
+		else if (!strcmp (env, "sse2"))
+			cap = G_SIMD_SSE2;
+		else if (!strcmp (env, "ssse3"))
+			cap = G_SIMD_SSSE3;
+		if (level > cap)
+			level = cap;
+	}
+
+	return level;
+}
+
+/*
+  fill bank[0..3] (lsb, msb, alsb, amsb) with the converters of the
+  given level; returns 0 and leaves bank alone when there are none
+*/
+int _g_rgb888_simd_bank (int level, cfunc *bank)
+{
+#ifdef HAVE_X86_SIMD
+	switch (level) {
+	case G_SIMD_AVX2:
+		bank[0] = rgb888lsb_avx2;
+		bank[1] = rgb888msb_avx2;
+		bank[2] = rgb888alsb_avx2;
+		bank[3] = rgb888amsb_avx2;
+		return 1;
+	case G_SIMD_SSSE3:
+		bank[0] = rgb888lsb_ssse3;
+		bank[1] = rgb888msb_ssse3;
+		bank[2] = rgb888alsb_ssse3;
+		bank[3] = rgb888amsb_ssse3;
+		return 1;
+	case G_SIMD_SSE2:
+		bank[0] = rgb888lsb_sse2;
+		bank[1] = rgb888msb_sse2;
+		bank[2] = rgb888alsb_sse2;
+		bank[3] = rgb888amsb_sse2;
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+/* same for the red_mask 0xff 32 bits/pixel bank */
+int _g_bgr888_simd_bank (int level, cfunc *bank)
+{
+#ifdef HAVE_X86_SIMD
+	switch (level) {
+	case G_SIMD_AVX2:
+		bank[0] = bgr888lsb_avx2;
+		bank[1] = bgr888msb_avx2;
+		bank[2] = bgr888alsb_avx2;
+		bank[3] = bgr888amsb_avx2;
+		return 1;
+	case G_SIMD_SSSE3:
+		bank[0] = bgr888lsb_ssse3;
+		bank[1] = bgr888msb_ssse3;
+		bank[2] = bgr888alsb_ssse3;
+		bank[3] = bgr888amsb_ssse3;
+		return 1;
+	case G_SIMD_SSE2:
+		bank[0] = bgr888lsb_sse2;
+		bank[1] = bgr888msb_sse2;
+		bank[2] = bgr888alsb_sse2;
+		bank[3] = bgr888amsb_sse2;
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+/*
+  packed 24 bits/pixel bank; bank[1] is a plain row copy and stays as it
+  is, and there is no SSE2 version since the byte moves need pshufb
+*/
+int _g_rgb24_simd_bank (int level, cfunc *bank)
+{
+#ifdef HAVE_X86_SIMD
+	switch (level) {
+	case G_SIMD_AVX2:
+		bank[0] = rgb24lsb_avx2;
+		bank[2] = rgb24alsb_avx2;
+		bank[3] = rgb24amsb_avx2;
+		return 1;
+	case G_SIMD_SSSE3:
+		bank[0] = rgb24lsb_ssse3;
+		bank[2] = rgb24alsb_ssse3;
+		bank[3] = rgb24amsb_ssse3;
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+/* the 4:2:0 kernel of the given level; the scalar one is always there */
+ycc420func _g_ycc420_func (int level)
+{
+#ifdef HAVE_X86_SIMD
+	if (level >= G_SIMD_AVX2)
+		return ycc420_avx2;
+	if (level >= G_SIMD_SSE2)
+		return ycc420_sse2;
+#endif
+	return ycc420_c;
+}
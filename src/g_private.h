@@ -0,0 +1,107 @@
+#ifndef _G_PRIVATE_H
+#define _G_PRIVATE_H
+#pragma once
+#include "g_pixbuf.h"
+
+/* declarations shared between the library sources; not installed */
+
+/*
+  atoms interned once per capture session; those from G_ATOM_LOOKUP_ONLY
+  on are never created on the server and are None when missing
+*/
+enum {
+	G_ATOM_MOTIF_WM_HINTS,
+	G_ATOM_NET_WM_STATE,
+	G_ATOM_NET_WM_WINDOW_TYPE,
+	G_ATOM_NET_WM_WINDOW_TYPE_DOCK,
+	G_ATOM_NET_WM_STATE_STICKY,
+	G_ATOM_LAST,
+	G_ATOM_LOOKUP_ONLY = G_ATOM_NET_WM_STATE_STICKY
+};
+
+typedef struct xlib_colormap_struct xlib_colormap;
+struct xlib_colormap_struct {
+	int size;
+	XColor *colors;
+	Visual *visual;
+	Colormap colormap;
+	/* channel tables for the generic True/DirectColor converters */
+	int shift[3];
+	unsigned int mask[3];
+	unsigned char lut[3][256];
+	/* R, G, B, 0xff of the first 256 cells, for the indexed converters */
+	unsigned char palette[256][4];
+};
+
+typedef void (* cfunc) (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *cmap);
+
+/* vector converters for the 24/32 bit TrueColor banks, see convert_simd.c */
+enum {
+	G_SIMD_NONE,
+	G_SIMD_SSE2,
+	G_SIMD_SSSE3,
+	G_SIMD_AVX2
+};
+
+int _g_simd_level (void);
+int _g_rgb888_simd_bank (int level, cfunc *bank);
+int _g_bgr888_simd_bank (int level, cfunc *bank);
+int _g_rgb24_simd_bank (int level, cfunc *bank);
+
+/*
+  the converters of the RGB888, BGR888, RGB24 and BGR24 banks (lsb, msb,
+  alsb, amsb each) at a level, G_SIMD_NONE for the plain C ones; what
+  convert_map holds, for tests/simd_parity.c
+*/
+#define G_TRUECOLOR_BANKS 16
+void _g_truecolor_banks (int level, cfunc *banks);
+
+/* what a capture does to its XImage, bands included; for bench/bench_convert.c */
+void _g_pixbuf_convert (XImage *image, unsigned char *pixels, int rowstride, int alpha, xlib_colormap *cmap);
+
+/*
+  two BGRX rows (0xXXRRGGBB dwords) -> two Y rows and one row each of Cb
+  and Cr averaged over 2x2, bit for bit what libjpeg computes; columns
+  past width repeat the last pixel up to 2 * c_cols
+*/
+typedef void (* ycc420func) (const unsigned char *row0, const unsigned char *row1, int width,
+			     unsigned char *y0, unsigned char *y1, unsigned char *cb, unsigned char *cr, int c_cols);
+
+ycc420func _g_ycc420_func (int level);
+
+Atom _g_capture_session_atom (GCaptureSession *session, int which);
+
+xlib_colormap *_g_xlib_colormap_get (Display *dpy, Colormap id, Visual *visual);
+void _g_xlib_colormap_free (xlib_colormap *xc);
+
+GPixbuf *_g_pixbuf_x_get_area (Display *dpy, Drawable src, int depth, xlib_colormap *x_cmap, int x, int y, int width, int height, GShmSegment *shm, g_capture_path *path, int native);
+int _g_pixbuf_x_update (Display *dpy, Drawable src, int depth, xlib_colormap *x_cmap, GShmSegment *shm, GPixbuf *dest, const GRect *rects, int n_rects);
+int _g_pixbuf_x_save_area (Display *dpy, Drawable src, int depth, xlib_colormap *x_cmap, int x, int y, int width, int height, GShmSegment *shm, GSaveSink *sink, g_save_type type, int band_rows);
+
+/* a FILE sink that can live on the stack, see g_sink.c */
+typedef struct {
+	GSaveSink sink;
+	FILE *fp;
+} GFileSink;
+
+void _g_file_sink_init (GFileSink *fs, FILE *fp);
+
+static inline int _g_sink_flush (GSaveSink *sink)
+{
+	return sink->flush ? sink->flush (sink) : 0;
+}
+
+/*
+  row by row encoders behind the streaming capture, see g_save.c;
+  rows are packed RGB or RGBA, or server BGRX/BGRA for JPEG and QOI
+  only, and arrive top to bottom
+*/
+#define G_SAVE_BAND_ROWS 64
+
+typedef struct _GRowWriter GRowWriter;
+
+GRowWriter *_g_row_writer_new (GSaveSink *sink, g_save_type type, int width, int height, g_pixel_format format);
+int _g_row_writer_write (GRowWriter *writer, const unsigned char *pixels, int rowstride, int n_rows);
+int _g_row_writer_finish (GRowWriter *writer);
+
+#endif
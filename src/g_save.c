@@ -1,5 +1,6 @@
-#include "g_pixbuf.h"
+#include "g_private.h"
 #include <png.h>
+#include <zlib.h>
 #ifndef png_jmpbuf					/* pngconf.h (libpng 1.0.6 or later) */
 # define png_jmpbuf(png_ptr) ((png_ptr)->jmpbuf)
 #endif
@@ -11,116 +12,1268 @@
 #include <tiffio.h>
 
 #include "list.h"
+#include "pool.h"
+#include "qoi.h"
 
-static int g_pixbuf_png_image_save(FILE *f, GPixbuf * pixbuf);
-static int g_pixbuf_jpeg_image_save(FILE * f, GPixbuf *pixbuf);
-static int g_pixbuf_bmp_image_save(FILE * f, GPixbuf *pixbuf);
-static int g_pixbuf_ico_image_save(FILE * f, GPixbuf *pixbuf);
-static int g_pixbuf_tiff_image_save(FILE * f, GPixbuf *pixbuf);
+static int g_pixbuf_png_image_save(GSaveSink *sink, GPixbuf * pixbuf, const GSaveOptions *options);
+static int g_pixbuf_jpeg_image_save(GSaveSink *sink, GPixbuf *pixbuf, const GSaveOptions *options);
+static int g_pixbuf_bmp_image_save(GSaveSink *sink, GPixbuf *pixbuf);
+static int g_pixbuf_ico_image_save(GSaveSink *sink, GPixbuf *pixbuf);
+static int g_pixbuf_tiff_image_save(GSaveSink *sink, GPixbuf *pixbuf, const GSaveOptions *options);
+static int g_pixbuf_qoi_image_save(GSaveSink *sink, GPixbuf *pixbuf);
 
 
 int g_pixbuf_save(GPixbuf *pixbuf, FILE *fp, g_save_type type)
 {
+	return g_pixbuf_save_with_options (pixbuf, fp, type, NULL);
+}
+
+void g_save_options_init (GSaveOptions *options, g_save_preset preset)
+{
+	memset (options, 0, sizeof(GSaveOptions));
+	options->jpeg.quality = 75;
+	options->jpeg.subsampling = G_JPEG_SUBSAMPLE_420;
+	options->jpeg.dct = G_JPEG_DCT_ISLOW;
+	options->png.level = -1;
+	options->png.filters = G_PNG_FILTER_ALL;
+	options->png.strategy = G_PNG_STRATEGY_AUTO;
+	options->tiff.compression = G_TIFF_COMPRESSION_NONE;
+
+	switch (preset) {
+	case G_SAVE_PRESET_FAST:
+		options->jpeg.dct = G_JPEG_DCT_IFAST;
+		/*
+		  sub turns flat UI areas into zero runs that level 1 finds
+		  cheaply; unfiltered RGB repeats every 3 bytes, which Z_RLE
+		  and packbits cannot see
+		*/
+		options->png.level = 1;
+		options->png.filters = G_PNG_FILTER_SUB;
+		options->png.strategy = G_PNG_STRATEGY_DEFAULT;
+		options->png.palette = 1;
+		options->tiff.compression = G_TIFF_COMPRESSION_LZW;
+		break;
+	case G_SAVE_PRESET_SMALL:
+		options->jpeg.optimize = 1;
+		options->jpeg.progressive = 1;
+		options->png.level = 9;
+		options->png.palette = 1;
+		options->tiff.compression = G_TIFF_COMPRESSION_DEFLATE;
+		break;
+	default:
+		break;
+	}
+}
+
+int g_pixbuf_save_with_options (GPixbuf *pixbuf, FILE *fp, g_save_type type, const GSaveOptions *options)
+{
+	GFileSink fs;
+
+	if (!fp)
+		return -1;
+	_g_file_sink_init (&fs, fp);
+	return g_pixbuf_save_to_sink (pixbuf, &fs.sink, type, options);
+}
+
+int g_pixbuf_save_to_sink (GPixbuf *pixbuf, GSaveSink *sink, g_save_type type, const GSaveOptions *options)
+{
+	GSaveOptions defaults;
+	int ret;
+
+	if (!options) {
+		g_save_options_init (&defaults, G_SAVE_PRESET_DEFAULT);
+		options = &defaults;
+	}
+
 	switch(type) {
 		case ICO:
-			return g_pixbuf_ico_image_save(fp, pixbuf);
+			ret = g_pixbuf_ico_image_save(sink, pixbuf);
+			break;
 		case BMP:
-			return g_pixbuf_bmp_image_save(fp, pixbuf);
+			ret = g_pixbuf_bmp_image_save(sink, pixbuf);
+			break;
 		case PNG:
-			return g_pixbuf_png_image_save(fp, pixbuf);
+			ret = g_pixbuf_png_image_save(sink, pixbuf, options);
+			break;
 		case TIFF0:
-			return g_pixbuf_tiff_image_save(fp, pixbuf);
+			ret = g_pixbuf_tiff_image_save(sink, pixbuf, options);
+			break;
+		case QOI:
+			ret = g_pixbuf_qoi_image_save(sink, pixbuf);
+			break;
 		case JPG:
 		case JPEG:
-			return g_pixbuf_jpeg_image_save(fp, pixbuf);
 		default:
-			return g_pixbuf_jpeg_image_save(fp, pixbuf);
+			ret = g_pixbuf_jpeg_image_save(sink, pixbuf, options);
+			break;
+	}
+
+	if (!ret && _g_sink_flush (sink) < 0)
+		ret = -1;
+	return ret;
+}
+
+int g_pixbuf_save_to_buffer (GPixbuf *pixbuf, unsigned char **data, size_t *size, g_save_type type, const GSaveOptions *options)
+{
+	GSaveSink *sink;
+	int ret;
+
+	sink = g_save_sink_new_buffer (0);
+	if (!sink)
+		return -1;
+	ret = g_pixbuf_save_to_sink (pixbuf, sink, type, options);
+	if (!ret) {
+		*data = g_save_sink_steal_buffer (sink, size);
+		if (!*data)
+			ret = -1;
+	}
+	g_save_sink_free (sink);
+
+	return ret;
+}
+
+
+/* where red and blue sit in a pixel; green is always in the middle */
+static void pixel_offsets (const GPixbuf *pixbuf, int *r, int *b)
+{
+	if (pixbuf->format == G_PIXEL_BGRX || pixbuf->format == G_PIXEL_BGRA) {
+		*r = 2;
+		*b = 0;
+	} else {
+		*r = 0;
+		*b = 2;
 	}
 }
 
+/*
+  Large PNGs and baseline JPEGs are encoded in row stripes on the save
+  pool. Off until g_pixbuf_set_save_threads() is called.
+*/
+static XssPool *save_pool;
+static int save_min_pixels = 1024 * 1024;
+
+void g_pixbuf_set_save_threads (int n_threads, int min_pixels)
+{
+	if (save_pool) {
+		xss_pool_free (save_pool);
+		save_pool = NULL;
+	}
+	if (n_threads != 1)
+		save_pool = xss_pool_new (n_threads);
+	if (min_pixels >= 0)
+		save_min_pixels = min_pixels;
+}
 
 struct error_handler_data {
   struct jpeg_error_mgr pub;    /* "public" fields */
   jmp_buf setjmp_buffer;        /* for return to caller */
 };
 
-static int g_pixbuf_jpeg_image_save(FILE * f, GPixbuf *pixbuf) {
+static void jpeg_error_exit (j_common_ptr cinfo)
+{
+	struct error_handler_data *err = (struct error_handler_data *)cinfo->err;
+
+	longjmp (err->setjmp_buffer, 1);
+}
+
+/* apply options on top of jpeg_set_defaults() */
+static void jpeg_set_options (struct jpeg_compress_struct *cinfo, const GSaveOptions *options)
+{
+	int quality = options->jpeg.quality;
+
+	if (quality < 1)
+		quality = 1;
+	if (quality > 100)
+		quality = 100;
+	jpeg_set_quality (cinfo, quality, TRUE);
+
+	/* luma sampling factors; the chroma components stay at 1x1 */
+	switch (options->jpeg.subsampling) {
+	case G_JPEG_SUBSAMPLE_444:
+		cinfo->comp_info[0].h_samp_factor = 1;
+		cinfo->comp_info[0].v_samp_factor = 1;
+		break;
+	case G_JPEG_SUBSAMPLE_422:
+		cinfo->comp_info[0].h_samp_factor = 2;
+		cinfo->comp_info[0].v_samp_factor = 1;
+		break;
+	default:
+		cinfo->comp_info[0].h_samp_factor = 2;
+		cinfo->comp_info[0].v_samp_factor = 2;
+		break;
+	}
+
+	switch (options->jpeg.dct) {
+	case G_JPEG_DCT_IFAST:
+		cinfo->dct_method = JDCT_IFAST;
+		break;
+	case G_JPEG_DCT_FLOAT:
+		cinfo->dct_method = JDCT_FLOAT;
+		break;
+	default:
+		cinfo->dct_method = JDCT_ISLOW;
+		break;
+	}
+
+	cinfo->optimize_coding = options->jpeg.optimize ? TRUE : FALSE;
+	if (options->jpeg.progressive)
+		jpeg_simple_progression (cinfo);
+}
+
+/*
+  Raw 4:2:0 feed: server BGRX rows go straight into the Y, Cb and Cr
+  planes of one iMCU row (16 luma rows) with _g_ycc420_func(), and on to
+  jpeg_write_raw_data(); libjpeg's own color conversion and downsampling,
+  and the packed RGB rows in front of them, are skipped. Rows may come
+  in any batches, a row left without its pair waits in hold. Past the
+  bottom the planes repeat their last row, as libjpeg pads.
+*/
+typedef struct {
+	ycc420func func;
+	int width, height;
+	int c_cols;		/* chroma samples per plane row, whole blocks */
+	int rows_in;		/* image rows taken so far */
+	int filled;		/* luma rows in the planes */
+	int pending;		/* hold has a row waiting for its pair */
+	unsigned char *hold;
+	JSAMPROW y[16], cb[8], cr[8];
+} jpeg_raw_feed;
+
+/* bytes of planes and hold row behind a jpeg_raw_feed */
+static size_t jpeg_raw_size (int width)
+{
+	return (size_t)48 * ((width + 15) / 16 * 8) + (size_t)4 * width;
+}
+
+static void jpeg_raw_init (jpeg_raw_feed *raw, int width, int height, unsigned char *buf)
+{
+	int i;
+
+	memset (raw, 0, sizeof(jpeg_raw_feed));
+	raw->func = _g_ycc420_func (_g_simd_level ());
+	raw->width = width;
+	raw->height = height;
+	raw->c_cols = (width + 15) / 16 * 8;
+	for (i = 0; i < 16; i++, buf += 2 * raw->c_cols)
+		raw->y[i] = buf;
+	for (i = 0; i < 8; i++, buf += raw->c_cols)
+		raw->cb[i] = buf;
+	for (i = 0; i < 8; i++, buf += raw->c_cols)
+		raw->cr[i] = buf;
+	raw->hold = buf;
+}
+
+static void jpeg_raw_flush (struct jpeg_compress_struct *cinfo, jpeg_raw_feed *raw)
+{
+	JSAMPARRAY planes[3] = { raw->y, raw->cb, raw->cr };
+	int i;
+
+	for (i = raw->filled; i < 16; i++)
+		memcpy (raw->y[i], raw->y[i - 1], 2 * raw->c_cols);
+	for (i = raw->filled / 2; i < 8; i++) {
+		memcpy (raw->cb[i], raw->cb[i - 1], raw->c_cols);
+		memcpy (raw->cr[i], raw->cr[i - 1], raw->c_cols);
+	}
+	jpeg_write_raw_data (cinfo, planes, 16);
+	raw->filled = 0;
+}
+
+static void jpeg_raw_pair (struct jpeg_compress_struct *cinfo, jpeg_raw_feed *raw, const unsigned char *a, const unsigned char *b)
+{
+	int i = raw->filled;
+
+	raw->func (a, b, raw->width, raw->y[i], raw->y[i + 1], raw->cb[i / 2], raw->cr[i / 2], raw->c_cols);
+	raw->filled += 2;
+	if (raw->filled == 16)
+		jpeg_raw_flush (cinfo, raw);
+}
+
+static void jpeg_raw_write (struct jpeg_compress_struct *cinfo, jpeg_raw_feed *raw, const unsigned char *pixels, int rowstride, int n_rows)
+{
+	const unsigned char *row;
+	int i = 0;
+
+	if (n_rows <= 0)
+		return;
+	if (raw->pending) {
+		jpeg_raw_pair (cinfo, raw, raw->hold, pixels);
+		raw->pending = 0;
+		i = 1;
+	}
+	for (; i + 1 < n_rows; i += 2)
+		jpeg_raw_pair (cinfo, raw, pixels + i * rowstride, pixels + (i + 1) * rowstride);
+	raw->rows_in += n_rows;
+	if (i < n_rows) {
+		row = pixels + i * rowstride;
+		if (raw->rows_in == raw->height) {
+			/* an odd last row pairs with itself */
+			jpeg_raw_pair (cinfo, raw, row, row);
+		} else {
+			memcpy (raw->hold, row, raw->width * 4);
+			raw->pending = 1;
+		}
+	}
+	if (raw->rows_in == raw->height && raw->filled)
+		jpeg_raw_flush (cinfo, raw);
+}
+
+/* how pixbuf rows reach the compressor */
+enum {
+	JPEG_FEED_CONVERT,	/* packed into RGB rows first */
+	JPEG_FEED_DIRECT,	/* read in place */
+	JPEG_FEED_RAW		/* turned into YCbCr planes */
+};
+
+/*
+  geometry and input layout, ahead of jpeg_set_defaults(); returns the
+  feed. raw_data_in has to be set again after the defaults for the raw one
+*/
+static int jpeg_set_pixbuf (struct jpeg_compress_struct *cinfo, const GPixbuf *pixbuf, int height, const GSaveOptions *options)
+{
+	cinfo->image_width = pixbuf->width;
+	cinfo->image_height = height;
+	cinfo->input_components = 3;
+	cinfo->in_color_space = JCS_RGB;
+	if ((pixbuf->format == G_PIXEL_BGRX || pixbuf->format == G_PIXEL_BGRA) &&
+	    options->jpeg.subsampling == G_JPEG_SUBSAMPLE_420) {
+		cinfo->in_color_space = JCS_YCbCr;
+		return JPEG_FEED_RAW;
+	}
+#ifdef JCS_EXTENSIONS
+	/* libjpeg-turbo reads server pixels as they are */
+	if (pixbuf->format == G_PIXEL_BGRX || pixbuf->format == G_PIXEL_BGRA) {
+		cinfo->input_components = 4;
+		cinfo->in_color_space = JCS_EXT_BGRX;
+		return JPEG_FEED_DIRECT;
+	}
+#endif
+	return pixbuf->format == G_PIXEL_RGB ? JPEG_FEED_DIRECT : JPEG_FEED_CONVERT;
+}
+
+/* scratch bytes jpeg_write_pixbuf() needs for a feed, 0 for none */
+static size_t jpeg_feed_size (int feed, int width)
+{
+	if (feed == JPEG_FEED_RAW)
+		return jpeg_raw_size (width);
+	if (feed == JPEG_FEED_CONVERT)
+		return (size_t)G_SAVE_BAND_ROWS * width * 3;
+	return 0;
+}
+
+/*
+  write pixbuf rows from y0 on until the compressor has all it wants.
+  G_SAVE_BAND_ROWS rows go per call, whole MCU row groups for any
+  sampling, pointing into the pixbuf for the direct feed and converted
+  into buf (jpeg_feed_size() bytes) otherwise
+*/
+static void jpeg_write_pixbuf (struct jpeg_compress_struct *cinfo, const GPixbuf *pixbuf, int y0, int feed, unsigned char *buf)
+{
+	JSAMPROW rows[G_SAVE_BAND_ROWS];
+	jpeg_raw_feed raw;
+	unsigned char *ptr, *row;
+	int i, j, n, y, r, b;
+	int w = pixbuf->width, channel = pixbuf->n_channels;
+
+	if (feed == JPEG_FEED_RAW) {
+		jpeg_raw_init (&raw, w, cinfo->image_height, buf);
+		jpeg_raw_write (cinfo, &raw, pixbuf->pixels + y0 * pixbuf->rowstride, pixbuf->rowstride, cinfo->image_height);
+		return;
+	}
+
+	pixel_offsets (pixbuf, &r, &b);
+	while (cinfo->next_scanline < cinfo->image_height) {
+		y = y0 + cinfo->next_scanline;
+		n = cinfo->image_height - cinfo->next_scanline;
+		if (n > G_SAVE_BAND_ROWS)
+			n = G_SAVE_BAND_ROWS;
+		for (i = 0; i < n; i++) {
+			ptr = pixbuf->pixels + (y + i) * pixbuf->rowstride;
+			if (feed == JPEG_FEED_DIRECT) {
+				rows[i] = ptr;
+				continue;
+			}
+			/* convert scanline to RGB packed */
+			row = buf + i * w * 3;
+			for (j = 0; j < w; j++, ptr += channel) {
+				row[j * 3] = ptr[r];
+				row[j * 3 + 1] = ptr[1];
+				row[j * 3 + 2] = ptr[b];
+			}
+			rows[i] = row;
+		}
+		jpeg_write_scanlines(cinfo, rows, n);
+	}
+}
+
+/* libjpeg destination that hands each full buffer to a sink */
+#define JPEG_SINK_BUF	65536
+
+typedef struct {
+	struct jpeg_destination_mgr pub;
+	GSaveSink *sink;
+	JOCTET *buffer;
+} jpeg_sink_destination;
+
+static void jpeg_sink_init (j_compress_ptr cinfo)
+{
+	jpeg_sink_destination *dest = (jpeg_sink_destination *)cinfo->dest;
+
+	dest->buffer = (JOCTET *)(*cinfo->mem->alloc_small) ((j_common_ptr)cinfo, JPOOL_IMAGE, JPEG_SINK_BUF);
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = JPEG_SINK_BUF;
+}
+
+static boolean jpeg_sink_empty (j_compress_ptr cinfo)
+{
+	jpeg_sink_destination *dest = (jpeg_sink_destination *)cinfo->dest;
+
+	/* the whole buffer is full when libjpeg asks */
+	if (dest->sink->write (dest->sink, dest->buffer, JPEG_SINK_BUF) < 0)
+		(*cinfo->err->error_exit) ((j_common_ptr)cinfo);
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = JPEG_SINK_BUF;
+	return TRUE;
+}
+
+static void jpeg_sink_term (j_compress_ptr cinfo)
+{
+	jpeg_sink_destination *dest = (jpeg_sink_destination *)cinfo->dest;
+	size_t n = JPEG_SINK_BUF - dest->pub.free_in_buffer;
+
+	if (n && dest->sink->write (dest->sink, dest->buffer, n) < 0)
+		(*cinfo->err->error_exit) ((j_common_ptr)cinfo);
+}
+
+/* like jpeg_stdio_dest(); dest must live until the compressor is destroyed */
+static void jpeg_sink_dest (j_compress_ptr cinfo, jpeg_sink_destination *dest, GSaveSink *sink)
+{
+	memset (dest, 0, sizeof(jpeg_sink_destination));
+	dest->pub.init_destination = jpeg_sink_init;
+	dest->pub.empty_output_buffer = jpeg_sink_empty;
+	dest->pub.term_destination = jpeg_sink_term;
+	dest->sink = sink;
+	cinfo->dest = &dest->pub;
+}
+
+/*
+  Parallel baseline JPEG: the image is cut into stripes of whole MCU
+  rows that are compressed on the save pool as separate JPEGs with the
+  same tables. The restart interval is set to one stripe, so a restart
+  marker between two stripes is all a decoder expects there: it resets
+  the DC predictors that each stripe already started from zero. Chroma
+  downsampling never looks across an MCU row, so the scan is the one a
+  single compressor with that interval writes.
+*/
+typedef struct {
+	struct jpeg_destination_mgr pub;
+	unsigned char *data;
+	unsigned long size;
+} jpeg_mem_destination;
+
+#define JPEG_MEM_CHUNK	65536
+
+static void jpeg_mem_init (j_compress_ptr cinfo)
+{
+	jpeg_mem_destination *dest = (jpeg_mem_destination *)cinfo->dest;
+
+	dest->size = JPEG_MEM_CHUNK;
+	dest->data = (unsigned char *)malloc(dest->size);
+	if (!dest->data)
+		(*cinfo->err->error_exit) ((j_common_ptr)cinfo);
+	dest->pub.next_output_byte = dest->data;
+	dest->pub.free_in_buffer = dest->size;
+}
+
+static boolean jpeg_mem_empty (j_compress_ptr cinfo)
+{
+	jpeg_mem_destination *dest = (jpeg_mem_destination *)cinfo->dest;
+	unsigned char *data;
+
+	/* the whole buffer is full when libjpeg asks */
+	data = (unsigned char *)realloc(dest->data, dest->size * 2);
+	if (!data)
+		(*cinfo->err->error_exit) ((j_common_ptr)cinfo);
+	dest->pub.next_output_byte = data + dest->size;
+	dest->pub.free_in_buffer = dest->size;
+	dest->data = data;
+	dest->size *= 2;
+	return TRUE;
+}
+
+static void jpeg_mem_term (j_compress_ptr cinfo)
+{
+	jpeg_mem_destination *dest = (jpeg_mem_destination *)cinfo->dest;
+
+	dest->size -= dest->pub.free_in_buffer;
+}
+
+typedef struct {
+	const GPixbuf *pixbuf;
+	const GSaveOptions *options;
+	int y0, y1;		/* rows of the stripe */
+	unsigned int restart_interval;
+	jpeg_mem_destination dest;
+	int failed;
+} jpeg_stripe;
+
+static void jpeg_stripe_run (void *data, void *usr_data)
+{
+	jpeg_stripe *s = (jpeg_stripe *)data;
 	struct jpeg_compress_struct cinfo;
-	unsigned char *buf;
-	unsigned char *ptr;
-	unsigned char *pixels;
-	JSAMPROW *jbuf;
-	int y = 0;
-	int i, j;
-	int w, h = 0;
-	int rowstride = 0;
 	struct error_handler_data jerr;
+	unsigned char *volatile buf = NULL;
+	size_t size;
+	int feed;
+
+	cinfo.err = jpeg_std_error (&jerr.pub);
+	jerr.pub.error_exit = jpeg_error_exit;
+	if (setjmp (jerr.setjmp_buffer)) {
+		jpeg_destroy_compress (&cinfo);
+		free (buf);
+		free (s->dest.data);
+		s->dest.data = NULL;
+		s->failed = 1;
+		return;
+	}
+	jpeg_create_compress (&cinfo);
+	s->dest.pub.init_destination = jpeg_mem_init;
+	s->dest.pub.empty_output_buffer = jpeg_mem_empty;
+	s->dest.pub.term_destination = jpeg_mem_term;
+	cinfo.dest = &s->dest.pub;
+
+	feed = jpeg_set_pixbuf (&cinfo, s->pixbuf, s->y1 - s->y0, s->options);
+	size = jpeg_feed_size (feed, s->pixbuf->width);
+	if (size) {
+		buf = (unsigned char *)malloc(size);
+		if (!buf)
+			(*cinfo.err->error_exit) ((j_common_ptr)&cinfo);
+	}
+	jpeg_set_defaults (&cinfo);
+	jpeg_set_options (&cinfo, s->options);
+	cinfo.raw_data_in = feed == JPEG_FEED_RAW;
+	cinfo.restart_interval = s->restart_interval;
+	jpeg_start_compress (&cinfo, TRUE);
+	jpeg_write_pixbuf (&cinfo, s->pixbuf, s->y0, feed, buf);
+	jpeg_finish_compress (&cinfo);
+	jpeg_destroy_compress (&cinfo);
+	free (buf);
+}
 
-	w = pixbuf->width;
-	h = pixbuf->height;
-	rowstride = pixbuf->rowstride;
-	pixels = pixbuf->pixels;
-	if (!pixels)
-		return 0;
-	/* allocate a small buffer to convert image data */
-	buf = malloc(w * 3 * sizeof(unsigned char));
-	if (!buf)
+/*
+  bytes of a stripe's scan: its headers are skipped, or kept with the
+  frame height patched for the first stripe; the EOI is dropped
+*/
+static int jpeg_stripe_scan (jpeg_stripe *s, int first, int height, unsigned long *start)
+{
+	unsigned char *p = s->dest.data, marker;
+	unsigned long pos = 2, len;
+
+	/* SOI, then segments with a length up to and including SOS */
+	while (pos + 4 <= s->dest.size && p[pos] == 0xff) {
+		marker = p[pos + 1];
+		len = p[pos + 2] << 8 | p[pos + 3];
+		if (first && marker >= 0xc0 && marker <= 0xc2 && pos + 7 <= s->dest.size) {
+			p[pos + 5] = height >> 8;
+			p[pos + 6] = height;
+		}
+		pos += 2 + len;
+		if (marker == 0xda) {
+			*start = first ? 0 : pos;
+			return s->dest.size >= pos + 2 ? 0 : -1;
+		}
+	}
+	return -1;
+}
+
+static int jpeg_save_parallel (GSaveSink *sink, GPixbuf *pixbuf, const GSaveOptions *options, int mcu_height, unsigned int mcus_per_row)
+{
+	int rows, n_stripes, batch, first, i, n, ret = 0;
+	unsigned long start;
+	unsigned char rst[2];
+	jpeg_stripe *stripes;
+	void **data;
+
+	/* a couple of stripes per thread, in whole MCU rows, one restart interval each */
+	n = xss_pool_get_max_threads (save_pool) * 2;
+	rows = (pixbuf->height / n + mcu_height - 1) / mcu_height;
+	if (rows < 1)
+		rows = 1;
+	if (rows * mcus_per_row > 65535)
+		rows = 65535 / mcus_per_row;
+	rows *= mcu_height;
+	n_stripes = (pixbuf->height + rows - 1) / rows;
+
+	batch = n;
+	stripes = (jpeg_stripe *)malloc(batch * sizeof(jpeg_stripe));
+	data = (void **)malloc(batch * sizeof(void *));
+	if (!stripes || !data) {
+		free (stripes);
+		free (data);
+		return -1;
+	}
+
+	for (first = 0; first < n_stripes && !ret; first += n) {
+		n = n_stripes - first < batch ? n_stripes - first : batch;
+		for (i = 0; i < n; i++) {
+			memset (&stripes[i], 0, sizeof(jpeg_stripe));
+			stripes[i].pixbuf = pixbuf;
+			stripes[i].options = options;
+			stripes[i].y0 = (first + i) * rows;
+			stripes[i].y1 = stripes[i].y0 + rows < pixbuf->height ? stripes[i].y0 + rows : pixbuf->height;
+			stripes[i].restart_interval = rows / mcu_height * mcus_per_row;
+			data[i] = &stripes[i];
+		}
+		xss_pool_run (save_pool, jpeg_stripe_run, data, n, NULL);
+
+		for (i = 0; i < n; i++) {
+			jpeg_stripe *s = &stripes[i];
+
+			if (!ret && (s->failed || jpeg_stripe_scan (s, first + i == 0, pixbuf->height, &start) < 0))
+				ret = -1;
+			if (!ret && first + i > 0) {
+				/* RSTn between intervals, numbered modulo 8 */
+				rst[0] = 0xff;
+				rst[1] = 0xd0 + (first + i - 1) % 8;
+				ret = sink->write (sink, rst, 2);
+			}
+			if (!ret)
+				ret = sink->write (sink, s->dest.data + start, s->dest.size - 2 - start);
+			free (s->dest.data);
+		}
+	}
+	free (stripes);
+	free (data);
+
+	if (!ret) {
+		/* EOI */
+		rst[0] = 0xff;
+		rst[1] = 0xd9;
+		ret = sink->write (sink, rst, 2);
+	}
+	return ret;
+}
+
+static int g_pixbuf_jpeg_image_save(GSaveSink *sink, GPixbuf *pixbuf, const GSaveOptions *options) {
+	struct jpeg_compress_struct cinfo;
+	jpeg_sink_destination dest;
+	unsigned char *volatile buf = NULL;
+	size_t size;
+	int feed, v_samp, h_samp;
+	struct error_handler_data jerr;
+
+	if (!pixbuf->pixels)
 		return 0;
 
+	/* baseline only: optimized tables would differ between stripes */
+	if (save_pool && !options->jpeg.optimize && !options->jpeg.progressive &&
+	    pixbuf->width * pixbuf->height >= save_min_pixels) {
+		v_samp = options->jpeg.subsampling == G_JPEG_SUBSAMPLE_420 ? 2 : 1;
+		h_samp = options->jpeg.subsampling == G_JPEG_SUBSAMPLE_444 ? 1 : 2;
+		if ((pixbuf->width + 8 * h_samp - 1) / (8 * h_samp) <= 65535)
+			return jpeg_save_parallel (sink, pixbuf, options, 8 * v_samp,
+						   (pixbuf->width + 8 * h_samp - 1) / (8 * h_samp));
+	}
+
 	cinfo.err = jpeg_std_error(&(jerr.pub));
-	if (sigsetjmp(jerr.setjmp_buffer, 1)) {
+	jerr.pub.error_exit = jpeg_error_exit;
+	if (setjmp(jerr.setjmp_buffer)) {
 		jpeg_destroy_compress(&cinfo);
 		free(buf);
-		fclose(f);
-		return 1;
+		return -1;
 	}
 
 	/* setup compress params */
 	jpeg_create_compress(&cinfo);
-	jpeg_stdio_dest(&cinfo, f);
-	cinfo.image_width = w;
-	cinfo.image_height = h;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_RGB;
-
+	jpeg_sink_dest(&cinfo, &dest, sink);
+	feed = jpeg_set_pixbuf(&cinfo, pixbuf, pixbuf->height, options);
+	size = jpeg_feed_size(feed, pixbuf->width);
+	if (size) {
+		/* a small buffer to convert a batch of rows */
+		buf = malloc(size);
+		if (!buf) {
+			jpeg_destroy_compress(&cinfo);
+			return -1;
+		}
+	}
 
 	/* set up jepg compression parameters */
 	jpeg_set_defaults(&cinfo);
+	jpeg_set_options(&cinfo, options);
+	cinfo.raw_data_in = feed == JPEG_FEED_RAW;
 	jpeg_start_compress(&cinfo, TRUE);
-	/* get the start pointer */
-	ptr = pixels;
-	/* go one scanline at a time... and save */
-	i = 0;
-	while (cinfo.next_scanline < cinfo.image_height) {
-		/* convert scanline from ARGB to RGB packed */
-		for (j = 0; j < w; j++)
-			memcpy(&(buf[j * 3]), &(ptr[i * rowstride + j * 3]), 3);
-
-		/* write scanline */
-		jbuf = (JSAMPROW *) (&buf);
-		jpeg_write_scanlines(&cinfo, jbuf, 1);
-		i++;
-		y++;
-	}
+	jpeg_write_pixbuf(&cinfo, pixbuf, 0, feed, buf);
 	/* finish off */
 	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
 	free(buf);
 	return 0;
 }
 
-static int g_pixbuf_png_image_save(FILE *f, GPixbuf * pixbuf) {
+/*
+  Parallel PNG, after pigz: rows are cut into stripes that are filtered
+  and deflated on the save pool at the same time. A stripe is primed with
+  the 32K of filtered data in front of it and ends on a sync flush, so
+  the pieces join into one zlib stream; their Adler-32 sums are combined
+  in order.
+*/
+#define PNG_STRIPE_BYTES	(1024 * 1024)	/* raw bytes per stripe, at least a row */
+#define PNG_WINDOW		32768
+
+/* the filter loops are plain byte loops that -O2 alone leaves scalar */
+#if defined(__GNUC__) && !defined(__clang__)
+#define PNG_VECTORIZE __attribute__((optimize("tree-vectorize")))
+#else
+#define PNG_VECTORIZE
+#endif
+
+/*
+  Indexed color: screenshots of UI often have a few dozen colors. One
+  pass collects them in a small open addressed table and gives up at
+  the 257th; a qualifying image is written as PNG_COLOR_TYPE_PALETTE at
+  the smallest depth that holds its colors. Translucent entries go first
+  so tRNS stays short.
+*/
+#define PNG_PALETTE_SLOTS	1024	/* power of two, at most 1/4 full */
+#define PNG_PALETTE_HASH(key)	(((key) * 0x9e3779b1u) >> 22)
+
+typedef struct {
+	unsigned int key[PNG_PALETTE_SLOTS];	/* 0xAARRGGBB */
+	short index[PNG_PALETTE_SLOTS];		/* -1 for a free slot */
+	int n_colors;
+	int n_trans;		/* entries with alpha below 255, first in the palette */
+	int depth;		/* 1, 2, 4 or 8 bits per pixel */
+	png_color colors[256];
+	png_byte trans[256];
+} png_palette;
+
+/* the pixel at p as 0xAARRGGBB, alpha 0xff without an alpha channel */
+static inline unsigned int png_pixel_key (const unsigned char *p, g_pixel_format format, int has_alpha)
+{
+	switch (format) {
+	case G_PIXEL_BGRX:
+		return (p[0] | p[1] << 8 | p[2] << 16) | 0xff000000u;
+	case G_PIXEL_BGRA:
+		return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+	default:
+		return (p[0] << 16 | p[1] << 8 | p[2]) | (has_alpha ? (unsigned int)p[3] << 24 : 0xff000000u);
+	}
+}
+
+static inline int png_palette_slot (const png_palette *pal, unsigned int key)
+{
+	int h = PNG_PALETTE_HASH (key);
+
+	while (pal->index[h] >= 0 && pal->key[h] != key)
+		h = (h + 1) & (PNG_PALETTE_SLOTS - 1);
+	return h;
+}
+
+/* 1 and a filled in palette when the pixbuf has at most 256 colors */
+static int png_palette_build (png_palette *pal, const GPixbuf *pixbuf)
+{
+	const unsigned char *p;
+	unsigned int key, last = 0;
+	int x, y, h, i, n, opaque, first = 1;
+	int channel = pixbuf->n_channels;
+
+	if (pixbuf->bits_per_sample != 8)
+		return 0;
+	memset (pal->index, 0xff, sizeof(pal->index));
+	pal->n_colors = 0;
+	pal->n_trans = 0;
+
+	for (y = 0; y < pixbuf->height; y++) {
+		p = pixbuf->pixels + y * pixbuf->rowstride;
+		for (x = 0; x < pixbuf->width; x++, p += channel) {
+			key = png_pixel_key (p, pixbuf->format, pixbuf->has_alpha);
+			/* runs of one color are the common case */
+			if (key == last && !first)
+				continue;
+			last = key;
+			first = 0;
+			h = png_palette_slot (pal, key);
+			if (pal->index[h] >= 0)
+				continue;
+			if (pal->n_colors == 256)
+				return 0;
+			pal->key[h] = key;
+			pal->index[h] = pal->n_colors++;
+			if (key >> 24 != 0xff)
+				pal->n_trans++;
+		}
+	}
+
+	/* number the colors, translucent ones first */
+	opaque = pal->n_trans;
+	for (i = 0, n = 0; i < PNG_PALETTE_SLOTS; i++) {
+		if (pal->index[i] < 0)
+			continue;
+		key = pal->key[i];
+		pal->index[i] = key >> 24 != 0xff ? n++ : opaque++;
+		pal->colors[pal->index[i]].red = key >> 16;
+		pal->colors[pal->index[i]].green = key >> 8;
+		pal->colors[pal->index[i]].blue = key;
+		pal->trans[pal->index[i]] = key >> 24;
+	}
+
+	pal->depth = pal->n_colors <= 2 ? 1 : pal->n_colors <= 4 ? 2 : pal->n_colors <= 16 ? 4 : 8;
+	return 1;
+}
+
+/* row y as packed palette indices */
+static void png_index_row (const png_palette *pal, const GPixbuf *pixbuf, int y, unsigned char *dst)
+{
+	const unsigned char *p = pixbuf->pixels + y * pixbuf->rowstride;
+	unsigned int key, last = 0, v = 0, acc = 0;
+	int x, shift, depth = pal->depth, channel = pixbuf->n_channels;
+
+	for (x = 0, shift = 8 - depth; x < pixbuf->width; x++, p += channel) {
+		key = png_pixel_key (p, pixbuf->format, pixbuf->has_alpha);
+		if (key != last || x == 0) {
+			v = pal->index[png_palette_slot (pal, key)];
+			last = key;
+		}
+		if (depth == 8) {
+			*dst++ = v;
+			continue;
+		}
+		acc |= v << shift;
+		shift -= depth;
+		if (shift < 0) {
+			*dst++ = acc;
+			acc = 0;
+			shift = 8 - depth;
+		}
+	}
+	if (depth < 8 && shift != 8 - depth)
+		*dst = acc;
+}
+
+/* bytes in one unfiltered row, and the filters' pixel distance */
+static int png_row_bytes (const GPixbuf *pixbuf, const png_palette *pal, int *bpp)
+{
+	if (pal) {
+		*bpp = 1;
+		return (pixbuf->width * pal->depth + 7) / 8;
+	}
+	*bpp = pixbuf->has_alpha ? 4 : 3;
+	return pixbuf->width * *bpp;
+}
+
+typedef struct {
+	const GPixbuf *pixbuf;
+	const png_palette *palette;	/* NULL for truecolor */
+	int y0, y1;		/* rows of the stripe */
+	int last;
+	int level, strategy, filters;
+	unsigned char *out;	/* 2 bytes zlib header room, data, 4 bytes adler room */
+	unsigned long out_len;
+	unsigned long adler;
+	unsigned long raw_len;
+	int failed;
+} png_stripe;
+
+/* zlib settings from the options; AUTO is what libpng picks */
+static int png_zlib_level (const GSaveOptions *options)
+{
+	if (options->png.level < 0)
+		return Z_DEFAULT_COMPRESSION;
+	return options->png.level > 9 ? 9 : options->png.level;
+}
+
+static int png_zlib_strategy (const GSaveOptions *options)
+{
+	switch (options->png.strategy) {
+	case G_PNG_STRATEGY_DEFAULT:
+		return Z_DEFAULT_STRATEGY;
+	case G_PNG_STRATEGY_FILTERED:
+		return Z_FILTERED;
+	case G_PNG_STRATEGY_HUFFMAN_ONLY:
+		return Z_HUFFMAN_ONLY;
+	case G_PNG_STRATEGY_RLE:
+		return Z_RLE;
+	default:
+		return (options->png.filters & G_PNG_FILTER_ALL) == G_PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+	}
+}
+
+static int png_filters (const GSaveOptions *options)
+{
+	int filters = options->png.filters & G_PNG_FILTER_ALL;
+
+	return filters ? filters : G_PNG_FILTER_NONE;
+}
+
+/* row y as packed RGB or RGBA, whatever the pixbuf layout */
+static void png_pack_row (const GPixbuf *pixbuf, int y, unsigned char *dst)
+{
+	const unsigned char *src = pixbuf->pixels + y * pixbuf->rowstride;
+	int x, r, b, channel = pixbuf->n_channels;
+
+	if (pixbuf->format == G_PIXEL_RGB || pixbuf->format == G_PIXEL_RGBA) {
+		memcpy (dst, src, pixbuf->width * (pixbuf->has_alpha ? 4 : 3));
+		return;
+	}
+	pixel_offsets (pixbuf, &r, &b);
+	for (x = 0; x < pixbuf->width; x++, src += channel) {
+		*dst++ = src[r];
+		*dst++ = src[1];
+		*dst++ = src[b];
+		if (pixbuf->has_alpha)
+			*dst++ = src[3];
+	}
+}
+
+static inline unsigned char paeth (int a, int b, int c)
+{
+	int pa = abs (b - c), pb = abs (a - c), pc = abs (a + b - 2 * c);
+
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/* sum of the residuals read as signed bytes, stopping once past limit */
+PNG_VECTORIZE
+static unsigned long png_row_cost (const unsigned char *v, int bytes, unsigned long limit)
+{
+	unsigned long sum = 0;
+	unsigned int block;
+	int i, end;
+
+	/* check the limit per block so the inner loop stays vectorizable */
+	for (i = 0; i < bytes && sum < limit; i = end) {
+		end = i + 1024 < bytes ? i + 1024 : bytes;
+		for (block = 0; i < end; i++)
+			block += abs ((signed char)v[i]);
+		sum += block;
+	}
+	return sum;
+}
+
+/*
+  filter one row into out (type byte first), picking among the allowed
+  filters the one with the smallest sum of signed residuals, like
+  libpng's default heuristic
+*/
+PNG_VECTORIZE
+static void png_filter_row (unsigned char *out, unsigned char *try, const unsigned char *row, const unsigned char *prev, int bytes, int bpp, int filters)
+{
+	unsigned long sum, best_sum = (unsigned long)-1;
+	const unsigned char *best = NULL, *cand;
+	unsigned char *tmp;
+	int i, type, best_type = 0;
+
+	for (type = 0; type <= 4; type++) {
+		if (!(filters & (G_PNG_FILTER_NONE << type)))
+			continue;
+		cand = try;
+		switch (type) {
+		case 0:
+			cand = row;
+			break;
+		case 1:
+			for (i = 0; i < bpp; i++)
+				try[i] = row[i];
+			for (; i < bytes; i++)
+				try[i] = row[i] - row[i - bpp];
+			break;
+		case 2:
+			for (i = 0; i < bytes; i++)
+				try[i] = row[i] - prev[i];
+			break;
+		case 3:
+			for (i = 0; i < bpp; i++)
+				try[i] = row[i] - (prev[i] >> 1);
+			for (; i < bytes; i++)
+				try[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+			break;
+		default:
+			for (i = 0; i < bpp; i++)
+				try[i] = row[i] - prev[i];
+			for (; i < bytes; i++)
+				try[i] = row[i] - paeth (row[i - bpp], prev[i], prev[i - bpp]);
+			break;
+		}
+		/* a lone filter needs no scoring */
+		sum = filters == (G_PNG_FILTER_NONE << type) ? 0 : png_row_cost (cand, bytes, best_sum);
+		if (!best || sum < best_sum) {
+			best_sum = sum;
+			best_type = type;
+			if (cand == try) {
+				/* keep the winner, filter the next candidate into the loser */
+				tmp = !best || best == row ? out + 1 : (unsigned char *)best;
+				best = try;
+				try = tmp;
+			} else
+				best = row;
+		}
+	}
+	out[0] = best_type;
+	if (best != out + 1)
+		memcpy (out + 1, best, bytes);
+}
+
+static void png_stripe_row (const png_stripe *s, int y, unsigned char *dst)
+{
+	if (s->palette)
+		png_index_row (s->palette, s->pixbuf, y, dst);
+	else
+		png_pack_row (s->pixbuf, y, dst);
+}
+
+static void png_stripe_run (void *data, void *usr_data)
+{
+	png_stripe *s = (png_stripe *)data;
+	const GPixbuf *pixbuf = s->pixbuf;
+	int bpp, bytes = png_row_bytes (pixbuf, s->palette, &bpp), line = bytes + 1;
+	unsigned char *rows, *cur, *prev, *filtered, *try, *dict = NULL, *tmp;
+	unsigned long out_size, dict_len = 0;
+	z_stream strm;
+	int y, y_dict, n_dict;
+
+	rows = (unsigned char *)calloc(2 * bytes + 2 * line, 1);
+	if (!rows) {
+		s->failed = 1;
+		return;
+	}
+	prev = rows;
+	cur = rows + bytes;
+	filtered = cur + bytes;
+	try = filtered + line;
+
+	memset (&strm, 0, sizeof(strm));
+	if (deflateInit2 (&strm, s->level, Z_DEFLATED, -15, 8, s->strategy) != Z_OK) {
+		free (rows);
+		s->failed = 1;
+		return;
+	}
+
+	/* re-filter the rows in front of the stripe: they are the window the
+	   serial encoder would have at this point */
+	n_dict = (PNG_WINDOW + line - 1) / line;
+	y_dict = s->y0 - n_dict < 0 ? 0 : s->y0 - n_dict;
+	if (y_dict > 0)
+		png_stripe_row (s, y_dict - 1, prev);
+	if (y_dict < s->y0) {
+		dict = (unsigned char *)malloc((s->y0 - y_dict) * line);
+		if (!dict)
+			goto fail;
+	}
+	for (y = y_dict; y < s->y0; y++) {
+		png_stripe_row (s, y, cur);
+		png_filter_row (dict + dict_len, try, cur, prev, bytes, bpp, s->filters);
+		dict_len += line;
+		tmp = prev; prev = cur; cur = tmp;
+	}
+	if (dict_len) {
+		if (dict_len > PNG_WINDOW)
+			deflateSetDictionary (&strm, dict + dict_len - PNG_WINDOW, PNG_WINDOW);
+		else
+			deflateSetDictionary (&strm, dict, dict_len);
+		free (dict);
+		dict = NULL;
+	}
+
+	s->raw_len = (unsigned long)(s->y1 - s->y0) * line;
+	out_size = deflateBound (&strm, s->raw_len) + 16;
+	s->out = (unsigned char *)malloc(2 + out_size + 4);
+	if (!s->out)
+		goto fail;
+	strm.next_out = s->out + 2;
+	strm.avail_out = out_size;
+
+	s->adler = adler32 (0, NULL, 0);
+	for (y = s->y0; y < s->y1; y++) {
+		png_stripe_row (s, y, cur);
+		png_filter_row (filtered, try, cur, prev, bytes, bpp, s->filters);
+		s->adler = adler32 (s->adler, filtered, line);
+		strm.next_in = filtered;
+		strm.avail_in = line;
+		if (deflate (&strm, Z_NO_FLUSH) != Z_OK || strm.avail_in)
+			goto fail;
+		tmp = prev; prev = cur; cur = tmp;
+	}
+	if (deflate (&strm, s->last ? Z_FINISH : Z_SYNC_FLUSH) != (s->last ? Z_STREAM_END : Z_OK))
+		goto fail;
+
+	s->out_len = out_size - strm.avail_out;
+	deflateEnd (&strm);
+	free (rows);
+	return;
+
+fail:
+	deflateEnd (&strm);
+	free (dict);
+	free (rows);
+	s->failed = 1;
+}
+
+static int png_put_chunk (GSaveSink *sink, const char *type, const unsigned char *data, unsigned long len)
+{
+	unsigned char head[8], tail[4];
+	unsigned long crc;
+
+	head[0] = len >> 24; head[1] = len >> 16; head[2] = len >> 8; head[3] = len;
+	memcpy (head + 4, type, 4);
+	crc = crc32 (crc32 (0, NULL, 0), head + 4, 4);
+	if (len)
+		crc = crc32 (crc, data, len);
+	tail[0] = crc >> 24; tail[1] = crc >> 16; tail[2] = crc >> 8; tail[3] = crc;
+
+	if (sink->write (sink, head, 8) < 0 || (len && sink->write (sink, data, len) < 0) || sink->write (sink, tail, 4) < 0)
+		return -1;
+	return 0;
+}
+
+static int png_save_parallel (GSaveSink *sink, GPixbuf *pixbuf, const GSaveOptions *options, const png_palette *pal)
+{
+	static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	unsigned char ihdr[13], sbit[4] = { 8, 8, 8, 8 };
+	int bpp, line = png_row_bytes (pixbuf, pal, &bpp) + 1;
+	int rows, n_stripes, batch, first, i, n, ret = 0;
+	unsigned long adler = adler32 (0, NULL, 0);
+	png_stripe *stripes;
+	void **data;
+
+	ihdr[0] = pixbuf->width >> 24; ihdr[1] = pixbuf->width >> 16; ihdr[2] = pixbuf->width >> 8; ihdr[3] = pixbuf->width;
+	ihdr[4] = pixbuf->height >> 24; ihdr[5] = pixbuf->height >> 16; ihdr[6] = pixbuf->height >> 8; ihdr[7] = pixbuf->height;
+	ihdr[8] = pal ? pal->depth : 8;		/* bit depth */
+	ihdr[9] = pal ? 3 : pixbuf->has_alpha ? 6 : 2;	/* PALETTE, RGB_ALPHA or RGB */
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;	/* deflate, adaptive filters, no interlace */
+
+	if (sink->write (sink, signature, 8) < 0 || png_put_chunk (sink, "IHDR", ihdr, 13) < 0)
+		return -1;
+	if (pal) {
+		if (png_put_chunk (sink, "PLTE", (const unsigned char *)pal->colors, pal->n_colors * 3) < 0 ||
+		    (pal->n_trans && png_put_chunk (sink, "tRNS", pal->trans, pal->n_trans) < 0))
+			return -1;
+	} else if (png_put_chunk (sink, "sBIT", sbit, pixbuf->has_alpha ? 4 : 3) < 0)
+		return -1;
+
+	rows = PNG_STRIPE_BYTES / line;
+	if (rows < 1)
+		rows = 1;
+	n_stripes = (pixbuf->height + rows - 1) / rows;
+	/* a few stripes per thread in flight bounds the memory held */
+	batch = xss_pool_get_max_threads (save_pool) * 2;
+	stripes = (png_stripe *)malloc(batch * sizeof(png_stripe));
+	data = (void **)malloc(batch * sizeof(void *));
+	if (!stripes || !data) {
+		free (stripes);
+		free (data);
+		return -1;
+	}
+
+	for (first = 0; first < n_stripes && !ret; first += n) {
+		n = n_stripes - first < batch ? n_stripes - first : batch;
+		for (i = 0; i < n; i++) {
+			memset (&stripes[i], 0, sizeof(png_stripe));
+			stripes[i].pixbuf = pixbuf;
+			stripes[i].palette = pal;
+			stripes[i].y0 = (first + i) * rows;
+			stripes[i].y1 = stripes[i].y0 + rows < pixbuf->height ? stripes[i].y0 + rows : pixbuf->height;
+			stripes[i].last = first + i == n_stripes - 1;
+			stripes[i].level = png_zlib_level (options);
+			stripes[i].strategy = png_zlib_strategy (options);
+			stripes[i].filters = pal ? G_PNG_FILTER_NONE : png_filters (options);
+			data[i] = &stripes[i];
+		}
+		xss_pool_run (save_pool, png_stripe_run, data, n, NULL);
+
+		for (i = 0; i < n; i++) {
+			png_stripe *s = &stripes[i];
+			unsigned char *p = s->out + 2;
+			unsigned long len = s->out_len;
+
+			if (s->failed || ret) {
+				ret = -1;
+				free (s->out);
+				continue;
+			}
+			adler = adler32_combine (adler, s->adler, s->raw_len);
+			if (first + i == 0) {
+				/* zlib header: deflate, 32K window, level hint as zlib sets it */
+				p -= 2;
+				len += 2;
+				p[0] = 0x78;
+				if (s->level == 0 || s->level == 1 || s->strategy >= Z_HUFFMAN_ONLY)
+					p[1] = 0x01;
+				else if (s->level >= 2 && s->level <= 5)
+					p[1] = 0x5e;
+				else if (s->level >= 7)
+					p[1] = 0xda;
+				else
+					p[1] = 0x9c;
+			}
+			if (s->last) {
+				p[len++] = adler >> 24;
+				p[len++] = adler >> 16;
+				p[len++] = adler >> 8;
+				p[len++] = adler;
+			}
+			ret = png_put_chunk (sink, "IDAT", p, len);
+			free (s->out);
+		}
+	}
+	free (stripes);
+	free (data);
+
+	if (!ret)
+		ret = png_put_chunk (sink, "IEND", NULL, 0);
+	return ret;
+}
+
+/* libpng output through a sink */
+static void png_sink_write (png_structp png_ptr, png_bytep data, png_size_t length)
+{
+	GSaveSink *sink = (GSaveSink *)png_get_io_ptr (png_ptr);
+
+	if (sink->write (sink, data, length) < 0)
+		png_error (png_ptr, "write error");
+}
+
+static void png_sink_flush (png_structp png_ptr)
+{
+	/* the sink is flushed once the file is complete */
+}
+
+static int g_pixbuf_png_image_save(GSaveSink *sink, GPixbuf * pixbuf, const GSaveOptions *options) {
 	png_structp png_ptr;
 	png_infop info_ptr;
-	unsigned char *ptr;
 	unsigned char *pixels;
-	int x, y, j;
-	png_bytep row_ptr, data = NULL;
+	int y, i, n;
+	png_bytep rows[G_SAVE_BAND_ROWS];
 	png_color_8 sig_bit;
 	int w, h, rowstride;
-	int has_alpha;
-	int bpc;
+	int has_alpha, bgr;
+	int bpc, bpp, row_bytes, ret;
+	png_palette *pal = NULL;
+	unsigned char *indexed = NULL;
+
+	if (options->png.palette) {
+		pal = (png_palette *)malloc(sizeof(png_palette));
+		if (pal && !png_palette_build (pal, pixbuf)) {
+			free (pal);
+			pal = NULL;
+		}
+	}
+
+	if (save_pool && pixbuf->bits_per_sample == 8 && pixbuf->width * pixbuf->height >= save_min_pixels) {
+		ret = png_save_parallel (sink, pixbuf, options, pal);
+		free (pal);
+		return ret;
+	}
+
+	/* indexed rows are made a band at a time */
+	if (pal) {
+		indexed = (unsigned char *)malloc(G_SAVE_BAND_ROWS * png_row_bytes (pixbuf, pal, &bpp));
+		if (!indexed) {
+			free (pal);
+			return -1;
+		}
+	}
 
 	bpc = pixbuf->bits_per_sample;
+	bgr = pixbuf->format == G_PIXEL_BGRX || pixbuf->format == G_PIXEL_BGRA;
 	w = pixbuf->width;
 	h = pixbuf->height;
 	rowstride = pixbuf->rowstride;
@@ -129,35 +1282,64 @@ static int g_pixbuf_png_image_save(FILE *f, GPixbuf * pixbuf) {
 	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
 									  NULL, NULL, NULL);
 	if (!png_ptr) {
-		fclose(f);
-		return 0;
+		free(indexed);
+		free(pal);
+		return -1;
 	}
 	info_ptr = png_create_info_struct(png_ptr);
 	if (info_ptr == NULL) {
-		fclose(f);
 		png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
-		return 0;
+		free(indexed);
+		free(pal);
+		return -1;
 	}
 	if (setjmp(png_jmpbuf(png_ptr))) {
-		fclose(f);
-		png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		free(indexed);
+		free(pal);
+		return -1;
+	}
+	png_set_write_fn(png_ptr, sink, png_sink_write, png_sink_flush);
+	/* g_png_filter bits are libpng's PNG_FILTER_* values; like libpng's
+	   own default, palette images are left unfiltered */
+	png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, pal ? PNG_FILTER_NONE : png_filters(options));
+	png_set_compression_level(png_ptr, png_zlib_level(options));
+	if (options->png.strategy != G_PNG_STRATEGY_AUTO)
+		png_set_compression_strategy(png_ptr, png_zlib_strategy(options));
+
+	if (pal) {
+		png_set_IHDR(png_ptr, info_ptr, w, h, pal->depth,
+					 PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+					 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+		png_set_PLTE(png_ptr, info_ptr, pal->colors, pal->n_colors);
+		if (pal->n_trans)
+			png_set_tRNS(png_ptr, info_ptr, pal->trans, pal->n_trans, NULL);
+		png_write_info(png_ptr, info_ptr);
+
+		row_bytes = png_row_bytes (pixbuf, pal, &bpp);
+		for (i = 0; i < G_SAVE_BAND_ROWS; i++)
+			rows[i] = indexed + i * row_bytes;
+		for (y = 0; y < h; y += n) {
+			n = h - y < G_SAVE_BAND_ROWS ? h - y : G_SAVE_BAND_ROWS;
+			for (i = 0; i < n; i++)
+				png_index_row (pal, pixbuf, y + i, rows[i]);
+			png_write_rows(png_ptr, rows, n);
+		}
+		png_write_end(png_ptr, info_ptr);
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		free(indexed);
+		free(pal);
 		return 0;
 	}
-	png_init_io(png_ptr, f);
+
 	if (has_alpha) {
 		png_set_IHDR(png_ptr, info_ptr, w, h, bpc,
 					 PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
 					 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-#ifndef LITTLE
-		png_set_swap_alpha(png_ptr);
-#else
-		png_set_bgr(png_ptr);
-#endif
 	} else {
 		png_set_IHDR(png_ptr, info_ptr, w, h, bpc,
 					 PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
 					 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-		data = malloc(w * 3 * sizeof(char));
 	}
 	sig_bit.red = bpc;
 	sig_bit.green = bpc;
@@ -167,24 +1349,21 @@ static int g_pixbuf_png_image_save(FILE *f, GPixbuf * pixbuf) {
 	png_write_info(png_ptr, info_ptr);
 	png_set_shift(png_ptr, &sig_bit);
 	png_set_packing(png_ptr);
-
-	ptr = pixels;
-	for (y = 0; y < h; y++) {
-		if (has_alpha)
-			row_ptr = (png_bytep) ptr;
-		else {
-			for (j = 0, x = 0; x < w; x++)
-				memcpy(&(data[x * 3]), &(ptr[x * 3]), 3);
-
-			row_ptr = (png_bytep) data;
-		}
-		png_write_rows(png_ptr, &row_ptr, 1);
-		ptr += rowstride;
+	/* let libpng swap and drop bytes of server pixels on the fly */
+	if (bgr)
+		png_set_bgr(png_ptr);
+	if (pixbuf->format == G_PIXEL_BGRX)
+		png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
+
+	/* every layout is read in place, in batches of rows */
+	for (y = 0; y < h; y += n) {
+		n = h - y < G_SAVE_BAND_ROWS ? h - y : G_SAVE_BAND_ROWS;
+		for (i = 0; i < n; i++)
+			rows[i] = (png_bytep) (pixels + (y + i) * rowstride);
+		png_write_rows(png_ptr, rows, n);
 	}
-	if (data)
-		free(data);
 	png_write_end(png_ptr, info_ptr);
-	png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
 	return 0;
 }
 
@@ -208,39 +1387,10 @@ static int g_pixbuf_png_image_save(FILE *f, GPixbuf * pixbuf) {
 			  buf += 4; }
 
 
-static int save_to_file_cb (const char *buf, unsigned long count,FILE *f)
-{
-	int bytes;
-	
-	while (count > 0) {
-		bytes = fwrite (buf, sizeof (char), count, f);
-		if (bytes <= 0)
-			break;
-		count -= bytes;
-		buf += bytes;
-	}
-
-	if (count) {
-		return -1;
-	}
-	
-	return 0;
-}
-
-
-static int g_pixbuf_bmp_image_save(FILE *f, GPixbuf *pixbuf)
+/* 24 bit BI_RGB headers; a negative height marks a top-down bitmap */
+static void bmp_fill_header (unsigned char *BFH_BIH, unsigned int width, int height, unsigned int size)
 {
-	unsigned int width, height, channel, size, stride, src_stride, x, y;
-	unsigned char BFH_BIH[54], *pixels, *buf, *src, *dst, *dst_line;
-	int ret;
-
-	width = pixbuf->width;
-	height = pixbuf->height;
-	channel = pixbuf->n_channels;
-	pixels = pixbuf->pixels;
-	src_stride = pixbuf->rowstride;
-	stride = (width * 3 + 3) & ~3;
-	size = stride * height;
+	unsigned char *dst;
 
 	/* filling BFH */
 	dst = BFH_BIH;
@@ -262,27 +1412,58 @@ static int g_pixbuf_bmp_image_save(FILE *f, GPixbuf *pixbuf)
 	put32 (dst, 0);			/* biYPelsPerMeter */
 	put32 (dst, 0);			/* biClrUsed */
 	put32 (dst, 0);			/* biClrImportant */
+}
+
+/* rows of BGR per write, about 1M */
+#define BMP_BATCH_BYTES (1024 * 1024)
+
+static int g_pixbuf_bmp_image_save(GSaveSink *sink, GPixbuf *pixbuf)
+{
+	unsigned int width, height, channel, size, stride, src_stride, x, y, batch, rows;
+	unsigned char BFH_BIH[54], *pixels, *buf, *src, *dst, *dst_line;
+	int ret = 0, r, b;
+
+	width = pixbuf->width;
+	height = pixbuf->height;
+	channel = pixbuf->n_channels;
+	pixel_offsets (pixbuf, &r, &b);
+	pixels = pixbuf->pixels;
+	src_stride = pixbuf->rowstride;
+	stride = (width * 3 + 3) & ~3;
+	size = stride * height;
 
-	if (save_to_file_cb((char *)BFH_BIH, 14 + 40, f) < 0)
+	bmp_fill_header (BFH_BIH, width, height, size);
+	if (sink->write (sink, BFH_BIH, 14 + 40) < 0)
 		return -1;
 
-	dst_line = buf = (unsigned char*)malloc(size * sizeof(unsigned char));
+	batch = stride ? BMP_BATCH_BYTES / stride : 1;
+	if (batch < 1)
+		batch = 1;
+	if (batch > height)
+		batch = height;
+	buf = (unsigned char*)malloc((size_t)batch * stride);
 	if (!buf) {
 		return -1;
 	}
+	/* the padding bytes stay zero */
+	memset (buf, 0, (size_t)batch * stride);
 
 	/* saving as a bottom-up bmp */
 	pixels += (height - 1) * src_stride;
-	for (y = 0; y < height; ++y, pixels -= src_stride, dst_line += stride) {
+	for (y = 0, rows = 0, dst_line = buf; y < height && !ret; ++y, pixels -= src_stride, dst_line += stride) {
 		dst = dst_line;
 		src = pixels;
 		for (x = 0; x < width; ++x, dst += 3, src += channel) {
-			dst[0] = src[2];
+			dst[0] = src[b];
 			dst[1] = src[1];
-			dst[2] = src[0];
+			dst[2] = src[r];
+		}
+		if (++rows == batch || y + 1 == height) {
+			ret = sink->write (sink, buf, (size_t)rows * stride);
+			rows = 0;
+			dst_line = buf - stride;
 		}
 	}
-	ret = save_to_file_cb ((char *)buf, size, f);
 	free (buf);
 
 	return ret;
@@ -305,49 +1486,35 @@ struct _IconEntry {
 	unsigned char *and;
 };
 
-static int write8 (FILE  *f, unsigned char   *data, int      count)
+static int write8 (GSaveSink *sink, unsigned char   *data, int      count)
 {
-  int bytes;
-  int written;
-
-  written = 0;
-  while (count > 0)
-    {
-      bytes = fwrite ((char*) data, sizeof (char), count, f);
-      if (bytes <= 0)
-        break;
-      count -= bytes;
-      data += bytes;
-      written += bytes;
-    }
-
-  return written;
+  return sink->write (sink, data, count);
 }
 
-static int write16 (FILE   *f, unsigned short  *data, int  count)
+static int write16 (GSaveSink *sink, unsigned short  *data, int  count)
 {
   int i;
 
   for (i = 0; i < count; i++)
 	  data[i] = UINT16_TO_LE (data[i]);
 
-  return write8 (f, (unsigned char*) data, count * 2);
+  return write8 (sink, (unsigned char*) data, count * 2);
 }
 
-static int write32 (FILE     *f, unsigned int  *data, int  count)
+static int write32 (GSaveSink *sink, unsigned int  *data, int  count)
 {
   int i;
 
   for (i = 0; i < count; i++)
 	  data[i] = UINT32_TO_LE (data[i]);
   
-  return write8 (f, (unsigned char*) data, count * 4);
+  return write8 (sink, (unsigned char*) data, count * 4);
 }
 
 
 static int fill_entry (IconEntry *icon, GPixbuf *pixbuf, int  hot_x, int  hot_y){
 	unsigned char *p, *pixels, *and, *xor;
-	int n_channels, v, x, y;
+	int n_channels, has_alpha, r, b, v, x, y;
 
 	if (icon->width > 255 || icon->height > 255) {
 		return -1;
@@ -381,15 +1548,20 @@ static int fill_entry (IconEntry *icon, GPixbuf *pixbuf, int  hot_x, int  hot_y)
 
 	if ((icon->xor_rowstride % 4) != 0)
 		icon->xor_rowstride = 4 * ((icon->xor_rowstride / 4) + 1);
-	icon->xor = (unsigned char*)malloc(icon->xor_rowstride * icon->height * sizeof(unsigned char));
+	icon->xor = (unsigned char*)calloc(icon->xor_rowstride * icon->height, sizeof(unsigned char));
 	
 	icon->and_rowstride = (icon->width + 7) / 8;
 	if ((icon->and_rowstride % 4) != 0)
 		icon->and_rowstride = 4 * ((icon->and_rowstride / 4) + 1);
-	icon->and = (unsigned char*)malloc(icon->and_rowstride * icon->height * sizeof(unsigned char));
+	/* the mask is or'ed in bit by bit */
+	icon->and = (unsigned char*)calloc(icon->and_rowstride * icon->height, sizeof(unsigned char));
+	if (!icon->xor || !icon->and)
+		return -1;
 
 	pixels = pixbuf->pixels;
 	n_channels = pixbuf->n_channels;
+	has_alpha = pixbuf->has_alpha;
+	pixel_offsets (pixbuf, &r, &b);
 	for (y = 0; y < icon->height; y++) {
 		p = pixels + pixbuf->rowstride * (icon->height - 1 - y);
 		and = icon->and + icon->and_rowstride * y;
@@ -397,11 +1569,11 @@ static int fill_entry (IconEntry *icon, GPixbuf *pixbuf, int  hot_x, int  hot_y)
 		for (x = 0; x < icon->width; x++) {
 			switch (icon->depth) {
 			case 32:
-				xor[0] = p[2];
+				xor[0] = p[b];
 				xor[1] = p[1];
-				xor[2] = p[0];
+				xor[2] = p[r];
 				xor[3] = 0xff;
-				if (n_channels == 4) {
+				if (has_alpha) {
 					xor[3] = p[3];
 					if (p[3] < 0x80)
 						*and |= 1 << (7 - x % 8);
@@ -409,18 +1581,18 @@ static int fill_entry (IconEntry *icon, GPixbuf *pixbuf, int  hot_x, int  hot_y)
 				xor += 4;
 				break;
 			case 24:
-				xor[0] = p[2];
+				xor[0] = p[b];
 				xor[1] = p[1];
-				xor[2] = p[0];
-				if (n_channels == 4 && p[3] < 0x80)
+				xor[2] = p[r];
+				if (has_alpha && p[3] < 0x80)
 					*and |= 1 << (7 - x % 8);
 				xor += 3;
 				break;
 			case 16:
-				v = ((p[0] >> 3) << 10) | ((p[1] >> 3) << 5) | (p[2] >> 3);
+				v = ((p[r] >> 3) << 10) | ((p[1] >> 3) << 5) | (p[b] >> 3);
 				xor[0] = v & 0xff;
 				xor[1] = v >> 8;
-				if (n_channels == 4 && p[3] < 0x80)
+				if (has_alpha && p[3] < 0x80)
 					*and |= 1 << (7 - x % 8);
 				xor += 2;
 				break;
@@ -435,15 +1607,15 @@ static int fill_entry (IconEntry *icon, GPixbuf *pixbuf, int  hot_x, int  hot_y)
 	return 0;
 }
 
+/* g_list_free() frees the entry itself */
 static void free_entry (IconEntry *icon)
 {
 	free (icon->colors);
 	free (icon->and);
 	free (icon->xor);
-	free (icon);
 }
 
-static void write_icon (FILE *f, GList *entries)
+static int write_icon (GSaveSink *sink, GList *entries)
 {
 	IconEntry *icon;
 	GList *entry;
@@ -465,7 +1637,8 @@ static void write_icon (FILE *f, GList *entries)
 	words[0] = 0;
 	words[1] = type;
 	words[2] = n_entries;
-	write16 (f, words, 3);
+	if (write16 (sink, words, 3) < 0)
+		return -1;
 	
 	offset = 6 + 16 * n_entries;
 
@@ -478,7 +1651,8 @@ static void write_icon (FILE *f, GList *entries)
 		bytes[1] = icon->height;
 		bytes[2] = icon->n_colors;
 		bytes[3] = 0;
-		write8 (f, bytes, 4);
+		if (write8 (sink, bytes, 4) < 0)
+			return -1;
 		if (type == 1) {
 			words[0] = 1;
 			words[1] = icon->depth;
@@ -487,10 +1661,10 @@ static void write_icon (FILE *f, GList *entries)
 			words[0] = icon->hot_x;
 			words[1] = icon->hot_y;
 		}
-		write16 (f, words, 2);
 		dwords[0] = size;
 		dwords[1] = offset;
-		write32 (f, dwords, 2);
+		if (write16 (sink, words, 2) < 0 || write32 (sink, dwords, 2) < 0)
+			return -1;
 
 		offset += size;
 	}
@@ -502,200 +1676,961 @@ static void write_icon (FILE *f, GList *entries)
 		dwords[0] = 40;
 		dwords[1] = icon->width;
 		dwords[2] = icon->height * 2;
-		write32 (f, dwords, 3);
+		if (write32 (sink, dwords, 3) < 0)
+			return -1;
 		words[0] = 1;
 		words[1] = icon->depth;
-		write16 (f, words, 2);
+		if (write16 (sink, words, 2) < 0)
+			return -1;
 		dwords[0] = 0;
 		dwords[1] = 0;
 		dwords[2] = 0;
 		dwords[3] = 0;
 		dwords[4] = 0;
 		dwords[5] = 0;
-		write32 (f, dwords, 6);
+		if (write32 (sink, dwords, 6) < 0)
+			return -1;
 
 		/* image data */
-		write8 (f, icon->xor, icon->xor_rowstride * icon->height);
-		write8 (f, icon->and, icon->and_rowstride * icon->height);
+		if (write8 (sink, icon->xor, icon->xor_rowstride * icon->height) < 0 ||
+		    write8 (sink, icon->and, icon->and_rowstride * icon->height) < 0)
+			return -1;
 	}
+
+	return 0;
 }
 
 
 
 
-static int g_pixbuf_ico_image_save (FILE *f, GPixbuf *pixbuf)
+static int g_pixbuf_ico_image_save (GSaveSink *sink, GPixbuf *pixbuf)
 {
-	int hot_x, hot_y;
+	int hot_x, hot_y, ret;
 	IconEntry *icon;
 	GList *entries = NULL;
 
 	/* support only single-image ICOs for now */
-	icon = (IconEntry*)malloc(sizeof(IconEntry));
+	icon = (IconEntry*)calloc(1, sizeof(IconEntry));
+	if (!icon)
+		return -1;
 	icon->width = pixbuf->width;
 	icon->height = pixbuf->height;
 	icon->depth = pixbuf->has_alpha ? 32 : 24;
 	hot_x = -1;
 	hot_y = -1;
 
-	if (!fill_entry (icon, pixbuf, hot_x, hot_y)) {
+	if (fill_entry (icon, pixbuf, hot_x, hot_y) < 0) {
 		free_entry (icon);
+		free (icon);
 		return -1;
 	}
 
 	entries = g_list_append (entries, icon); 
-	write_icon (f, entries);
+	ret = write_icon (sink, entries);
 
 	g_list_foreach (entries, (FUNC)free_entry, NULL);
 	g_list_free (entries);
 
+	return ret;
+}
+
+
+/*
+  QOI: a byte oriented format with no entropy coder, several times
+  faster than PNG at any level. Rows are encoded straight from the
+  pixbuf, BGRX captures included, in batches of about 1M of output.
+*/
+#define QOI_BATCH_BYTES (1024 * 1024)
+
+static int qoi_batch_rows (int width)
+{
+	size_t rows = QOI_BATCH_BYTES / QOI_ROW_BOUND (width);
+
+	return rows > 0 ? (int)rows : 1;
+}
+
+static void qoi_set_desc (qoi_desc *desc, int width, int height, int has_alpha)
+{
+	desc->width = width;
+	desc->height = height;
+	desc->channels = has_alpha ? 4 : 3;
+	desc->colorspace = 0;
+}
+
+static int g_pixbuf_qoi_image_save(GSaveSink *sink, GPixbuf *pixbuf)
+{
+	qoi_desc desc;
+	qoi_state s;
+	unsigned char *buf, *o;
+	int y, rows, batch, bgr, ret = 0;
+
+	if (pixbuf->width <= 0 || pixbuf->height <= 0 ||
+	    (unsigned int)pixbuf->height > QOI_PIXELS_MAX / (unsigned int)pixbuf->width)
+		return -1;
+
+	batch = qoi_batch_rows (pixbuf->width);
+	if (batch > pixbuf->height)
+		batch = pixbuf->height;
+	buf = (unsigned char *)malloc(QOI_ROW_BOUND (pixbuf->width) * batch + QOI_HEADER_SIZE + QOI_PADDING_SIZE + 1);
+	if (!buf)
+		return -1;
+
+	bgr = pixbuf->format == G_PIXEL_BGRX || pixbuf->format == G_PIXEL_BGRA;
+	qoi_set_desc (&desc, pixbuf->width, pixbuf->height, pixbuf->has_alpha);
+	qoi_write_header (buf, &desc);
+	o = buf + QOI_HEADER_SIZE;
+	qoi_state_init (&s);
+
+	for (y = 0; y < pixbuf->height && !ret; y += rows) {
+		rows = pixbuf->height - y < batch ? pixbuf->height - y : batch;
+		o = qoi_encode_rows (&s, pixbuf->pixels + (size_t)y * pixbuf->rowstride, pixbuf->rowstride,
+				     pixbuf->width, rows, pixbuf->n_channels, bgr, pixbuf->has_alpha, o);
+		if (y + rows == pixbuf->height)
+			o = qoi_encode_finish (&s, o);
+		ret = sink->write (sink, buf, o - buf);
+		o = buf;
+	}
+	free (buf);
+
+	return ret;
+}
+
+GPixbuf *g_pixbuf_new_from_qoi (FILE *fp)
+{
+	GPixbuf *pixbuf = NULL;
+	qoi_desc desc;
+	qoi_state s;
+	const unsigned char *p, *end;
+	unsigned char *data;
+	size_t size;
+	int y;
+
+	data = qoi_read_file (fp, &size);
+	if (!data)
+		return NULL;
+	if (qoi_read_header (data, &desc) < 0)
+		goto out;
+	pixbuf = g_pixbuf_new (24, LSBFirst, desc.channels == 4, 8, desc.width, desc.height);
+	if (!pixbuf)
+		goto out;
+
+	qoi_state_init (&s);
+	p = data + QOI_HEADER_SIZE;
+	end = data + size - QOI_PADDING_SIZE;
+	for (y = 0; y < pixbuf->height && p; y++)
+		p = qoi_decode_row (&s, p, end, pixbuf->pixels + (size_t)y * pixbuf->rowstride,
+				    pixbuf->width, pixbuf->n_channels);
+	if (!p) {
+		g_pixbuf_free (pixbuf);
+		pixbuf = NULL;
+	}
+
+out:
+	free (data);
+	return pixbuf;
+}
+
+
+/*
+  TIFF output: libtiff seeks back to patch the header once the directory
+  is written, so a seekable sink gets the strips straight as they fill
+  up, and anything else (a pipe) gets the file built in a buffer sink
+  first
+*/
+#define TIFF_STRIP_BYTES (1024 * 1024)
+
+typedef struct {
+	GSaveSink *sink;
+	GSaveSink *to;		/* sink, or memory */
+	long long base;		/* where the tiff starts in to */
+	long long pos, end;	/* relative to base */
+	GSaveSink *memory;	/* NULL when writing to sink */
+} TiffOutput;
+
+/* nothing is read back in "w" mode */
+static tsize_t tiff_output_read (thandle_t handle, tdata_t buf, tsize_t size)
+{
+	return 0;
+}
+
+/* the position is kept here, so only a real move costs a seek */
+static tsize_t tiff_output_write (thandle_t handle, tdata_t buf, tsize_t size)
+{
+	TiffOutput *out = (TiffOutput *)handle;
+
+	if (out->to->write (out->to, buf, size) < 0)
+		return -1;
+	out->pos += size;
+	if (out->pos > out->end)
+		out->end = out->pos;
+	return size;
+}
+
+static toff_t tiff_output_seek (thandle_t handle, toff_t offset, int whence)
+{
+	TiffOutput *out = (TiffOutput *)handle;
+	long long pos;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = out->pos + offset;
+		break;
+	case SEEK_END:
+		pos = out->end + offset;
+		break;
+	default:
+		return (toff_t)-1;
+	}
+	if (pos != out->pos && out->to->seek (out->to, out->base + pos, SEEK_SET) < 0)
+		return (toff_t)-1;
+	out->pos = pos;
+	return pos;
+}
+
+static int tiff_output_close_cb (thandle_t handle)
+{
 	return 0;
 }
 
+static toff_t tiff_output_size (thandle_t handle)
+{
+	return ((TiffOutput *)handle)->end;
+}
+
+static TIFF *tiff_output_open (TiffOutput *out, GSaveSink *sink)
+{
+	TIFF *tiff;
+
+	memset (out, 0, sizeof(TiffOutput));
+	out->sink = sink;
+	out->to = sink;
+	out->base = sink->seek ? sink->seek (sink, 0, SEEK_CUR) : -1;
+	if (out->base < 0) {
+		out->memory = g_save_sink_new_buffer (0);
+		if (!out->memory)
+			return NULL;
+		out->to = out->memory;
+		out->base = 0;
+	}
+
+	tiff = TIFFClientOpen ("libtiff-pixbuf", "w", (thandle_t)out,
+			       tiff_output_read, tiff_output_write,
+			       tiff_output_seek, tiff_output_close_cb,
+			       tiff_output_size, NULL, NULL);
+	if (!tiff) {
+		g_save_sink_free (out->memory);
+		out->memory = NULL;
+	}
+	return tiff;
+}
+
+/*
+  write the directory and leave the sink after the tiff; failed says the
+  pixels did not all go in, and nothing is copied out of memory then
+*/
+static int tiff_output_close (TiffOutput *out, TIFF *tiff, int failed)
+{
+	const unsigned char *data;
+	size_t size;
+	int ret = failed ? -1 : 0;
+
+	if (!TIFFFlush (tiff))
+		ret = -1;
+	TIFFClose (tiff);
+
+	if (!out->memory) {
+		if (out->pos != out->end && out->sink->seek (out->sink, out->base + out->end, SEEK_SET) < 0)
+			ret = -1;
+		return ret;
+	}
+	if (!ret) {
+		data = g_save_sink_get_buffer (out->memory, &size);
+		ret = out->sink->write (out->sink, data, size);
+	}
+	g_save_sink_free (out->memory);
+	out->memory = NULL;
+	return ret;
+}
+
+/* TIFFTAG_COMPRESSION value, plus horizontal differencing where it helps */
+static void tiff_set_compression (TIFF *tiff, g_tiff_compression compression)
+{
+	switch (compression) {
+	case G_TIFF_COMPRESSION_LZW:
+		TIFFSetField (tiff, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+		TIFFSetField (tiff, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+		break;
+	case G_TIFF_COMPRESSION_DEFLATE:
+		TIFFSetField (tiff, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+		TIFFSetField (tiff, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+		break;
+	case G_TIFF_COMPRESSION_PACKBITS:
+		TIFFSetField (tiff, TIFFTAG_COMPRESSION, COMPRESSION_PACKBITS);
+		break;
+	default:
+		TIFFSetField (tiff, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+		break;
+	}
+}
 
-typedef struct _TiffSaveContent{
-        char *buffer;
-        unsigned int allocated;
-        unsigned int used;
-        unsigned int pos;
-} TiffSaveContext;
+/* each strip is compressed on its own, so not too small for the codec */
+static int tiff_rows_per_strip (int width, int height, int has_alpha, const GSaveOptions *options)
+{
+	int rows = options->tiff.rows_per_strip;
+
+	if (rows <= 0)
+		rows = TIFF_STRIP_BYTES / (width * (has_alpha ? 4 : 3));
+	if (rows < 1)
+		rows = 1;
+	if (rows > height)
+		rows = height;
+	return rows;
+}
 
-static tsize_t tiff_save_read (thandle_t handle, tdata_t buf, tsize_t size)
+/* tags of an 8 bit RGB or RGBA image and its strips */
+static void tiff_set_layout (TIFF *tiff, int width, int height, int has_alpha, const GSaveOptions *options)
 {
-        return -1;
+	unsigned short alpha_samples[1] = { EXTRASAMPLE_UNASSALPHA };
+
+	TIFFSetField (tiff, TIFFTAG_IMAGEWIDTH, width);
+	TIFFSetField (tiff, TIFFTAG_IMAGELENGTH, height);
+	TIFFSetField (tiff, TIFFTAG_BITSPERSAMPLE, 8);
+	TIFFSetField (tiff, TIFFTAG_SAMPLESPERPIXEL, has_alpha ? 4 : 3);
+	if (has_alpha)
+		TIFFSetField (tiff, TIFFTAG_EXTRASAMPLES, 1, alpha_samples);
+	TIFFSetField (tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+	TIFFSetField (tiff, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);
+	TIFFSetField (tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField (tiff, TIFFTAG_ROWSPERSTRIP, tiff_rows_per_strip (width, height, has_alpha, options));
+	tiff_set_compression (tiff, options->tiff.compression);
 }
 
-static tsize_t tiff_save_write (thandle_t handle, tdata_t buf, tsize_t size)
+/*
+  Parallel TIFF: strips are packed, differenced and compressed on the
+  save pool with the codecs libtiff would use (zlib for deflate, LZW
+  and PackBits below), then handed to libtiff in order through
+  TIFFWriteRawStrip(), which only lays them out in the file.
+*/
+typedef struct {
+	const GPixbuf *pixbuf;
+	g_tiff_compression compression;
+	int y0, y1;		/* rows of the strip */
+	unsigned char *out;
+	size_t out_len;
+	int failed;
+} tiff_strip;
+
+/* one row in RGB(A) order, with PREDICTOR_HORIZONTAL applied if asked */
+static void tiff_pack_row (const GPixbuf *pixbuf, int y, unsigned char *dst, int predictor)
 {
-        TiffSaveContext *context = (TiffSaveContext *)handle;
+	const unsigned char *src = pixbuf->pixels + y * pixbuf->rowstride;
+	int channel = pixbuf->has_alpha ? 4 : 3, n = pixbuf->width * channel;
+	int i, x;
+
+	if (pixbuf->format == G_PIXEL_BGRX || pixbuf->format == G_PIXEL_BGRA) {
+		for (x = 0, i = 0; x < pixbuf->width; x++, src += 4, i += channel) {
+			dst[i] = src[2];
+			dst[i + 1] = src[1];
+			dst[i + 2] = src[0];
+			if (channel == 4)
+				dst[i + 3] = src[3];
+		}
+	} else
+		memcpy (dst, src, n);
 
-        /* Modify buffer length */
-        if (context->pos + size > context->used)
-                context->used = context->pos + size;
+	/* every sample less the same one of the pixel to its left */
+	if (predictor)
+		for (i = n - 1; i >= channel; i--)
+			dst[i] -= dst[i - channel];
+}
 
-        /* Realloc */
-        if (context->used > context->allocated) {
-                context->buffer = realloc(context->buffer, context->pos + size);
-                context->allocated = context->used;
-        }
+/* PackBits of one row, runs never cross rows; at most n + (n + 127) / 128 bytes */
+static unsigned char *tiff_packbits_row (const unsigned char *p, int n, unsigned char *o)
+{
+	int run;
+
+	while (n > 0) {
+		for (run = 1; run < n && run < 128 && p[run] == p[0]; run++)
+			;
+		if (run > 1) {
+			*o++ = (unsigned char)(1 - run);
+			*o++ = p[0];
+		} else {
+			/* literal bytes up to where three equal ones start */
+			for (run = 1; run < n && run < 128; run++)
+				if (run + 2 < n && p[run] == p[run + 1] && p[run] == p[run + 2])
+					break;
+			*o++ = run - 1;
+			memcpy (o, p, run);
+			o += run;
+		}
+		p += run;
+		n -= run;
+	}
+	return o;
+}
 
-        /* Now copy the data */
-        memcpy (context->buffer + context->pos, buf, size);
+/*
+  TIFF LZW as libtiff writes it: msb first codes of 9 to 12 bits, a
+  clear code up front and whenever the table fills, and the code width
+  growing one entry early. The hash slots carry a generation number, so
+  a new table costs nothing until the numbers wrap
+*/
+#define LZW_CLEAR	256
+#define LZW_EOI		257
+#define LZW_FIRST	258
+#define LZW_FULL	4094		/* libtiff's CODE_MAX - 1 */
+#define LZW_HASH	8192
+
+typedef struct {
+	unsigned int key[LZW_HASH];	/* generation << 20 | byte << 12 | prefix */
+	unsigned short code[LZW_HASH];
+	unsigned int gen;
+	unsigned char *o;
+	unsigned long bits;	/* pending output, msb first */
+	int n_bits;
+} tiff_lzw;
+
+static void lzw_new_table (tiff_lzw *z)
+{
+	if (++z->gen == 4096) {
+		memset (z->key, 0, sizeof(z->key));
+		z->gen = 1;
+	}
+}
 
-        /* Update pos */
-        context->pos += size;
+static void lzw_put (tiff_lzw *z, unsigned int code, int width)
+{
+	z->bits = (z->bits << width) | code;
+	z->n_bits += width;
+	while (z->n_bits >= 8) {
+		z->n_bits -= 8;
+		*z->o++ = z->bits >> z->n_bits;
+	}
+}
 
-        return size;
+/* one strip; at most n + n / 2 + 8 bytes */
+static unsigned char *tiff_lzw_strip (tiff_lzw *z, const unsigned char *p, size_t n, unsigned char *o)
+{
+	unsigned int ent, fcode, h, free_ent = LZW_FIRST;
+	int width = 9;
+	size_t i;
+
+	z->o = o;
+	z->bits = 0;
+	z->n_bits = 0;
+	lzw_new_table (z);
+	lzw_put (z, LZW_CLEAR, width);
+
+	if (n) {
+		ent = p[0];
+		for (i = 1; i < n; i++) {
+			fcode = (unsigned int)p[i] << 12 | ent;
+			h = (fcode * 2654435761u) >> 19;
+			while (z->key[h] >> 20 == z->gen && (z->key[h] & 0xfffff) != fcode)
+				h = (h + 1) & (LZW_HASH - 1);
+			if (z->key[h] >> 20 == z->gen) {
+				ent = z->code[h];
+				continue;
+			}
+			lzw_put (z, ent, width);
+			ent = p[i];
+			z->key[h] = z->gen << 20 | fcode;
+			z->code[h] = free_ent++;
+			if (free_ent == LZW_FULL) {
+				lzw_put (z, LZW_CLEAR, width);
+				lzw_new_table (z);
+				free_ent = LZW_FIRST;
+				width = 9;
+			} else if (free_ent > (1u << width) - 1)
+				width++;
+		}
+		/* the decoder adds an entry for the last code too */
+		lzw_put (z, ent, width);
+		if (++free_ent == LZW_FULL) {
+			lzw_put (z, LZW_CLEAR, width);
+			width = 9;
+		} else if (free_ent > (1u << width) - 1)
+			width++;
+	}
+	lzw_put (z, LZW_EOI, width);
+	if (z->n_bits)
+		*z->o++ = z->bits << (8 - z->n_bits);
+	return z->o;
 }
 
-static toff_t tiff_save_seek (thandle_t handle, toff_t offset, int whence)
+static void tiff_strip_run (void *data, void *usr_data)
 {
-        TiffSaveContext *context = (TiffSaveContext *)handle;
+	tiff_strip *s = (tiff_strip *)data;
+	const GPixbuf *pixbuf = s->pixbuf;
+	int line = pixbuf->width * (pixbuf->has_alpha ? 4 : 3), rows = s->y1 - s->y0, y;
+	size_t raw_len = (size_t)line * rows, bound;
+	unsigned char *raw, *o;
+	tiff_lzw *z = NULL;
+	uLongf len;
+
+	if (s->compression == G_TIFF_COMPRESSION_DEFLATE)
+		bound = compressBound (raw_len);
+	else if (s->compression == G_TIFF_COMPRESSION_LZW)
+		bound = raw_len + raw_len / 2 + 8;
+	else
+		bound = raw_len + (size_t)rows * ((line + 127) / 128);
+
+	raw = (unsigned char *)malloc(raw_len);
+	s->out = (unsigned char *)malloc(bound);
+	if (s->compression == G_TIFF_COMPRESSION_LZW)
+		z = (tiff_lzw *)calloc(1, sizeof(tiff_lzw));
+	if (!raw || !s->out || (s->compression == G_TIFF_COMPRESSION_LZW && !z)) {
+		s->failed = 1;
+		goto out;
+	}
 
-        switch (whence) {
-        case SEEK_SET:
-                context->pos = offset;
-                break;
-        case SEEK_CUR:
-                context->pos += offset;
-                break;
-        case SEEK_END:
-                context->pos = context->used + offset;
-                break;
-        default:
-                return -1;
-        }
-        return context->pos;
+	for (y = 0; y < rows; y++)
+		tiff_pack_row (pixbuf, s->y0 + y, raw + (size_t)y * line, s->compression != G_TIFF_COMPRESSION_PACKBITS);
+
+	switch (s->compression) {
+	case G_TIFF_COMPRESSION_DEFLATE:
+		len = bound;
+		if (compress2 (s->out, &len, raw, raw_len, Z_DEFAULT_COMPRESSION) != Z_OK)
+			s->failed = 1;
+		s->out_len = len;
+		break;
+	case G_TIFF_COMPRESSION_LZW:
+		s->out_len = tiff_lzw_strip (z, raw, raw_len, s->out) - s->out;
+		break;
+	default:
+		for (y = 0, o = s->out; y < rows; y++)
+			o = tiff_packbits_row (raw + (size_t)y * line, line, o);
+		s->out_len = o - s->out;
+		break;
+	}
+
+out:
+	free (raw);
+	free (z);
 }
 
-static int tiff_save_close (thandle_t context)
+static int tiff_save_parallel (TIFF *tiff, GPixbuf *pixbuf, const GSaveOptions *options)
 {
-        return 0;
+	int rows, n_strips, batch, first, i, n, ret = 0;
+	tiff_strip *strips;
+	void **data;
+
+	rows = tiff_rows_per_strip (pixbuf->width, pixbuf->height, pixbuf->has_alpha, options);
+	n_strips = (pixbuf->height + rows - 1) / rows;
+	/* a few strips per thread in flight bounds the memory held */
+	batch = xss_pool_get_max_threads (save_pool) * 2;
+	strips = (tiff_strip *)malloc(batch * sizeof(tiff_strip));
+	data = (void **)malloc(batch * sizeof(void *));
+	if (!strips || !data) {
+		free (strips);
+		free (data);
+		return -1;
+	}
+
+	for (first = 0; first < n_strips && !ret; first += n) {
+		n = n_strips - first < batch ? n_strips - first : batch;
+		for (i = 0; i < n; i++) {
+			memset (&strips[i], 0, sizeof(tiff_strip));
+			strips[i].pixbuf = pixbuf;
+			strips[i].compression = options->tiff.compression;
+			strips[i].y0 = (first + i) * rows;
+			strips[i].y1 = strips[i].y0 + rows < pixbuf->height ? strips[i].y0 + rows : pixbuf->height;
+			data[i] = &strips[i];
+		}
+		xss_pool_run (save_pool, tiff_strip_run, data, n, NULL);
+
+		for (i = 0; i < n; i++) {
+			if (strips[i].failed || (!ret && TIFFWriteRawStrip (tiff, first + i, strips[i].out, strips[i].out_len) < 0))
+				ret = -1;
+			free (strips[i].out);
+		}
+	}
+	free (strips);
+	free (data);
+
+	return ret;
 }
 
-static toff_t tiff_save_size (thandle_t handle)
+static int g_pixbuf_tiff_image_save(GSaveSink *sink, GPixbuf *pixbuf, const GSaveOptions *options)
 {
-        return -1;
+	TIFF *tiff;
+	TiffOutput out;
+	int width, height, rowstride;
+	unsigned char *pixels;
+	int has_alpha, bgr;
+	int x, y;
+	unsigned char *line = NULL, *src, *dst;
+	unsigned char *icc_profile = NULL;
+	unsigned long icc_profile_size = 0;
+	int failed = 0;
+
+	tiff = tiff_output_open (&out, sink);
+	if (!tiff)
+		return -1;
+
+	rowstride = pixbuf->rowstride;
+	pixels = pixbuf->pixels;
+	has_alpha = pixbuf->has_alpha;
+	height = pixbuf->height;
+	width = pixbuf->width;
+
+	tiff_set_layout (tiff, width, height, has_alpha, options);
+
+	if (icc_profile != NULL)
+		TIFFSetField (tiff, TIFFTAG_ICCPROFILE, icc_profile_size, icc_profile);
+
+	if (save_pool && options->tiff.compression != G_TIFF_COMPRESSION_NONE &&
+	    width * height >= save_min_pixels) {
+		failed = tiff_save_parallel (tiff, pixbuf, options) < 0;
+		free (icc_profile);
+		return tiff_output_close (&out, tiff, failed);
+	}
+
+	/*
+	  tiff wants RGB order, server pixels go through a scratch row; so
+	  do all rows under a predictor, which differences them in place
+	*/
+	bgr = pixbuf->format == G_PIXEL_BGRX || pixbuf->format == G_PIXEL_BGRA;
+	if (bgr || options->tiff.compression == G_TIFF_COMPRESSION_LZW ||
+	    options->tiff.compression == G_TIFF_COMPRESSION_DEFLATE) {
+		line = (unsigned char *)malloc(width * (has_alpha ? 4 : 3));
+		if (!line)
+			failed = 1;
+	}
+
+	for (y = 0; y < height && !failed; y++) {
+		src = pixels + y * rowstride;
+		if (line && bgr) {
+			for (x = 0, dst = line; x < width; x++, src += 4) {
+				*dst++ = src[2];
+				*dst++ = src[1];
+				*dst++ = src[0];
+				if (has_alpha)
+					*dst++ = src[3];
+			}
+			src = line;
+		} else if (line) {
+			memcpy (line, src, width * (has_alpha ? 4 : 3));
+			src = line;
+		}
+		if (TIFFWriteScanline (tiff, src, y, 0) == -1)
+			failed = 1;
+	}
+
+	free (line);
+	free (icc_profile);
+	return tiff_output_close (&out, tiff, failed);
 }
 
-static TiffSaveContext *create_save_context (void)
+
+/*
+  Streaming row writers: the encoder is set up from the geometry alone and
+  takes rows as they are captured, so a whole frame is never held.
+*/
+struct _GRowWriter {
+	g_save_type type;
+	GSaveSink *sink;
+	int width, height;
+	g_pixel_format format;
+	int has_alpha;
+	int row;		/* rows written so far */
+	int failed;
+
+	struct jpeg_compress_struct cinfo;
+	struct error_handler_data jerr;
+	jpeg_sink_destination dest;
+	jpeg_raw_feed raw;	/* for BGRX rows */
+	unsigned char *planes;
+
+	png_structp png_ptr;
+	png_infop info_ptr;
+
+	TIFF *tiff;
+	TiffOutput tiff_out;
+
+	qoi_state qoi;
+
+	unsigned char *line;	/* one bmp row, BGR and padded, or qoi output */
+	unsigned int stride;	/* bmp row bytes, or rows per qoi batch */
+	long long data_offset;	/* sink position of the first pixel */
+	int bottom_up;		/* the sink can seek, rows go to their final place */
+};
+
+static int row_writer_start (GRowWriter *w)
 {
-    TiffSaveContext *context;
+	GSaveOptions options;
+	unsigned char BFH_BIH[54];
+	qoi_desc desc;
+
+	switch (w->type) {
+	case JPG:
+	case JPEG:
+		if (w->format == G_PIXEL_RGBA)
+			return -1;
+		w->cinfo.err = jpeg_std_error (&w->jerr.pub);
+		w->jerr.pub.error_exit = jpeg_error_exit;
+		if (setjmp (w->jerr.setjmp_buffer))
+			return -1;
+		jpeg_create_compress (&w->cinfo);
+		jpeg_sink_dest (&w->cinfo, &w->dest, w->sink);
+		w->cinfo.image_width = w->width;
+		w->cinfo.image_height = w->height;
+		w->cinfo.input_components = 3;
+		w->cinfo.in_color_space = w->format == G_PIXEL_RGB ? JCS_RGB : JCS_YCbCr;
+		jpeg_set_defaults (&w->cinfo);
+		if (w->format != G_PIXEL_RGB) {
+			/* the defaults are 4:2:0 already */
+			w->planes = (unsigned char *)malloc(jpeg_raw_size (w->width));
+			if (!w->planes)
+				return -1;
+			jpeg_raw_init (&w->raw, w->width, w->height, w->planes);
+			w->cinfo.raw_data_in = TRUE;
+		}
+		jpeg_start_compress (&w->cinfo, TRUE);
+		return 0;
+
+	case PNG:
+		if (w->format != G_PIXEL_RGB && w->format != G_PIXEL_RGBA)
+			return -1;
+		w->png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+		if (!w->png_ptr)
+			return -1;
+		w->info_ptr = png_create_info_struct (w->png_ptr);
+		if (!w->info_ptr)
+			return -1;
+		if (setjmp (png_jmpbuf (w->png_ptr)))
+			return -1;
+		png_set_write_fn (w->png_ptr, w->sink, png_sink_write, png_sink_flush);
+		png_set_IHDR (w->png_ptr, w->info_ptr, w->width, w->height, 8,
+			      w->has_alpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+			      PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+		png_write_info (w->png_ptr, w->info_ptr);
+		return 0;
+
+	case TIFF0:
+		if (w->format != G_PIXEL_RGB && w->format != G_PIXEL_RGBA)
+			return -1;
+		w->tiff = tiff_output_open (&w->tiff_out, w->sink);
+		if (!w->tiff)
+			return -1;
+		g_save_options_init (&options, G_SAVE_PRESET_DEFAULT);
+		tiff_set_layout (w->tiff, w->width, w->height, w->has_alpha, &options);
+		return 0;
 
-    context = (TiffSaveContext *)malloc(sizeof(TiffSaveContext));
-    context->buffer = NULL;
-    context->allocated = 0;
-    context->used = 0;
-    context->pos = 0;
+	case BMP:
+		if (w->format != G_PIXEL_RGB && w->format != G_PIXEL_RGBA)
+			return -1;
+		w->stride = (w->width * 3 + 3) & ~3;
+		w->line = (unsigned char *)calloc(w->stride, 1);
+		if (!w->line)
+			return -1;
+		w->data_offset = w->sink->seek ? w->sink->seek (w->sink, 0, SEEK_CUR) : -1;
+		w->bottom_up = w->data_offset >= 0;
+		w->data_offset += 14 + 40;
+		bmp_fill_header (BFH_BIH, w->width, w->bottom_up ? w->height : -w->height, w->stride * w->height);
+		return w->sink->write (w->sink, BFH_BIH, 14 + 40);
+
+	case QOI:
+		/* takes every format, BGRX bands are encoded as they come */
+		if ((unsigned int)w->height > QOI_PIXELS_MAX / (unsigned int)w->width)
+			return -1;
+		w->has_alpha = w->format == G_PIXEL_RGBA || w->format == G_PIXEL_BGRA;
+		w->stride = qoi_batch_rows (w->width);
+		w->line = (unsigned char *)malloc(QOI_ROW_BOUND (w->width) * w->stride + QOI_HEADER_SIZE);
+		if (!w->line)
+			return -1;
+		qoi_set_desc (&desc, w->width, w->height, w->has_alpha);
+		qoi_write_header (w->line, &desc);
+		qoi_state_init (&w->qoi);
+		return w->sink->write (w->sink, w->line, QOI_HEADER_SIZE);
 
-   	return context;
+	default:
+		return -1;
+	}
 }
 
-static void free_save_context (TiffSaveContext *context)
+GRowWriter *_g_row_writer_new (GSaveSink *sink, g_save_type type, int width, int height, g_pixel_format format)
 {
-	free (context->buffer);
-    free (context);
+	GRowWriter *w;
+
+	if (!sink || width <= 0 || height <= 0)
+		return NULL;
+
+	w = (GRowWriter *)malloc(sizeof(GRowWriter));
+	if (!w)
+		return NULL;
+	memset (w, 0, sizeof(GRowWriter));
+	w->type = type;
+	w->sink = sink;
+	w->width = width;
+	w->height = height;
+	w->format = format;
+	w->has_alpha = format == G_PIXEL_RGBA;
+
+	if (row_writer_start (w) < 0) {
+		w->failed = 1;
+		_g_row_writer_finish (w);
+		return NULL;
+	}
+
+	return w;
 }
 
-static int g_pixbuf_tiff_image_save(FILE * f, GPixbuf *pixbuf)
+int _g_row_writer_write (GRowWriter *w, const unsigned char *pixels, int rowstride, int n_rows)
 {
-    TIFF *tiff;
-    int width, height, rowstride;
-    unsigned char *pixels;
-    int has_alpha;
-    unsigned short alpha_samples[1] = { EXTRASAMPLE_UNASSALPHA };
-    int y;
-    TiffSaveContext *context;
-    int retval;
-    unsigned char *icc_profile = NULL;
-    unsigned long icc_profile_size = 0;
+	JSAMPROW rows[G_SAVE_BAND_ROWS];
+	unsigned int x, channel = w->has_alpha ? 4 : 3;
+	const unsigned char *src;
+	unsigned char *dst;
+	int bgr;
+	int i, n;
+
+	if (w->failed || n_rows > w->height - w->row)
+		return -1;
 
-    context = create_save_context ();
-    tiff = TIFFClientOpen ("libtiff-pixbuf", "w", context,  
-                            tiff_save_read, tiff_save_write, 
-                            tiff_save_seek, tiff_save_close, 
-                            tiff_save_size, 
-                            NULL, NULL);
+	switch (w->type) {
+	case JPG:
+	case JPEG:
+		if (setjmp (w->jerr.setjmp_buffer))
+			goto fail;
+		if (w->planes) {
+			jpeg_raw_write (&w->cinfo, &w->raw, pixels, rowstride, n_rows);
+			w->row += n_rows;
+			return 0;
+		}
+		while (n_rows > 0) {
+			n = n_rows < G_SAVE_BAND_ROWS ? n_rows : G_SAVE_BAND_ROWS;
+			for (i = 0; i < n; i++)
+				rows[i] = (JSAMPROW)(pixels + i * rowstride);
+			n = jpeg_write_scanlines (&w->cinfo, rows, n);
+			w->row += n;
+			pixels += n * rowstride;
+			n_rows -= n;
+		}
+		return 0;
+
+	case PNG:
+		if (setjmp (png_jmpbuf (w->png_ptr)))
+			goto fail;
+		while (n_rows > 0) {
+			n = n_rows < G_SAVE_BAND_ROWS ? n_rows : G_SAVE_BAND_ROWS;
+			for (i = 0; i < n; i++)
+				rows[i] = (png_bytep)(pixels + i * rowstride);
+			png_write_rows (w->png_ptr, (png_bytepp)rows, n);
+			w->row += n;
+			pixels += n * rowstride;
+			n_rows -= n;
+		}
+		return 0;
+
+	case TIFF0:
+		for (i = 0; i < n_rows; i++, w->row++)
+			if (TIFFWriteScanline (w->tiff, (tdata_t)(pixels + i * rowstride), w->row, 0) == -1)
+				goto fail;
+		return 0;
 
-    if (!tiff) {
-        free_save_context (context);
-        return -1;
-   	}
+	case BMP:
+		for (i = 0; i < n_rows; i++, w->row++) {
+			src = pixels + i * rowstride;
+			dst = w->line;
+			for (x = 0; x < w->width; x++, dst += 3, src += channel) {
+				dst[0] = src[2];
+				dst[1] = src[1];
+				dst[2] = src[0];
+			}
+			if (w->bottom_up &&
+			    w->sink->seek (w->sink, w->data_offset + (long long)(w->height - 1 - w->row) * w->stride, SEEK_SET) < 0)
+				goto fail;
+			if (w->sink->write (w->sink, w->line, w->stride) < 0)
+				goto fail;
+		}
+		return 0;
+
+	case QOI:
+		bgr = w->format == G_PIXEL_BGRX || w->format == G_PIXEL_BGRA;
+		while (n_rows > 0) {
+			n = n_rows < (int)w->stride ? n_rows : (int)w->stride;
+			dst = qoi_encode_rows (&w->qoi, pixels, rowstride, w->width, n,
+					       w->format == G_PIXEL_RGB ? 3 : 4, bgr, w->has_alpha, w->line);
+			if (w->sink->write (w->sink, w->line, dst - w->line) < 0)
+				goto fail;
+			w->row += n;
+			pixels += n * rowstride;
+			n_rows -= n;
+		}
+		return 0;
+
+	default:
+		break;
+	}
 
-    rowstride = pixbuf->rowstride;
-    pixels = pixbuf->pixels ;
+fail:
+	w->failed = 1;
+	return -1;
+}
 
-    has_alpha = pixbuf->has_alpha ;
+/* finish the file and free w; -1 if anything went wrong on the way */
+int _g_row_writer_finish (GRowWriter *w)
+{
+	int ret;
 
-    height = pixbuf->height ;
-    width = pixbuf->width ;
+	if (!w->failed && w->row != w->height)
+		w->failed = 1;
 
-    TIFFSetField (tiff, TIFFTAG_IMAGEWIDTH, width);
-    TIFFSetField (tiff, TIFFTAG_IMAGELENGTH, height);
-    TIFFSetField (tiff, TIFFTAG_BITSPERSAMPLE, 8);
-    TIFFSetField (tiff, TIFFTAG_SAMPLESPERPIXEL, has_alpha ? 4 : 3);
-    TIFFSetField (tiff, TIFFTAG_ROWSPERSTRIP, height);
+	switch (w->type) {
+	case JPG:
+	case JPEG:
+		if (!w->cinfo.err)
+			break;
+		if (setjmp (w->jerr.setjmp_buffer))
+			w->failed = 1;
+		else if (!w->failed)
+			jpeg_finish_compress (&w->cinfo);
+		jpeg_destroy_compress (&w->cinfo);
+		free (w->planes);
+		break;
 
-    if (has_alpha)
-    	TIFFSetField (tiff, TIFFTAG_EXTRASAMPLES, 1, alpha_samples);
+	case PNG:
+		if (!w->png_ptr)
+			break;
+		if (setjmp (png_jmpbuf (w->png_ptr)))
+			w->failed = 1;
+		else if (!w->failed)
+			png_write_end (w->png_ptr, w->info_ptr);
+		png_destroy_write_struct (&w->png_ptr, &w->info_ptr);
+		break;
 
-    TIFFSetField (tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-   	TIFFSetField (tiff, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);        
-    TIFFSetField (tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	case TIFF0:
+		if (w->tiff && tiff_output_close (&w->tiff_out, w->tiff, w->failed) < 0)
+			w->failed = 1;
+		break;
 
-    if (icc_profile != NULL)
-    	TIFFSetField (tiff, TIFFTAG_ICCPROFILE, icc_profile_size, icc_profile);
+	case BMP:
+		/* leave the sink after the bitmap, like the other writers */
+		if (w->bottom_up && !w->failed)
+			w->sink->seek (w->sink, w->data_offset + (long long)w->height * w->stride, SEEK_SET);
+		free (w->line);
+		break;
 
-    for (y = 0; y < height; y++) {
-    	if (TIFFWriteScanline (tiff, pixels + y * rowstride, y, 0) == -1)
-        	break;
-        }
+	case QOI:
+		if (w->line && !w->failed &&
+		    w->sink->write (w->sink, w->line, qoi_encode_finish (&w->qoi, w->line) - w->line) < 0)
+			w->failed = 1;
+		free (w->line);
+		break;
 
-    TIFFClose (tiff);
+	default:
+		break;
+	}
 
-    /* Now call the callback */
-   	retval = save_to_file_cb(context->buffer, context->used, f);
+	if (!w->failed && _g_sink_flush (w->sink) < 0)
+		w->failed = 1;
+	ret = w->failed ? -1 : 0;
+	free (w);
 
-    free (icc_profile);
-    free_save_context (context);
-    return retval;
+	return ret;
 }
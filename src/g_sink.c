@@ -0,0 +1,248 @@
+#include "g_private.h"
+#include <errno.h>
+#include <unistd.h>
+
+/* Output sinks: where the savers in g_save.c put their bytes */
+
+/* FILE: stdio does the buffering */
+static int file_sink_write (GSaveSink *sink, const void *buf, size_t count)
+{
+	GFileSink *fs = (GFileSink *)sink;
+
+	return fwrite (buf, 1, count, fs->fp) == count ? 0 : -1;
+}
+
+static int file_sink_flush (GSaveSink *sink)
+{
+	return fflush (((GFileSink *)sink)->fp) == 0 ? 0 : -1;
+}
+
+static long long file_sink_seek (GSaveSink *sink, long long offset, int whence)
+{
+	FILE *fp = ((GFileSink *)sink)->fp;
+
+	if (fseeko (fp, offset, whence) < 0)
+		return -1;
+	return ftello (fp);
+}
+
+void _g_file_sink_init (GFileSink *fs, FILE *fp)
+{
+	memset (fs, 0, sizeof(GFileSink));
+	fs->sink.write = file_sink_write;
+	fs->sink.flush = file_sink_flush;
+	fs->sink.seek = file_sink_seek;
+	fs->fp = fp;
+}
+
+GSaveSink *g_save_sink_new_for_file (FILE *fp)
+{
+	GFileSink *fs;
+
+	if (!fp)
+		return NULL;
+	fs = (GFileSink *)malloc(sizeof(GFileSink));
+	if (fs)
+		_g_file_sink_init (fs, fp);
+	return (GSaveSink *)fs;
+}
+
+/* fd: small writes are gathered, large ones go straight to write(2) */
+#define FD_SINK_BUF (64 * 1024)
+
+typedef struct {
+	GSaveSink sink;
+	int fd;
+	size_t used;
+	unsigned char buf[FD_SINK_BUF];
+} GFdSink;
+
+static int fd_write_all (int fd, const unsigned char *buf, size_t count)
+{
+	ssize_t n;
+
+	while (count > 0) {
+		n = write (fd, buf, count);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		count -= n;
+	}
+	return 0;
+}
+
+static int fd_sink_flush (GSaveSink *sink)
+{
+	GFdSink *fs = (GFdSink *)sink;
+	int ret = fd_write_all (fs->fd, fs->buf, fs->used);
+
+	fs->used = 0;
+	return ret;
+}
+
+static int fd_sink_write (GSaveSink *sink, const void *buf, size_t count)
+{
+	GFdSink *fs = (GFdSink *)sink;
+
+	if (fs->used + count > FD_SINK_BUF && fd_sink_flush (sink) < 0)
+		return -1;
+	if (count >= FD_SINK_BUF)
+		return fd_write_all (fs->fd, (const unsigned char *)buf, count);
+	memcpy (fs->buf + fs->used, buf, count);
+	fs->used += count;
+	return 0;
+}
+
+static long long fd_sink_seek (GSaveSink *sink, long long offset, int whence)
+{
+	GFdSink *fs = (GFdSink *)sink;
+
+	if (fd_sink_flush (sink) < 0)
+		return -1;
+	return lseek (fs->fd, offset, whence);
+}
+
+static void fd_sink_destroy (GSaveSink *sink)
+{
+	fd_sink_flush (sink);
+}
+
+GSaveSink *g_save_sink_new_for_fd (int fd)
+{
+	GFdSink *fs;
+
+	if (fd < 0)
+		return NULL;
+	fs = (GFdSink *)malloc(sizeof(GFdSink));
+	if (!fs)
+		return NULL;
+	memset (&fs->sink, 0, sizeof(GSaveSink));
+	fs->sink.write = fd_sink_write;
+	fs->sink.flush = fd_sink_flush;
+	fs->sink.seek = fd_sink_seek;
+	fs->sink.destroy = fd_sink_destroy;
+	fs->fd = fd;
+	fs->used = 0;
+	return &fs->sink;
+}
+
+/* growable buffer: seeks and overwrites like a file, gaps read as zeros */
+typedef struct {
+	GSaveSink sink;
+	unsigned char *data;
+	size_t size;		/* bytes written, the high water mark */
+	size_t pos;
+	size_t allocated;
+} GBufferSink;
+
+static int buffer_sink_write (GSaveSink *sink, const void *buf, size_t count)
+{
+	GBufferSink *bs = (GBufferSink *)sink;
+	size_t need = bs->pos + count, allocated;
+	unsigned char *data;
+
+	if (need < bs->pos)
+		return -1;
+	/* double, so n writes copy O(n) bytes in all */
+	if (need > bs->allocated) {
+		allocated = bs->allocated ? bs->allocated : 64 * 1024;
+		while (allocated < need)
+			allocated *= 2;
+		data = (unsigned char *)realloc(bs->data, allocated);
+		if (!data)
+			return -1;
+		bs->data = data;
+		bs->allocated = allocated;
+	}
+	if (bs->pos > bs->size)
+		memset (bs->data + bs->size, 0, bs->pos - bs->size);
+
+	memcpy (bs->data + bs->pos, buf, count);
+	bs->pos += count;
+	if (bs->pos > bs->size)
+		bs->size = bs->pos;
+	return 0;
+}
+
+static long long buffer_sink_seek (GSaveSink *sink, long long offset, int whence)
+{
+	GBufferSink *bs = (GBufferSink *)sink;
+	long long pos;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = (long long)bs->pos + offset;
+		break;
+	case SEEK_END:
+		pos = (long long)bs->size + offset;
+		break;
+	default:
+		return -1;
+	}
+	if (pos < 0)
+		return -1;
+	bs->pos = pos;
+	return pos;
+}
+
+static void buffer_sink_destroy (GSaveSink *sink)
+{
+	free (((GBufferSink *)sink)->data);
+}
+
+GSaveSink *g_save_sink_new_buffer (size_t size_hint)
+{
+	GBufferSink *bs;
+
+	bs = (GBufferSink *)malloc(sizeof(GBufferSink));
+	if (!bs)
+		return NULL;
+	memset (bs, 0, sizeof(GBufferSink));
+	bs->sink.write = buffer_sink_write;
+	bs->sink.seek = buffer_sink_seek;
+	bs->sink.destroy = buffer_sink_destroy;
+	if (size_hint) {
+		bs->data = (unsigned char *)malloc(size_hint);
+		if (bs->data)
+			bs->allocated = size_hint;
+	}
+	return &bs->sink;
+}
+
+const unsigned char *g_save_sink_get_buffer (GSaveSink *sink, size_t *size)
+{
+	GBufferSink *bs = (GBufferSink *)sink;
+
+	if (sink->write != buffer_sink_write)
+		return NULL;
+	*size = bs->size;
+	return bs->data;
+}
+
+unsigned char *g_save_sink_steal_buffer (GSaveSink *sink, size_t *size)
+{
+	GBufferSink *bs = (GBufferSink *)sink;
+	unsigned char *data;
+
+	if (sink->write != buffer_sink_write)
+		return NULL;
+	data = bs->data;
+	*size = bs->size;
+	bs->data = NULL;
+	bs->size = bs->pos = bs->allocated = 0;
+	return data;
+}
+
+void g_save_sink_free (GSaveSink *sink)
+{
+	if (!sink)
+		return;
+	if (sink->destroy)
+		sink->destroy (sink);
+	free (sink);
+}
@@ -1,4 +1,9 @@
-#include "g_pixbuf.h"
+#include "g_private.h"
+#include "pool.h"
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <pthread.h>
+#include <X11/extensions/XShm.h>
 
 
 static unsigned int mask_table[] = {
@@ -13,18 +18,6 @@ static unsigned int mask_table[] = {
 	0xffffffff
 };
 
-typedef struct xlib_colormap_struct xlib_colormap;
-struct xlib_colormap_struct {
-	int size;
-	XColor *colors;
-	Visual *visual;
-	Colormap colormap;
-};
-
-typedef void (* cfunc) (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *cmap);
-
-static xlib_colormap *xlib_get_colormap (Display *dpy, Colormap id, Visual *visual);
-static void xlib_colormap_free (xlib_colormap *xc);
 static void rgbconvert (XImage *image, unsigned char *pixels, int rowstride, int alpha, xlib_colormap *cmap);
 static void rgb1(XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
 static void rgb1a(XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
@@ -43,35 +36,106 @@ static void rgb888alsb (XImage *image, unsigned char *pixels, int rowstride, xli
 static void rgb888lsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
 static void rgb888amsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
 static void rgb888msb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
+static void bgr888lsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
+static void bgr888msb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
+static void bgr888alsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
+static void bgr888amsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
+static void rgb24lsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
+static void rgb24msb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
+static void rgb24alsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
+static void rgb24amsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap);
 
 
 static void visual_decompose_mask (unsigned long  mask, int *shift, int *prec);
 static void convert_real_slow (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *cmap, int alpha);
+static cfunc convert_generic_init (XImage *image, xlib_colormap *cmap, int index);
 
 static cfunc convert_map[] = {
 	rgb1,rgb1,rgb1a,rgb1a,
 	rgb8,rgb8,rgb8a,rgb8a,
 	rgb555lsb,rgb555msb,rgb555alsb,rgb555amsb,
 	rgb565lsb,rgb565msb,rgb565alsb,rgb565amsb,
-	rgb888lsb,rgb888msb,rgb888alsb,rgb888amsb
+	rgb888lsb,rgb888msb,rgb888alsb,rgb888amsb,
+	bgr888lsb,bgr888msb,bgr888alsb,bgr888amsb,
+	rgb24lsb,rgb24msb,rgb24alsb,rgb24amsb,
+	/* packed bgr bytes are packed rgb bytes in the other byte order */
+	rgb24msb,rgb24lsb,rgb24amsb,rgb24alsb
 };
 
-static xlib_colormap *xlib_get_colormap (Display *dpy, Colormap id, Visual *visual)
+/* first converter of the 24/32 bit TrueColor banks in convert_map */
+#define RGB888_BANK (4 << 2)
+#define BGR888_BANK (5 << 2)
+#define RGB24_BANK (6 << 2)
+#define BGR24_BANK (7 << 2)
+
+/* the plain C converters of those four banks, before convert_map_init() */
+static cfunc truecolor_c[G_TRUECOLOR_BANKS];
+
+void _g_truecolor_banks (int level, cfunc *banks)
+{
+	cfunc *rgb24 = &banks[RGB24_BANK - RGB888_BANK];
+	cfunc *bgr24 = &banks[BGR24_BANK - RGB888_BANK];
+
+	memcpy (banks, truecolor_c, sizeof(truecolor_c));
+	_g_rgb888_simd_bank (level, banks);
+	_g_bgr888_simd_bank (level, &banks[BGR888_BANK - RGB888_BANK]);
+	if (_g_rgb24_simd_bank (level, rgb24)) {
+		bgr24[0] = rgb24[1];
+		bgr24[1] = rgb24[0];
+		bgr24[2] = rgb24[3];
+		bgr24[3] = rgb24[2];
+	}
+}
+
+/* swap in the fastest 24/32 bit converters this cpu can run, once at load time */
+static void convert_map_init (void) __attribute__((constructor));
+static void convert_map_init (void)
+{
+	memcpy (truecolor_c, &convert_map[RGB888_BANK], sizeof(truecolor_c));
+	_g_truecolor_banks (_g_simd_level (), &convert_map[RGB888_BANK]);
+}
+
+/*
+  read the colors of a colormap once; TrueColor pixels carry their own
+  color, so those visuals skip the XQueryColors round-trip
+*/
+xlib_colormap *_g_xlib_colormap_get (Display *dpy, Colormap id, Visual *visual)
 {
 	int i;
 	xlib_colormap *xc = (xlib_colormap *)malloc(sizeof(xlib_colormap));
 
-	xc->size = visual->map_entries;
-	xc->colors = (XColor*)malloc(sizeof(XColor) * xc->size);
+	if (!xc)
+		return NULL;
+
+	xc->size = visual->class == TrueColor ? 0 : visual->map_entries;
+	xc->colors = NULL;
 	xc->visual = visual;
 	xc->colormap = id;
+	memset (xc->palette, 0, sizeof(xc->palette));
 
-	for (i = 0; i < xc->size; i++) {
-		xc->colors[i].pixel = i;
-		xc->colors[i].flags = DoRed | DoGreen | DoBlue;
+	if (xc->size > 0) {
+		xc->colors = (XColor*)malloc(sizeof(XColor) * xc->size);
+		if (!xc->colors) {
+			free (xc);
+			return NULL;
+		}
+		for (i = 0; i < xc->size; i++) {
+			xc->colors[i].pixel = i;
+			xc->colors[i].flags = DoRed | DoGreen | DoBlue;
+		}
+
+		XQueryColors (dpy, xc->colormap, xc->colors, xc->size);
 	}
 
-	XQueryColors (dpy, xc->colormap, xc->colors, xc->size);
+	/* 8 bit R, G, B, A of the first 256 cells for the indexed converters */
+	for (i = 0; i < 256; i++) {
+		if (i < xc->size) {
+			xc->palette[i][0] = xc->colors[i].red >> 8;
+			xc->palette[i][1] = xc->colors[i].green >> 8;
+			xc->palette[i][2] = xc->colors[i].blue >> 8;
+		}
+		xc->palette[i][3] = 0xff;
+	}
 
 	return xc;
 }
@@ -91,6 +155,8 @@ GPixbuf *g_pixbuf_new_from_data (const unsigned char *data, int depth, int b_ord
 	pixbuf->rowstride = rowstride;
 	pixbuf->bytes_per_line = ((width * depth + 31) >> 5) << 2;
 	pixbuf->pixels = (unsigned char *)data;
+	pixbuf->format = has_alpha ? G_PIXEL_RGBA : G_PIXEL_RGB;
+	pixbuf->borrowed = 0;
 
 	return pixbuf;
 }
@@ -122,12 +188,210 @@ GPixbuf *g_pixbuf_new (int depth, int b_order, int has_alpha, int bits_per_sampl
 	return g_pixbuf_new_from_data (buf,depth, b_order, has_alpha, bits_per_sample, width, height, rowstride);
 }
 
-GPixbuf *g_pixbuf_x_get_from_drawable (Display *dpy, Drawable src, int src_x, int src_y, int width, int height)
+void g_pixbuf_free (GPixbuf *pixbuf)
+{
+	if (!pixbuf)
+		return;
+	if (!pixbuf->borrowed)
+		free (pixbuf->pixels);
+	free (pixbuf);
+}
+
+/* MIT-SHM capture: one shared segment kept per session and reused */
+struct _GShmSegment {
+	Display *dpy;
+	int available;		/* extension present and attach worked */
+	int major_opcode;	/* of MIT-SHM, to tell its errors apart */
+	int attached;
+	XShmSegmentInfo info;
+	unsigned int size;	/* bytes in the current segment */
+	XImage *image;		/* header describing the last capture */
+};
+
+/*
+  XSetErrorHandler() is process-wide, so the MIT-SHM requests whose
+  errors we catch (attach and get image) are serialised on one lock
+  across all sessions. The handler takes the MIT-SHM errors of the
+  display in use and passes anything else to the handler it replaced.
+*/
+static pthread_mutex_t shm_trap_lock = PTHREAD_MUTEX_INITIALIZER;
+static Display *shm_trap_dpy;
+static int shm_trap_opcode;
+static int shm_error;
+static int (*shm_old_handler) (Display *, XErrorEvent *);
+
+static int shm_error_handler (Display *dpy, XErrorEvent *ev)
+{
+	if (dpy == shm_trap_dpy && ev->request_code == shm_trap_opcode) {
+		shm_error = 1;
+		return 0;
+	}
+	return shm_old_handler ? shm_old_handler (dpy, ev) : 0;
+}
+
+static void shm_trap_errors (GShmSegment *shm)
+{
+	pthread_mutex_lock (&shm_trap_lock);
+	shm_trap_dpy = shm->dpy;
+	shm_trap_opcode = shm->major_opcode;
+	shm_error = 0;
+	shm_old_handler = XSetErrorHandler (shm_error_handler);
+}
+
+/* 1 if a MIT-SHM request since shm_trap_errors() failed */
+static int shm_untrap_errors (GShmSegment *shm)
+{
+	int failed;
+
+	/* the errors of everything sent so far come in before the handler goes */
+	XSync (shm->dpy, False);
+	XSetErrorHandler (shm_old_handler);
+	failed = shm_error;
+	shm_trap_dpy = NULL;
+	pthread_mutex_unlock (&shm_trap_lock);
+	return failed;
+}
+
+GShmSegment *g_shm_segment_new (Display *dpy)
+{
+	GShmSegment *shm;
+	int event_base, error_base;
+
+	shm = (GShmSegment *)malloc(sizeof(GShmSegment));
+	if (!shm)
+		return NULL;
+
+	memset (shm, 0, sizeof(GShmSegment));
+	shm->dpy = dpy;
+	shm->info.shmid = -1;
+	shm->info.shmaddr = (char *)-1;
+	shm->available = XQueryExtension (dpy, "MIT-SHM", &shm->major_opcode, &event_base, &error_base) &&
+			 XShmQueryExtension (dpy);
+
+	return shm;
+}
+
+static void shm_segment_release (GShmSegment *shm)
+{
+	if (shm->image) {
+		/* the pixels belong to the segment, not to Xlib */
+		shm->image->data = NULL;
+		XDestroyImage (shm->image);
+		shm->image = NULL;
+	}
+	if (shm->attached) {
+		XShmDetach (shm->dpy, &shm->info);
+		XSync (shm->dpy, False);
+		shm->attached = 0;
+	}
+	if (shm->info.shmaddr != (char *)-1) {
+		shmdt (shm->info.shmaddr);
+		shm->info.shmaddr = (char *)-1;
+	}
+	shm->info.shmid = -1;
+	shm->size = 0;
+}
+
+void g_shm_segment_free (GShmSegment *shm)
+{
+	if (!shm)
+		return;
+	shm_segment_release (shm);
+	free (shm);
+}
+
+/* make sure the segment holds at least size bytes, growing it if needed */
+static int shm_segment_reserve (GShmSegment *shm, unsigned int size)
+{
+	int failed;
+
+	if (shm->attached && size <= shm->size)
+		return 1;
+
+	shm_segment_release (shm);
+
+	shm->info.shmid = shmget (IPC_PRIVATE, size, IPC_CREAT | 0600);
+	if (shm->info.shmid < 0)
+		goto fail;
+	shm->info.shmaddr = (char *)shmat (shm->info.shmid, NULL, 0);
+	if (shm->info.shmaddr == (char *)-1)
+		goto fail;
+	shm->info.readOnly = False;
+
+	/* a remote server accepts the extension query but cannot attach */
+	shm_trap_errors (shm);
+	if (!XShmAttach (shm->dpy, &shm->info))
+		shm_error = 1;
+	failed = shm_untrap_errors (shm);
+	shm->attached = !failed;
+	if (failed)
+		goto fail;
+
+	shm->size = size;
+	/* the id goes away once both sides have detached */
+	shmctl (shm->info.shmid, IPC_RMID, NULL);
+	return 1;
+
+fail:
+	if (shm->info.shmid >= 0)
+		shmctl (shm->info.shmid, IPC_RMID, NULL);
+	shm_segment_release (shm);
+	shm->available = 0;
+	return 0;
+}
+
+/*
+  fetch an area through the shared segment; the returned image stays
+  owned by shm and is only valid until the next capture on it
+*/
+static XImage *shm_get_image (GShmSegment *shm, Drawable src, Visual *visual, int depth, int x, int y, int width, int height)
 {
 	XImage *image;
-	int rowstride, bpp, alpha;
+	Status ok;
+	int failed;
+
+	if (!shm->available)
+		return NULL;
+
+	image = shm->image;
+	if (!image || image->width != width || image->height != height || image->depth != depth) {
+		if (image) {
+			image->data = NULL;
+			XDestroyImage (image);
+			shm->image = NULL;
+		}
+		image = XShmCreateImage (shm->dpy, visual, depth, ZPixmap, NULL, &shm->info, width, height);
+		if (!image)
+			return NULL;
+		if (!shm_segment_reserve (shm, image->bytes_per_line * image->height)) {
+			XDestroyImage (image);
+			return NULL;
+		}
+		image->data = shm->info.shmaddr;
+		shm->image = image;
+	}
+
+	/* BadMatch for a window that is unmapped or partly off screen */
+	shm_trap_errors (shm);
+	ok = XShmGetImage (shm->dpy, src, image, x, y, AllPlanes);
+	failed = shm_untrap_errors (shm);
+
+	if (!ok || failed)
+		return NULL;
+
+	return image;
+}
+
+GPixbuf *g_pixbuf_x_get_from_drawable (Display *dpy, Drawable src, int src_x, int src_y, int width, int height)
+{
+	return g_pixbuf_x_get_from_drawable_shm (dpy, src, src_x, src_y, width, height, NULL, NULL);
+}
+
+GPixbuf *g_pixbuf_x_get_from_drawable_shm (Display *dpy, Drawable src, int src_x, int src_y, int width, int height, GShmSegment *shm, g_capture_path *path)
+{
 	XWindowAttributes wa;
 	xlib_colormap *x_cmap;
+	GPixbuf *dest;
 
 	XGetWindowAttributes (dpy, src, &wa);
 	int src_width = wa.width;
@@ -137,7 +401,7 @@ GPixbuf *g_pixbuf_x_get_from_drawable (Display *dpy, Drawable src, int src_x, in
 	int src_xorigin, src_yorigin;
 	int screen_width, screen_height;
 	int screen_srcx, screen_srcy;
-	
+
 	Window child;
 	ret =XTranslateCoordinates (dpy, src, DefaultRootWindow(dpy), 0, 0, &src_xorigin, &src_yorigin, &child);
 
@@ -157,35 +421,196 @@ GPixbuf *g_pixbuf_x_get_from_drawable (Display *dpy, Drawable src, int src_x, in
 		width = screen_width - screen_srcx;
 	if (height + screen_srcy > screen_height)
 		height = screen_height - screen_srcy;
- 
-	/* Get Image in ZPixmap format (packed bits). */
-	image = XGetImage (dpy, src, screen_srcx, screen_srcy, width, height, AllPlanes, ZPixmap);
+
+	x_cmap = _g_xlib_colormap_get (dpy, wa.colormap, wa.visual);
+	if (!x_cmap)
+		return NULL;
+	dest = _g_pixbuf_x_get_area (dpy, src, wa.depth, x_cmap, screen_srcx, screen_srcy, width, height, shm, path, 0);
+	_g_xlib_colormap_free (x_cmap);
+
+	return dest;
+}
+
+/* can the server pixels be used as they are? */
+static int native_format (XImage *image, Visual *visual, g_pixel_format *format)
+{
+	if (visual->class != TrueColor || image->bits_per_pixel != 32 || image->byte_order != LSBFirst)
+		return 0;
+	if (visual->red_mask != 0xff0000 || visual->green_mask != 0xff00 || visual->blue_mask != 0xff)
+		return 0;
+
+	*format = image->depth == 32 ? G_PIXEL_BGRA : G_PIXEL_BGRX;
+	return 1;
+}
+
+/*
+  fetch and convert an area whose coordinates are already clipped, for
+  callers that know the depth and colormap of the drawable up front;
+  with native set a BGRX image is handed over instead of converted
+*/
+GPixbuf *_g_pixbuf_x_get_area (Display *dpy, Drawable src, int depth, xlib_colormap *x_cmap, int x, int y, int width, int height, GShmSegment *shm, g_capture_path *path, int native)
+{
+	g_pixel_format format;
+	XImage *image = NULL;
+	int rowstride, alpha;
+	g_capture_path used = G_CAPTURE_XGETIMAGE;
+
+	if (width <= 0 || height <= 0)
+		return NULL;
+
+	/* Try the shared segment first, then a plain XGetImage in ZPixmap format (packed bits). */
+	if (shm)
+		image = shm_get_image (shm, src, x_cmap->visual, depth, x, y, width, height);
+	if (image)
+		used = G_CAPTURE_XSHM;
+	else
+		image = XGetImage (dpy, src, x, y, width, height, AllPlanes, ZPixmap);
+	if (!image)
+		return NULL;
+	if (path)
+		*path = used;
+
+	if (native && native_format (image, x_cmap->visual, &format)) {
+		GPixbuf *dest = g_pixbuf_new_from_data ((unsigned char *)image->data, image->depth, image->byte_order,
+							format == G_PIXEL_BGRA, 8, width, height, image->bytes_per_line);
+		if (!dest) {
+			if (used == G_CAPTURE_XGETIMAGE)
+				XDestroyImage (image);
+			return NULL;
+		}
+		dest->format = format;
+		dest->n_channels = 4;
+		if (used == G_CAPTURE_XSHM)
+			dest->borrowed = 1;
+		else {
+			/* adopt the Xlib buffer, it was malloc'd like ours */
+			image->data = NULL;
+			XDestroyImage (image);
+		}
+		return dest;
+	}
+
 	GPixbuf *dest = g_pixbuf_new (image->depth, image->byte_order, 0, 8, width, height);
 	if (!dest) {
-		XDestroyImage (image);
+		if (used == G_CAPTURE_XGETIMAGE)
+			XDestroyImage (image);
 		return NULL;
 	}
-	/* Get the colormap if needed */
-	Colormap cmap = wa.colormap;
-	Visual *visual = wa.visual;
-
-	x_cmap = xlib_get_colormap (dpy, cmap, visual);
-
 	alpha = dest->has_alpha;
 	rowstride = dest->rowstride;
-	bpp = alpha ? 4 : 3;
 
-	/* we offset into the image data based on the position we are retrieving from */
 	rgbconvert (image, dest->pixels ,rowstride, alpha, x_cmap);
 
-	xlib_colormap_free (x_cmap);
-	XDestroyImage (image);
+	/* a shared image stays with its segment for the next capture */
+	if (used == G_CAPTURE_XGETIMAGE)
+		XDestroyImage (image);
 
 	return dest;
 }
 
+/*
+  refresh rects (in drawable coordinates, inside dest) of a pixbuf that
+  mirrors the whole drawable; returns -1 if some rect could not be fetched
+*/
+int _g_pixbuf_x_update (Display *dpy, Drawable src, int depth, xlib_colormap *x_cmap, GShmSegment *shm, GPixbuf *dest, const GRect *rects, int n_rects)
+{
+	XImage *image;
+	const GRect *r;
+	int i, shared, ret = 0;
+
+	for (i = 0; i < n_rects; i++) {
+		r = &rects[i];
+		image = shm ? shm_get_image (shm, src, x_cmap->visual, depth, r->x, r->y, r->width, r->height) : NULL;
+		shared = image != NULL;
+		if (!image)
+			image = XGetImage (dpy, src, r->x, r->y, r->width, r->height, AllPlanes, ZPixmap);
+		if (!image) {
+			ret = -1;
+			continue;
+		}
+
+		rgbconvert (image, dest->pixels + r->y * dest->rowstride + r->x * dest->n_channels, dest->rowstride, dest->has_alpha, x_cmap);
+		if (!shared)
+			XDestroyImage (image);
+	}
+
+	return ret;
+}
+
+/*
+  capture an area band_rows rows at a time and hand each converted band
+  to an encoder, so only one band of server pixels and one band of RGB
+  are held at once (JPEG and QOI read BGRX bands in place and need no
+  RGB);
+  returns 0 on success, -1 on error
+*/
+int _g_pixbuf_x_save_area (Display *dpy, Drawable src, int depth, xlib_colormap *x_cmap, int x, int y, int width, int height, GShmSegment *shm, GSaveSink *sink, g_save_type type, int band_rows)
+{
+	g_pixel_format format = G_PIXEL_RGB;
+	XImage *image;
+	GPixbuf *band = NULL;
+	GRowWriter *writer = NULL;
+	int row, rows, ret = 0;
+	int shared;
+
+	if (width <= 0 || height <= 0)
+		return -1;
+	if (band_rows <= 0)
+		band_rows = G_SAVE_BAND_ROWS;
+	if (band_rows > height)
+		band_rows = height;
+
+	for (row = 0; row < height && !ret; row += rows) {
+		rows = height - row < band_rows ? height - row : band_rows;
+
+		image = shm ? shm_get_image (shm, src, x_cmap->visual, depth, x, y + row, width, rows) : NULL;
+		shared = image != NULL;
+		if (!image)
+			image = XGetImage (dpy, src, x, y + row, width, rows, AllPlanes, ZPixmap);
+		if (!image) {
+			ret = -1;
+			break;
+		}
+
+		/*
+		  JPEG takes server BGRX rows as they are and makes its YCbCr
+		  planes from them, QOI encodes them directly, the rest gets
+		  packed RGB bands
+		*/
+		if (!writer) {
+			if ((type != JPG && type != JPEG && type != QOI) || !native_format (image, x_cmap->visual, &format)) {
+				format = G_PIXEL_RGB;
+				band = g_pixbuf_new (depth, 0, 0, 8, width, band_rows);
+			}
+			if (band || format != G_PIXEL_RGB)
+				writer = _g_row_writer_new (sink, type, width, height, format);
+			if (!writer) {
+				if (!shared)
+					XDestroyImage (image);
+				ret = -1;
+				break;
+			}
+		}
+
+		if (band) {
+			rgbconvert (image, band->pixels, band->rowstride, 0, x_cmap);
+			ret = _g_row_writer_write (writer, band->pixels, band->rowstride, rows);
+		} else
+			ret = _g_row_writer_write (writer, (unsigned char *)image->data, image->bytes_per_line, rows);
+		if (!shared)
+			XDestroyImage (image);
+	}
+
+	if (writer && _g_row_writer_finish (writer) < 0)
+		ret = -1;
+	if (band)
+		g_pixbuf_free (band);
+
+	return ret;
+}
+
 
-static void xlib_colormap_free (xlib_colormap *xc)
+void _g_xlib_colormap_free (xlib_colormap *xc)
 {
 	free(xc->colors);
 	free(xc);
@@ -193,10 +618,92 @@ static void xlib_colormap_free (xlib_colormap *xc)
 
 
 
+/*
+  Row-band conversion: every converter works row by row, so a large image
+  is cut into horizontal bands that run on the pool at the same time.
+  Off (one thread) until g_pixbuf_set_convert_threads() is called.
+*/
+static XssPool *convert_pool;
+static int convert_min_pixels = 512 * 512;
+
+typedef struct {
+	XImage image;		/* view of the band's rows of the source image */
+	unsigned char *pixels;
+	int rowstride;
+	int alpha;
+	cfunc func;		/* NULL for convert_real_slow */
+	xlib_colormap *cmap;
+} convert_band;
+
+void g_pixbuf_set_convert_threads (int n_threads, int min_pixels)
+{
+	if (convert_pool) {
+		xss_pool_free (convert_pool);
+		convert_pool = NULL;
+	}
+	if (n_threads != 1)
+		convert_pool = xss_pool_new (n_threads);
+	if (min_pixels >= 0)
+		convert_min_pixels = min_pixels;
+}
+
+static void convert_band_run (void *data, void *usr_data)
+{
+	convert_band *band = (convert_band *)data;
+
+	if (band->func)
+		band->func (&band->image, band->pixels, band->rowstride, band->cmap);
+	else
+		convert_real_slow (&band->image, band->pixels, band->rowstride, band->cmap, band->alpha);
+}
+
+static void convert_rows (cfunc func, XImage *image, unsigned char *pixels, int rowstride, int alpha, xlib_colormap *cmap)
+{
+	XssPool *pool = convert_pool;
+	convert_band *bands = NULL;
+	void **data = NULL;
+	int i, n = 0, rows;
+
+	if (pool && image->width * image->height >= convert_min_pixels) {
+		/* a couple of bands per thread evens out uneven cores */
+		n = xss_pool_get_max_threads (pool) * 2;
+		if (n > image->height)
+			n = image->height;
+		bands = (convert_band *)malloc(n * sizeof(convert_band));
+		data = (void **)malloc(n * sizeof(void *));
+	}
+	if (n < 2 || !bands || !data) {
+		free (bands);
+		free (data);
+		if (func)
+			(* func) (image, pixels, rowstride, cmap);
+		else
+			convert_real_slow (image, pixels, rowstride, cmap, alpha);
+		return;
+	}
+
+	rows = (image->height + n - 1) / n;
+	for (i = 0; i < n && i * rows < image->height; i++) {
+		bands[i].image = *image;
+		bands[i].image.data = image->data + i * rows * image->bytes_per_line;
+		bands[i].image.height = image->height - i * rows < rows ? image->height - i * rows : rows;
+		bands[i].pixels = pixels + i * rows * rowstride;
+		bands[i].rowstride = rowstride;
+		bands[i].alpha = alpha;
+		bands[i].func = func;
+		bands[i].cmap = cmap;
+		data[i] = &bands[i];
+	}
+	xss_pool_run (pool, convert_band_run, data, i, NULL);
+
+	free (bands);
+	free (data);
+}
+
 static void rgbconvert (XImage *image, unsigned char *pixels, int rowstride, int alpha, xlib_colormap *cmap)
 {
 	int index = (image->byte_order == MSBFirst) | (alpha != 0) << 1;
-	int bank=5;		/* default fallback converter */
+	int bank=-1;		/* default fallback converter */
 	Visual *v = cmap->visual;
 
 	switch (v->class) {
@@ -228,9 +735,12 @@ static void rgbconvert (XImage *image, unsigned char *pixels, int rowstride, int
 			break;
 		case 24:
 		case 32:
-			if (v->red_mask == 0xff0000 && v->green_mask == 0xff00 && v->blue_mask == 0xff
-			    && image->bits_per_pixel == 32)
-				bank = 4;
+			if (v->green_mask != 0xff00 || (image->bits_per_pixel != 32 && image->bits_per_pixel != 24))
+				break;
+			if (v->red_mask == 0xff0000 && v->blue_mask == 0xff)
+				bank = image->bits_per_pixel == 32 ? 4 : 6;
+			else if (v->red_mask == 0xff && v->blue_mask == 0xff0000)
+				bank = image->bits_per_pixel == 32 ? 5 : 7;
 			break;
 		}
 		break;
@@ -239,14 +749,20 @@ static void rgbconvert (XImage *image, unsigned char *pixels, int rowstride, int
 		break;
 	}
 
-	if (bank==5) {
-		convert_real_slow(image, pixels, rowstride, cmap, alpha);
-	} else {
+	if (bank<0)
+		/* table driven for any other True/DirectColor layout, else per pixel */
+		convert_rows(convert_generic_init(image, cmap, index), image, pixels, rowstride, alpha, cmap);
+	else {
 		index |= bank << 2;
-		(* convert_map[index]) (image, pixels, rowstride, cmap);
+		convert_rows(convert_map[index], image, pixels, rowstride, alpha, cmap);
 	}
 }
 
+void _g_pixbuf_convert (XImage *image, unsigned char *pixels, int rowstride, int alpha, xlib_colormap *cmap)
+{
+	rgbconvert (image, pixels, rowstride, alpha, cmap);
+}
+
 
 static void rgb1 (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap)
 {
@@ -272,9 +788,9 @@ static void rgb1 (XImage *image, unsigned char *pixels, int rowstride, xlib_colo
 
 		for (xx = 0; xx < width; xx ++) {
 			data = srow[xx >> 3] >> (7 - (xx & 7)) & 1;
-			*o++ = colormap->colors[data].red;
-			*o++ = colormap->colors[data].green;
-			*o++ = colormap->colors[data].blue;
+			*o++ = colormap->palette[data][0];
+			*o++ = colormap->palette[data][1];
+			*o++ = colormap->palette[data][2];
 		}
 		srow += bpl;
 		orow += rowstride;
@@ -294,7 +810,6 @@ static void rgb1a (XImage *image, unsigned char *pixels, int rowstride, xlib_col
 	register unsigned char data;
 	unsigned char *o;
 	unsigned char *srow = image->data, *orow = pixels;
-	unsigned int remap[2];
 
 
 	/* convert upto 8 pixels/time */
@@ -304,27 +819,15 @@ static void rgb1a (XImage *image, unsigned char *pixels, int rowstride, xlib_col
 	height = image->height;
 	bpl = image->bytes_per_line;
 
-	for (xx = 0; xx < 2; xx++) {
-#ifdef LITTLE
-		remap[xx] = 0xff000000
-			| colormap->colors[xx].blue << 16
-			| colormap->colors[xx].green << 8
-			| colormap->colors[xx].red;
-#else
-		remap[xx] = 0xff
-			| colormap->colors[xx].red << 24
-			| colormap->colors[xx].green << 16
-			| colormap->colors[xx].blue << 8;
-#endif
-	}
-
 	for (yy = 0; yy < height; yy++) {
 		s = srow;
 		o = orow;
 
 		for (xx = 0; xx < width; xx ++) {
 			data = srow[xx >> 3] >> (7 - (xx & 7)) & 1;
-			*o++ = remap[data];
+			/* palette entries are R, G, B, 0xff already */
+			memcpy (o, colormap->palette[data], 4);
+			o += 4;
 		}
 		srow += bpl;
 		orow += rowstride;
@@ -358,9 +861,9 @@ static void rgb8 (XImage *image, unsigned char *pixels, int rowstride, xlib_colo
 		o = orow;
 		for (xx = 0; xx < width; xx++) {
 			data = *s++ & mask;
-			*o++ = colormap->colors[data].red;
-			*o++ = colormap->colors[data].green;
-			*o++ = colormap->colors[data].blue;
+			*o++ = colormap->palette[data][0];
+			*o++ = colormap->palette[data][1];
+			*o++ = colormap->palette[data][2];
 		}
 		srow += bpl;
 		orow += rowstride;
@@ -378,9 +881,8 @@ static void rgb8a (XImage *image, unsigned char *pixels, int rowstride, xlib_col
 	int bpl;
 	unsigned int mask;
 	register unsigned int data;
-	unsigned int remap[256];
-	register unsigned char *s;	/* read 2 pixels at once */
-	register unsigned int *o;
+	register unsigned char *s;
+	register unsigned char *o;
 	unsigned char *srow = image->data, *orow = pixels;
 
 	width = image->width;
@@ -389,26 +891,14 @@ static void rgb8a (XImage *image, unsigned char *pixels, int rowstride, xlib_col
 
 	mask = mask_table[image->depth];
 
-	for (xx = 0; xx < colormap->size; xx++) {
-#ifdef LITTLE
-		remap[xx] = 0xff000000
-			| colormap->colors[xx].blue << 16
-			| colormap->colors[xx].green << 8
-			| colormap->colors[xx].red;
-#else
-		remap[xx] = 0xff
-			| colormap->colors[xx].red << 24
-			| colormap->colors[xx].green << 16
-			| colormap->colors[xx].blue << 8;
-#endif
-	}
-
 	for (yy = 0; yy < height; yy++) {
 		s = srow;
-		o = (unsigned int *) orow;
+		o = orow;
 		for (xx = 0; xx < width; xx ++) {
 			data = *s++ & mask;
-			*o++ = remap[data];
+			/* one 4 byte move per pixel, the palette carries the alpha */
+			memcpy (o, colormap->palette[data], 4);
+			o += 4;
 		}
 		srow += bpl;
 		orow += rowstride;
@@ -978,14 +1468,8 @@ static void rgb888amsb (XImage *image, unsigned char *pixels, int rowstride, xli
 	int bpl;
 
 	unsigned char *srow = image->data, *orow = pixels;
-#ifdef LITTLE
-	unsigned int *o;
-	unsigned int *s;
-#else
-	unsigned char *s;	/* for byte order swapping */
+	unsigned char *s;
 	unsigned char *o;
-#endif
-
 
 	width = image->width;
 	height = image->height;
@@ -993,24 +1477,14 @@ static void rgb888amsb (XImage *image, unsigned char *pixels, int rowstride, xli
 
 	/* msb data */
 	for (yy = 0; yy < height; yy++) {
-#ifdef LITTLE
-		s = (unsigned int *) srow;
-		o = (unsigned int *) orow;
-#else
 		s = srow;
 		o = orow;
-#endif
 		for (xx = 0; xx < width; xx++) {
-#ifdef LITTLE
 			*o++ = s[1];
 			*o++ = s[2];
 			*o++ = s[3];
 			*o++ = 0xff;
 			s += 4;
-#else
-			*o++ = (*s << 8) | 0xff; /* untested */
-			s++;
-#endif
 		}
 		srow += bpl;
 		orow += rowstride;
@@ -1045,6 +1519,226 @@ static void rgb888msb (XImage *image, unsigned char *pixels, int rowstride, xlib
 	}
 }
 
+/*
+  32 bits/pixel with red in the low byte (red_mask 0xff)
+*/
+static void bgr888lsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap)
+{
+	int xx, yy;
+	int width, height;
+	int bpl;
+
+	unsigned char *srow = image->data, *orow = pixels;
+	unsigned char *s;
+	unsigned char *o;
+
+	width = image->width;
+	height = image->height;
+	bpl = image->bytes_per_line;
+
+	for (yy = 0; yy < height; yy++) {
+		s = srow;
+		o = orow;
+		for (xx = 0; xx < width; xx++) {
+			*o++ = s[0];
+			*o++ = s[1];
+			*o++ = s[2];
+			s += 4;
+		}
+		srow += bpl;
+		orow += rowstride;
+	}
+}
+
+static void bgr888msb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap)
+{
+	int xx, yy;
+	int width, height;
+	int bpl;
+
+	unsigned char *srow = image->data, *orow = pixels;
+	unsigned char *s;
+	unsigned char *o;
+
+	width = image->width;
+	height = image->height;
+	bpl = image->bytes_per_line;
+
+	for (yy = 0; yy < height; yy++) {
+		s = srow;
+		o = orow;
+		for (xx = 0; xx < width; xx++) {
+			*o++ = s[3];
+			*o++ = s[2];
+			*o++ = s[1];
+			s += 4;
+		}
+		srow += bpl;
+		orow += rowstride;
+	}
+}
+
+static void bgr888alsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap)
+{
+	int xx, yy;
+	int width, height;
+	int bpl;
+
+	unsigned char *srow = image->data, *orow = pixels;
+	unsigned char *s;
+	unsigned char *o;
+
+	width = image->width;
+	height = image->height;
+	bpl = image->bytes_per_line;
+
+	for (yy = 0; yy < height; yy++) {
+		s = srow;
+		o = orow;
+		for (xx = 0; xx < width; xx++) {
+			*o++ = s[0];
+			*o++ = s[1];
+			*o++ = s[2];
+			*o++ = 0xff;
+			s += 4;
+		}
+		srow += bpl;
+		orow += rowstride;
+	}
+}
+
+static void bgr888amsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap)
+{
+	int xx, yy;
+	int width, height;
+	int bpl;
+
+	unsigned char *srow = image->data, *orow = pixels;
+	unsigned char *s;
+	unsigned char *o;
+
+	width = image->width;
+	height = image->height;
+	bpl = image->bytes_per_line;
+
+	for (yy = 0; yy < height; yy++) {
+		s = srow;
+		o = orow;
+		for (xx = 0; xx < width; xx++) {
+			*o++ = s[3];
+			*o++ = s[2];
+			*o++ = s[1];
+			*o++ = 0xff;
+			s += 4;
+		}
+		srow += bpl;
+		orow += rowstride;
+	}
+}
+
+/*
+  packed 24 bits/pixel, red_mask 0xff0000; the msb versions also serve
+  lsb data of a red_mask 0xff visual
+*/
+static void rgb24lsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap)
+{
+	int xx, yy;
+	int width, height;
+	int bpl;
+
+	unsigned char *srow = image->data, *orow = pixels;
+	unsigned char *s;
+	unsigned char *o;
+
+	width = image->width;
+	height = image->height;
+	bpl = image->bytes_per_line;
+
+	for (yy = 0; yy < height; yy++) {
+		s = srow;
+		o = orow;
+		for (xx = 0; xx < width; xx++) {
+			*o++ = s[2];
+			*o++ = s[1];
+			*o++ = s[0];
+			s += 3;
+		}
+		srow += bpl;
+		orow += rowstride;
+	}
+}
+
+static void rgb24msb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap)
+{
+	int yy;
+	unsigned char *srow = image->data, *orow = pixels;
+
+	/* already in output order */
+	for (yy = 0; yy < image->height; yy++) {
+		memcpy (orow, srow, image->width * 3);
+		srow += image->bytes_per_line;
+		orow += rowstride;
+	}
+}
+
+static void rgb24alsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap)
+{
+	int xx, yy;
+	int width, height;
+	int bpl;
+
+	unsigned char *srow = image->data, *orow = pixels;
+	unsigned char *s;
+	unsigned char *o;
+
+	width = image->width;
+	height = image->height;
+	bpl = image->bytes_per_line;
+
+	for (yy = 0; yy < height; yy++) {
+		s = srow;
+		o = orow;
+		for (xx = 0; xx < width; xx++) {
+			*o++ = s[2];
+			*o++ = s[1];
+			*o++ = s[0];
+			*o++ = 0xff;
+			s += 3;
+		}
+		srow += bpl;
+		orow += rowstride;
+	}
+}
+
+static void rgb24amsb (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *colormap)
+{
+	int xx, yy;
+	int width, height;
+	int bpl;
+
+	unsigned char *srow = image->data, *orow = pixels;
+	unsigned char *s;
+	unsigned char *o;
+
+	width = image->width;
+	height = image->height;
+	bpl = image->bytes_per_line;
+
+	for (yy = 0; yy < height; yy++) {
+		s = srow;
+		o = orow;
+		for (xx = 0; xx < width; xx++) {
+			*o++ = s[0];
+			*o++ = s[1];
+			*o++ = s[2];
+			*o++ = 0xff;
+			s += 3;
+		}
+		srow += bpl;
+		orow += rowstride;
+	}
+}
+
 static void visual_decompose_mask (unsigned long  mask, int *shift, int *prec)
 {
 	*shift = 0;
@@ -1061,6 +1755,137 @@ static void visual_decompose_mask (unsigned long  mask, int *shift, int *prec)
 	}
 }
 
+/*
+  Generic True/DirectColor conversion: each channel is shifted down and
+  looked up in a 256 entry table built once from the visual masks, so a
+  pixel costs one load and three lookups whatever the mask layout is.
+*/
+static inline unsigned int generic_fetch (const unsigned char *s, int bytes, int msb)
+{
+	switch (bytes) {
+	case 2:
+		return msb ? s[0] << 8 | s[1] : s[0] | s[1] << 8;
+	case 3:
+		return msb ? s[0] << 16 | s[1] << 8 | s[2] : s[0] | s[1] << 8 | s[2] << 16;
+	default:
+		return msb ? (unsigned int)s[0] << 24 | s[1] << 16 | s[2] << 8 | s[3]
+			: s[0] | s[1] << 8 | s[2] << 16 | (unsigned int)s[3] << 24;
+	}
+}
+
+static inline void convert_generic (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *cmap, int bytes, int msb, int alpha) __attribute__((always_inline));
+static inline void convert_generic (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *cmap, int bytes, int msb, int alpha)
+{
+	int xx, yy;
+	int width, height;
+	int bpl;
+	unsigned int pixel;
+	unsigned char *srow = image->data, *orow = pixels;
+	const unsigned char *s;
+	unsigned char *o;
+	const unsigned char *rl = cmap->lut[0], *gl = cmap->lut[1], *bl = cmap->lut[2];
+	int rs = cmap->shift[0], gs = cmap->shift[1], bs = cmap->shift[2];
+	unsigned int rm = cmap->mask[0], gm = cmap->mask[1], bm = cmap->mask[2];
+
+	width = image->width;
+	height = image->height;
+	bpl = image->bytes_per_line;
+
+	for (yy = 0; yy < height; yy++) {
+		s = srow;
+		o = orow;
+		for (xx = 0; xx < width; xx++) {
+			pixel = generic_fetch (s, bytes, msb);
+			o[0] = rl[(pixel >> rs) & rm];
+			o[1] = gl[(pixel >> gs) & gm];
+			o[2] = bl[(pixel >> bs) & bm];
+			if (alpha) {
+				o[3] = 0xff;
+				o += 4;
+			} else
+				o += 3;
+			s += bytes;
+		}
+		srow += bpl;
+		orow += rowstride;
+	}
+}
+
+#define GENERIC_CONVERTER(name, bytes, msb, alpha) \
+static void name (XImage *image, unsigned char *pixels, int rowstride, xlib_colormap *cmap) \
+{ \
+	convert_generic (image, pixels, rowstride, cmap, bytes, msb, alpha); \
+}
+
+GENERIC_CONVERTER (generic16lsb, 2, 0, 0)
+GENERIC_CONVERTER (generic16msb, 2, 1, 0)
+GENERIC_CONVERTER (generic16alsb, 2, 0, 1)
+GENERIC_CONVERTER (generic16amsb, 2, 1, 1)
+GENERIC_CONVERTER (generic24lsb, 3, 0, 0)
+GENERIC_CONVERTER (generic24msb, 3, 1, 0)
+GENERIC_CONVERTER (generic24alsb, 3, 0, 1)
+GENERIC_CONVERTER (generic24amsb, 3, 1, 1)
+GENERIC_CONVERTER (generic32lsb, 4, 0, 0)
+GENERIC_CONVERTER (generic32msb, 4, 1, 0)
+GENERIC_CONVERTER (generic32alsb, 4, 0, 1)
+GENERIC_CONVERTER (generic32amsb, 4, 1, 1)
+
+/* same index layout as convert_map, one bank per 16/24/32 bits_per_pixel */
+static cfunc generic_map[] = {
+	generic16lsb,generic16msb,generic16alsb,generic16amsb,
+	generic24lsb,generic24msb,generic24alsb,generic24amsb,
+	generic32lsb,generic32msb,generic32alsb,generic32amsb
+};
+
+/*
+  fill the channel tables of cmap for image and return the matching
+  converter, or NULL when only convert_real_slow can handle the visual
+*/
+static cfunc convert_generic_init (XImage *image, xlib_colormap *cmap, int index)
+{
+	Visual *v = cmap->visual;
+	unsigned long masks[3];
+	int c, i, shift, prec, idx;
+	unsigned char component;
+
+	if (v->class != TrueColor && v->class != DirectColor)
+		return NULL;
+	if (image->bits_per_pixel != 16 && image->bits_per_pixel != 24 && image->bits_per_pixel != 32)
+		return NULL;
+
+	masks[0] = v->red_mask;
+	masks[1] = v->green_mask;
+	masks[2] = v->blue_mask;
+
+	for (c = 0; c < 3; c++) {
+		if (!masks[c] || masks[c] > 0xffffffff)
+			return NULL;
+		visual_decompose_mask (masks[c], &shift, &prec);
+		/* only the top 8 bits of a wider channel reach the output */
+		if (prec > 8) {
+			shift += prec - 8;
+			prec = 8;
+		}
+		cmap->shift[c] = shift;
+		cmap->mask[c] = mask_table[prec];
+
+		for (i = 0; i <= (int)mask_table[prec]; i++) {
+			if (v->class == TrueColor) {
+				/* replicate the top bits down, as convert_real_slow does */
+				component = 0;
+				for (idx = 24; idx < 32; idx += prec)
+					component |= ((unsigned int)i << (32 - prec)) >> idx;
+				cmap->lut[c][i] = component;
+			} else {
+				idx = i << (8 - prec);
+				cmap->lut[c][i] = cmap->palette[idx][c];
+			}
+		}
+	}
+
+	return generic_map[(image->bits_per_pixel / 8 - 2) << 2 | (index & 3)];
+}
+
 /*
   This should work correctly with any display/any endianness, but will probably
   run quite slow
@@ -0,0 +1,457 @@
+#include "g_private.h"
+#include <X11/extensions/Xdamage.h>
+
+static const char *atom_names[G_ATOM_LAST] = {
+	"_MOTIF_WM_HINTS",
+	"_NET_WM_STATE",
+	"_NET_WM_WINDOW_TYPE",
+	"_NET_WM_WINDOW_TYPE_DOCK",
+	"_NET_WM_STATE_STICKY"
+};
+
+/* colormaps remembered per session, one per (Colormap, Visual) */
+#define G_CMAP_CACHE 8
+
+struct _GCaptureSession {
+	Display *dpy;
+	int own_display;	/* close dpy when the session goes away */
+
+	int screen;
+	Window root;
+	int root_width, root_height;
+
+	/* root window visual info, queried once */
+	Visual *visual;
+	int depth;
+	Colormap colormap;
+	long root_event_mask;
+
+	/* colormaps read so far, most recently used first */
+	xlib_colormap *cmaps[G_CMAP_CACHE];
+	int n_cmaps;
+
+	Atom atoms[G_ATOM_LAST];
+
+	/* reused for every capture on this connection */
+	GShmSegment *shm;
+
+	/* damage tracking, see g_capture_session_track_damage() */
+	int damage_event;	/* -1 until the extension was queried */
+	Damage damage;
+	XserverRegion parts;
+	Drawable damage_src;
+	GPixbuf *frame;		/* mirror of damage_src */
+	GRect *dirty;
+	int n_dirty, dirty_size;
+};
+
+/* more damaged rects than this are fetched as their bounding box */
+#define G_DAMAGE_MAX_RECTS 64
+
+GCaptureSession *g_capture_session_new_for_display (Display *dpy)
+{
+	GCaptureSession *session;
+	XWindowAttributes wa;
+
+	if (!dpy)
+		return NULL;
+
+	session = (GCaptureSession *)malloc(sizeof(GCaptureSession));
+	if (!session)
+		return NULL;
+
+	memset (session, 0, sizeof(GCaptureSession));
+	session->dpy = dpy;
+	session->screen = DefaultScreen (dpy);
+	session->root = RootWindow (dpy, session->screen);
+
+	XGetWindowAttributes (dpy, session->root, &wa);
+	session->root_width = wa.width;
+	session->root_height = wa.height;
+	session->visual = wa.visual;
+	session->depth = wa.depth;
+	session->colormap = wa.colormap;
+	session->root_event_mask = wa.your_event_mask;
+
+	/* RandR resizes and monitor hotplugs arrive as ConfigureNotify */
+	if (!(session->root_event_mask & StructureNotifyMask)) {
+		session->root_event_mask |= StructureNotifyMask;
+		XSelectInput (dpy, session->root, session->root_event_mask);
+	}
+
+	/* one round-trip for each kind instead of one per XInternAtom */
+	XInternAtoms (dpy, (char **)atom_names, G_ATOM_LOOKUP_ONLY, False, session->atoms);
+	XInternAtoms (dpy, (char **)atom_names + G_ATOM_LOOKUP_ONLY, G_ATOM_LAST - G_ATOM_LOOKUP_ONLY,
+		      True, session->atoms + G_ATOM_LOOKUP_ONLY);
+
+	session->shm = g_shm_segment_new (dpy);
+	session->damage_event = -1;
+
+	return session;
+}
+
+GCaptureSession *g_capture_session_new (const char *display_name)
+{
+	GCaptureSession *session;
+	Display *dpy;
+
+	dpy = XOpenDisplay (display_name);
+	if (!dpy)
+		return NULL;
+
+	session = g_capture_session_new_for_display (dpy);
+	if (!session) {
+		XCloseDisplay (dpy);
+		return NULL;
+	}
+	session->own_display = 1;
+
+	return session;
+}
+
+void g_capture_session_free (GCaptureSession *session)
+{
+	if (!session)
+		return;
+
+	g_capture_session_untrack_damage (session);
+	g_capture_session_invalidate_colormaps (session);
+	g_shm_segment_free (session->shm);
+	if (session->own_display)
+		XCloseDisplay (session->dpy);
+	free (session);
+}
+
+Display *g_capture_session_get_display (GCaptureSession *session)
+{
+	return session->dpy;
+}
+
+Atom _g_capture_session_atom (GCaptureSession *session, int which)
+{
+	return session->atoms[which];
+}
+
+/* clip area to a width x height drawable, returns 0 when nothing is left */
+static int clip_area (GRect *r, const GRect *area, int width, int height)
+{
+	int x1, y1, x2, y2;
+
+	if (!area) {
+		r->x = r->y = 0;
+		r->width = width;
+		r->height = height;
+		return width > 0 && height > 0;
+	}
+
+	x1 = area->x < 0 ? 0 : area->x;
+	y1 = area->y < 0 ? 0 : area->y;
+	x2 = area->x + area->width;
+	y2 = area->y + area->height;
+	if (x2 > width)
+		x2 = width;
+	if (y2 > height)
+		y2 = height;
+
+	r->x = x1;
+	r->y = y1;
+	r->width = x2 - x1;
+	r->height = y2 - y1;
+
+	return r->width > 0 && r->height > 0;
+}
+
+/* drop cached colors of id, or of every colormap when id is None */
+static void colormap_cache_drop (GCaptureSession *session, Colormap id)
+{
+	int i, n = 0;
+
+	for (i = 0; i < session->n_cmaps; i++) {
+		if (id == None || session->cmaps[i]->colormap == id)
+			_g_xlib_colormap_free (session->cmaps[i]);
+		else
+			session->cmaps[n++] = session->cmaps[i];
+	}
+	session->n_cmaps = n;
+}
+
+void g_capture_session_invalidate_colormaps (GCaptureSession *session)
+{
+	colormap_cache_drop (session, None);
+}
+
+/*
+  colors of colormap id for visual, read from the server only the first
+  time; w is a window using it, watched for ColormapNotify from then on
+*/
+static xlib_colormap *session_colormap (GCaptureSession *session, Window w, Colormap id, Visual *visual, long event_mask)
+{
+	xlib_colormap *xc;
+	XEvent ev;
+	int i;
+
+	/* a colormap that was installed, replaced or freed is read again */
+	while (XCheckTypedEvent (session->dpy, ColormapNotify, &ev))
+		colormap_cache_drop (session, ev.xcolormap.colormap);
+
+	for (i = 0; i < session->n_cmaps; i++) {
+		xc = session->cmaps[i];
+		if (xc->colormap == id && xc->visual == visual) {
+			memmove (&session->cmaps[1], &session->cmaps[0], i * sizeof(xlib_colormap *));
+			session->cmaps[0] = xc;
+			return xc;
+		}
+	}
+
+	xc = _g_xlib_colormap_get (session->dpy, id, visual);
+	if (!xc)
+		return NULL;
+
+	/* TrueColor pixels do not go through the colormap */
+	if (visual->class != TrueColor && !(event_mask & ColormapChangeMask)) {
+		XSelectInput (session->dpy, w, event_mask | ColormapChangeMask);
+		if (w == session->root)
+			session->root_event_mask |= ColormapChangeMask;
+	}
+
+	if (session->n_cmaps == G_CMAP_CACHE)
+		_g_xlib_colormap_free (session->cmaps[--session->n_cmaps]);
+	memmove (&session->cmaps[1], &session->cmaps[0], session->n_cmaps * sizeof(xlib_colormap *));
+	session->cmaps[0] = xc;
+	session->n_cmaps++;
+
+	return xc;
+}
+
+/* what a capture of src needs to know about it */
+typedef struct {
+	Drawable drawable;
+	int depth;
+	int width, height;
+	xlib_colormap *cmap;
+} capture_target;
+
+static int session_target (GCaptureSession *session, Drawable src, capture_target *t)
+{
+	XWindowAttributes wa;
+	XEvent ev;
+
+	if (src == None || src == session->root) {
+		/* everything about the root is already known, bar a new size */
+		while (XCheckTypedWindowEvent (session->dpy, session->root, ConfigureNotify, &ev)) {
+			session->root_width = ev.xconfigure.width;
+			session->root_height = ev.xconfigure.height;
+		}
+		t->drawable = session->root;
+		t->depth = session->depth;
+		t->width = session->root_width;
+		t->height = session->root_height;
+		t->cmap = session_colormap (session, session->root, session->colormap, session->visual, session->root_event_mask);
+	} else {
+		if (!XGetWindowAttributes (session->dpy, src, &wa))
+			return -1;
+		t->drawable = src;
+		t->depth = wa.depth;
+		t->width = wa.width;
+		t->height = wa.height;
+		t->cmap = session_colormap (session, src, wa.colormap, wa.visual, wa.your_event_mask);
+	}
+
+	return t->cmap ? 0 : -1;
+}
+
+/*
+  capture area (in src coordinates, NULL for all of it) from src, or from
+  the root window when src is None
+*/
+GPixbuf *g_capture_session_grab (GCaptureSession *session, Drawable src, const GRect *area, g_capture_path *path)
+{
+	capture_target t;
+	GRect r;
+
+	if (session_target (session, src, &t) < 0 || !clip_area (&r, area, t.width, t.height))
+		return NULL;
+
+	return _g_pixbuf_x_get_area (session->dpy, t.drawable, t.depth, t.cmap, r.x, r.y, r.width, r.height, session->shm, path, 0);
+}
+
+GPixbuf *g_capture_session_grab_native (GCaptureSession *session, Drawable src, const GRect *area, g_capture_path *path)
+{
+	capture_target t;
+	GRect r;
+
+	if (session_target (session, src, &t) < 0 || !clip_area (&r, area, t.width, t.height))
+		return NULL;
+
+	return _g_pixbuf_x_get_area (session->dpy, t.drawable, t.depth, t.cmap, r.x, r.y, r.width, r.height, session->shm, path, 1);
+}
+
+/* streaming counterpart of g_capture_session_grab() */
+int g_capture_session_save (GCaptureSession *session, Drawable src, const GRect *area, FILE *fp, g_save_type type, int band_rows)
+{
+	GFileSink fs;
+
+	if (!fp)
+		return -1;
+	_g_file_sink_init (&fs, fp);
+	return g_capture_session_save_to_sink (session, src, area, &fs.sink, type, band_rows);
+}
+
+int g_capture_session_save_to_sink (GCaptureSession *session, Drawable src, const GRect *area, GSaveSink *sink, g_save_type type, int band_rows)
+{
+	capture_target t;
+	GRect r;
+
+	if (session_target (session, src, &t) < 0 || !clip_area (&r, area, t.width, t.height))
+		return -1;
+
+	return _g_pixbuf_x_save_area (session->dpy, t.drawable, t.depth, t.cmap, r.x, r.y, r.width, r.height, session->shm, sink, type, band_rows);
+}
+
+static void damage_frame_free (GCaptureSession *session)
+{
+	g_pixbuf_free (session->frame);
+	session->frame = NULL;
+}
+
+int g_capture_session_track_damage (GCaptureSession *session, Drawable src)
+{
+	int error_base;
+
+	g_capture_session_untrack_damage (session);
+
+	if (session->damage_event < 0 && !XDamageQueryExtension (session->dpy, &session->damage_event, &error_base)) {
+		session->damage_event = -1;
+		return -1;
+	}
+
+	session->damage_src = src == None ? session->root : src;
+	/* one event per clean -> damaged transition, the region is read on demand */
+	session->damage = XDamageCreate (session->dpy, session->damage_src, XDamageReportNonEmpty);
+	session->parts = XFixesCreateRegion (session->dpy, NULL, 0);
+
+	return 0;
+}
+
+void g_capture_session_untrack_damage (GCaptureSession *session)
+{
+	if (session->damage) {
+		XDamageDestroy (session->dpy, session->damage);
+		XFixesDestroyRegion (session->dpy, session->parts);
+		session->damage = None;
+		session->parts = None;
+	}
+	damage_frame_free (session);
+	free (session->dirty);
+	session->dirty = NULL;
+	session->n_dirty = session->dirty_size = 0;
+}
+
+/* move the damage accumulated so far into session->dirty */
+static int damage_collect (GCaptureSession *session, int width, int height)
+{
+	XRectangle *rects;
+	XEvent ev;
+	GRect r, area, *dirty;
+	int i, n = 0, need;
+	int x1, y1, x2, y2;
+
+	/* the notify events only say "something changed", drop them */
+	while (XCheckTypedEvent (session->dpy, session->damage_event + XDamageNotify, &ev))
+		;
+
+	XDamageSubtract (session->dpy, session->damage, None, session->parts);
+	rects = XFixesFetchRegion (session->dpy, session->parts, &n);
+	if (!rects)
+		n = 0;
+
+	/* room for at least one rect, the full frame on the first grab */
+	need = n > G_DAMAGE_MAX_RECTS || n < 1 ? 1 : n;
+	if (need > session->dirty_size) {
+		dirty = (GRect *)realloc(session->dirty, need * sizeof(GRect));
+		if (!dirty) {
+			if (rects)
+				XFree (rects);
+			return -1;
+		}
+		session->dirty = dirty;
+		session->dirty_size = need;
+	}
+
+	session->n_dirty = 0;
+	if (!rects) {
+		/* no reply, and the damage is subtracted already: redo it all */
+		if (clip_area (&r, NULL, width, height))
+			session->dirty[session->n_dirty++] = r;
+	} else if (n > G_DAMAGE_MAX_RECTS) {
+		x1 = y1 = 0x7fffffff;
+		x2 = y2 = -0x7fffffff;
+		for (i = 0; i < n; i++) {
+			if (rects[i].x < x1)
+				x1 = rects[i].x;
+			if (rects[i].y < y1)
+				y1 = rects[i].y;
+			if (rects[i].x + rects[i].width > x2)
+				x2 = rects[i].x + rects[i].width;
+			if (rects[i].y + rects[i].height > y2)
+				y2 = rects[i].y + rects[i].height;
+		}
+		area.x = x1;
+		area.y = y1;
+		area.width = x2 - x1;
+		area.height = y2 - y1;
+		if (clip_area (&r, &area, width, height))
+			session->dirty[session->n_dirty++] = r;
+	} else {
+		for (i = 0; i < n; i++) {
+			area.x = rects[i].x;
+			area.y = rects[i].y;
+			area.width = rects[i].width;
+			area.height = rects[i].height;
+			if (clip_area (&r, &area, width, height))
+				session->dirty[session->n_dirty++] = r;
+		}
+	}
+	if (rects)
+		XFree (rects);
+
+	return 0;
+}
+
+GPixbuf *g_capture_session_grab_damaged (GCaptureSession *session, const GRect **dirty, int *n_dirty)
+{
+	capture_target t;
+
+	if (!session->damage || session_target (session, session->damage_src, &t) < 0)
+		return NULL;
+
+	/* a resized window starts over with a full frame */
+	if (session->frame && (session->frame->width != t.width || session->frame->height != t.height))
+		damage_frame_free (session);
+
+	if (damage_collect (session, t.width, t.height) < 0)
+		return NULL;
+
+	if (!session->frame) {
+		session->frame = g_pixbuf_new (t.depth, 0, 0, 8, t.width, t.height);
+		if (!session->frame)
+			return NULL;
+		session->dirty[0].x = session->dirty[0].y = 0;
+		session->dirty[0].width = t.width;
+		session->dirty[0].height = t.height;
+		session->n_dirty = 1;
+	}
+
+	if (_g_pixbuf_x_update (session->dpy, t.drawable, t.depth, t.cmap, session->shm, session->frame, session->dirty, session->n_dirty) < 0) {
+		/* whatever was missed gets fetched again next time */
+		damage_frame_free (session);
+		return NULL;
+	}
+
+	if (dirty)
+		*dirty = session->dirty;
+	if (n_dirty)
+		*n_dirty = session->n_dirty;
+
+	return session->frame;
+}
@@ -1,4 +1,4 @@
-#include "g_pixbuf.h"
+#include "g_private.h"
 #include <X11/Xatom.h>
 #include <X11/cursorfont.h>
 #include <strings.h>
@@ -25,20 +25,11 @@ typedef struct _mwmhints{
     uint32_t status;
 }MWMHints;
 
+static GCaptureSession *session;
 static Display *dpy;
 static Window win;
 
 static void grab_pointer_position(int *src_x, int *src_y, int *width, int *height);
-static void my_init()
-{
-	dpy = XOpenDisplay(NULL);
-}
-
-static void my_close()
-{
-	if (dpy != NULL)
-		XCloseDisplay(dpy);
-}
 
 static void createWindow()
 {
@@ -55,7 +46,7 @@ static void removeTile()
 	MWMHints mwmhints;
     Atom prop;
     memset(&mwmhints, 0, sizeof(mwmhints));
-    prop = XInternAtom(dpy, "_MOTIF_WM_HINTS", False);
+    prop = _g_capture_session_atom(session, G_ATOM_MOTIF_WM_HINTS);
     mwmhints.flags = MWM_HINTS_DECORATIONS;
     mwmhints.decorations = 0;
     XChangeProperty(dpy, win, prop, prop, 32, PropModeReplace, (unsigned char *) &mwmhints, PROP_MWM_HINTS_ELEMENTS);
@@ -64,17 +55,18 @@ static void removeTile()
 static void show_forever()
 {
 #if 1  //实现在linux桌面任意工作区可见
-	Atom net_wm_state_sticky=XInternAtom(dpy, "_NET_WM_STATE_STICKY", True);
-	Atom net_wm_state = XInternAtom (dpy, "_NET_WM_STATE", False);
-  	XChangeProperty (dpy, win, net_wm_state, XA_ATOM, 32, PropModeAppend, (unsigned char *)&net_wm_state_sticky, 1);
+	Atom net_wm_state_sticky = _g_capture_session_atom(session, G_ATOM_NET_WM_STATE_STICKY);
+	Atom net_wm_state = _g_capture_session_atom(session, G_ATOM_NET_WM_STATE);
+	if (net_wm_state_sticky != None)
+  		XChangeProperty (dpy, win, net_wm_state, XA_ATOM, 32, PropModeAppend, (unsigned char *)&net_wm_state_sticky, 1);
 #endif
 }
 
 static void show_toplevel()
 {
 #if 1 // 窗口始终置顶
-	Atom net_wm_window_type = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False);
-	Atom net_wm_window_type_dock = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DOCK", False);
+	Atom net_wm_window_type = _g_capture_session_atom(session, G_ATOM_NET_WM_WINDOW_TYPE);
+	Atom net_wm_window_type_dock = _g_capture_session_atom(session, G_ATOM_NET_WM_WINDOW_TYPE_DOCK);
 	XChangeProperty (dpy, win, net_wm_window_type, XA_ATOM, 32, PropModeReplace, (unsigned char *)&net_wm_window_type_dock, 1);  
 #endif
 }
@@ -204,19 +196,35 @@ void grab_window_position(int *src_x, int *src_y, int *width, int *height)
 
 void grab_window(const char *fileName, g_save_type type)
 {
-	my_init();
-	int x, y, w, h;
+	GCaptureSession *s = g_capture_session_new(NULL);
+
+	if (!s)
+		return;
+	grab_window_with_session(s, fileName, type);
+	g_capture_session_free(s);
+}
+
+/* same as grab_window() but reuses the connection and buffers of s */
+void grab_window_with_session(GCaptureSession *s, const char *fileName, g_save_type type)
+{
+	int x = 0, y = 0, w = 0, h = 0;
+	GRect area;
+
+	session = s;
+	dpy = g_capture_session_get_display(s);
 //	grab_pointer_position(&x, &y, &w, &h);
 	grab_window_position(&x, &y, &w, &h);
-   	XWindowAttributes window_attr;
-	Window window = DefaultRootWindow(dpy);
-	GPixbuf *dest = g_pixbuf_x_get_from_drawable(dpy, window, x, y, w, h);
+	area.x = x;
+	area.y = y;
+	area.width = w;
+	area.height = h;
+	GPixbuf *dest = g_capture_session_grab(s, None, &area, NULL);
+	if (!dest)
+		return;
 	FILE *fp;
 	fp = fopen(fileName, "wba");
 
 	g_pixbuf_save(dest, fp, type);
 	if (fp) fclose(fp);
-	free(dest->pixels);
-	free(dest);
-	my_close();
+	g_pixbuf_free(dest);
 }
@@ -0,0 +1,172 @@
+/*
+  simd_parity --- the vector converters against the plain C ones
+
+  At every XSS_SIMD level this cpu runs, each 24/32 bit TrueColor
+  converter and the 4:2:0 JPEG kernel must write the same bytes as the
+  scalar code, on odd widths and on rows with padding after them. Levels
+  the cpu lacks are skipped; exits 77 when there is no vector level.
+*/
+
+#include "g_private.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HEIGHT	5
+#define PAD	13		/* bytes after each row, odd to misalign rows */
+#define FILL	0x5a		/* what is under the padding, must survive */
+
+static const char *level_names[] = { "none", "sse2", "ssse3", "avx2" };
+static const int widths[] = { 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 257 };
+#define N_WIDTHS ((int)(sizeof(widths) / sizeof(widths[0])))
+
+static const char *bank_names[] = { "rgb888", "bgr888", "rgb24", "bgr24" };
+static const char *order_names[] = { "lsb", "msb", "alsb", "amsb" };
+
+static void fill_random (unsigned char *p, size_t n)
+{
+	while (n--)
+		*p++ = rand () >> 7;
+}
+
+/* the source ends right after the last row, so overreads hit the end */
+static unsigned char *source_new (int width, int bpp, int *bpl)
+{
+	unsigned char *src;
+	size_t size;
+
+	*bpl = width * bpp + PAD;
+	size = (size_t)*bpl * (HEIGHT - 1) + width * bpp;
+	src = (unsigned char *)malloc(size);
+	if (src)
+		fill_random (src, size);
+	return src;
+}
+
+static int check_converter (cfunc ref, cfunc vec, int bpp, int n_channels, int width)
+{
+	XImage image;
+	unsigned char *src, *a, *b;
+	int bpl, rowstride, ok;
+	size_t size;
+
+	src = source_new (width, bpp, &bpl);
+	rowstride = width * n_channels + PAD;
+	size = (size_t)rowstride * HEIGHT;
+	a = (unsigned char *)malloc(size);
+	b = (unsigned char *)malloc(size);
+	if (!src || !a || !b) {
+		fprintf (stderr, "simd_parity: out of memory\n");
+		exit (1);
+	}
+	memset (a, FILL, size);
+	memset (b, FILL, size);
+
+	memset (&image, 0, sizeof(image));
+	image.width = width;
+	image.height = HEIGHT;
+	image.bytes_per_line = bpl;
+	image.data = (char *)src;
+
+	ref (&image, a, rowstride, NULL);
+	vec (&image, b, rowstride, NULL);
+	ok = !memcmp (a, b, size);
+
+	free (src);
+	free (a);
+	free (b);
+	return ok;
+}
+
+static int check_ycc420 (ycc420func ref, ycc420func vec, int width)
+{
+	unsigned char *src, *out[2];
+	int bpl, c_cols, i, ok;
+	size_t y_size, c_size;
+
+	/* as wide as the jpeg MCUs, so the kernels pad the last pixel out */
+	c_cols = (width + 15) / 16 * 8;
+	y_size = 2 * c_cols + PAD;
+	c_size = c_cols + PAD;
+
+	src = source_new (width, 4, &bpl);
+	if (!src) {
+		fprintf (stderr, "simd_parity: out of memory\n");
+		exit (1);
+	}
+	for (i = 0; i < 2; i++) {
+		out[i] = (unsigned char *)malloc(2 * y_size + 2 * c_size);
+		if (!out[i]) {
+			fprintf (stderr, "simd_parity: out of memory\n");
+			exit (1);
+		}
+		memset (out[i], FILL, 2 * y_size + 2 * c_size);
+	}
+
+	ref (src, src + bpl, width, out[0], out[0] + y_size,
+	     out[0] + 2 * y_size, out[0] + 2 * y_size + c_size, c_cols);
+	vec (src, src + bpl, width, out[1], out[1] + y_size,
+	     out[1] + 2 * y_size, out[1] + 2 * y_size + c_size, c_cols);
+	ok = !memcmp (out[0], out[1], 2 * y_size + 2 * c_size);
+
+	free (src);
+	free (out[0]);
+	free (out[1]);
+	return ok;
+}
+
+int main (void)
+{
+	cfunc ref[G_TRUECOLOR_BANKS], vec[G_TRUECOLOR_BANKS];
+	int level, got, i, w, bpp, n_channels;
+	int n_levels = 0, n_checks = 0, n_failed = 0;
+
+	srand (1);
+	_g_truecolor_banks (G_SIMD_NONE, ref);
+
+	for (level = G_SIMD_SSE2; level <= G_SIMD_AVX2; level++) {
+		setenv ("XSS_SIMD", level_names[level], 1);
+		got = _g_simd_level ();
+		if (got > level) {
+			printf ("FAIL XSS_SIMD=%s gives level %s\n", level_names[level], level_names[got]);
+			n_failed++;
+			continue;
+		}
+		if (got < level) {
+			printf ("SKIP %s, not on this cpu\n", level_names[level]);
+			continue;
+		}
+		n_levels++;
+
+		_g_truecolor_banks (level, vec);
+		for (i = 0; i < G_TRUECOLOR_BANKS; i++) {
+			if (vec[i] == ref[i])
+				continue;
+			bpp = i < 8 ? 4 : 3;
+			n_channels = (i & 3) < 2 ? 3 : 4;
+			for (w = 0; w < N_WIDTHS; w++) {
+				n_checks++;
+				if (!check_converter (ref[i], vec[i], bpp, n_channels, widths[w])) {
+					printf ("FAIL %s %s%s width %d\n", level_names[level],
+						bank_names[i >> 2], order_names[i & 3], widths[w]);
+					n_failed++;
+				}
+			}
+		}
+
+		if (_g_ycc420_func (level) != _g_ycc420_func (G_SIMD_NONE)) {
+			for (w = 0; w < N_WIDTHS; w++) {
+				n_checks++;
+				if (!check_ycc420 (_g_ycc420_func (G_SIMD_NONE), _g_ycc420_func (level), widths[w])) {
+					printf ("FAIL %s ycc420 width %d\n", level_names[level], widths[w]);
+					n_failed++;
+				}
+			}
+		}
+	}
+
+	printf ("simd_parity: %d levels, %d checks, %d failed\n", n_levels, n_checks, n_failed);
+	if (n_failed)
+		return 1;
+	return n_levels ? 0 : 77;
+}
@@ -0,0 +1,543 @@
+/*
+  Batch conversion: expand the inputs into a file list, then convert the
+  files on an XssPool. Workers claim files one at a time, so a thread
+  that draws a small file simply takes the next one while another is
+  still busy with a large one. Every file reserves its decoded size
+  against max_inflight first; a file larger than the whole budget runs
+  once nothing else is in flight.
+*/
+
+#include "transform.h"
+#include "bmp_png.h"
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <glob.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define BATCH_MAX_INFLIGHT	(512ULL * 1024 * 1024)
+
+typedef struct {
+	char *in;
+	char *out;
+	unsigned long long need;	/* decoded bytes the conversion holds */
+	int refuse;			/* status to fail with unconverted, -2 or -3 */
+} convert_job;
+
+typedef struct {
+	char **files;
+	int n_files, allocated;
+} file_list;
+
+typedef struct {
+	convert_type type;
+	const convert_batch_options *options;
+	pthread_mutex_t lock;
+	pthread_cond_t released;
+	pthread_mutex_t progress_lock;	/* only keeps progress calls apart */
+	unsigned long long inflight;
+	convert_batch_stats *stats;
+} convert_batch_data;
+
+static double now_ms (void)
+{
+	struct timespec t;
+
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+void convert_batch_options_init (convert_batch_options *options)
+{
+	memset (options, 0, sizeof(convert_batch_options));
+	options->complevel = -1;
+	options->jpeg_scale = 1;
+}
+
+/* ------------------------------------------------------------------ */
+
+static int file_list_add (file_list *list, const char *fn)
+{
+	char **files;
+	int allocated;
+
+	if (list->n_files == list->allocated) {
+		allocated = list->allocated ? list->allocated * 2 : 256;
+		files = (char **)realloc(list->files, allocated * sizeof(char *));
+		if (!files)
+			return -1;
+		list->files = files;
+		list->allocated = allocated;
+	}
+	list->files[list->n_files] = strdup (fn);
+	if (!list->files[list->n_files])
+		return -1;
+	list->n_files++;
+	return 0;
+}
+
+static void file_list_free (file_list *list)
+{
+	int i;
+
+	for (i = 0; i < list->n_files; i++)
+		free (list->files[i]);
+	free (list->files);
+}
+
+static int has_input_suffix (convert_type type, const char *fn)
+{
+	const char *dot = strrchr (fn, '.');
+
+	if (!dot)
+		return 0;
+	switch (type) {
+	case CONVERT_BMP2PNG:
+		return !strcasecmp (dot, ".bmp");
+	case CONVERT_PNG2BMP:
+		return !strcasecmp (dot, ".png");
+	case CONVERT_JPG2BMP:
+		return !strcasecmp (dot, ".jpg") || !strcasecmp (dot, ".jpeg");
+	}
+	return 0;
+}
+
+static int compare_names (const void *a, const void *b)
+{
+	return strcmp (*(char * const *)a, *(char * const *)b);
+}
+
+/* the files of dir with the input suffix, in name order */
+static int add_directory (file_list *list, convert_type type, const char *dir)
+{
+	struct dirent *e;
+	struct stat st;
+	char *fn;
+	DIR *d;
+	int first = list->n_files, ret = 0;
+
+	d = opendir (dir);
+	if (!d)
+		return -1;
+	while (!ret && (e = readdir (d)) != NULL) {
+		if (!has_input_suffix (type, e->d_name))
+			continue;
+		fn = (char *)malloc(strlen (dir) + strlen (e->d_name) + 2);
+		if (!fn) {
+			ret = -1;
+			break;
+		}
+		sprintf (fn, "%s/%s", dir, e->d_name);
+		if (stat (fn, &st) == 0 && S_ISREG (st.st_mode))
+			ret = file_list_add (list, fn);
+		free (fn);
+	}
+	closedir (d);
+
+	qsort (list->files + first, list->n_files - first, sizeof(char *), compare_names);
+	return ret;
+}
+
+static int expand_inputs (file_list *list, convert_type type, char **inputs, int n_inputs)
+{
+	struct stat st;
+	glob_t g;
+	size_t j;
+	int i, ret = 0;
+
+	for (i = 0; i < n_inputs && !ret; i++) {
+		if (stat (inputs[i], &st) == 0) {
+			if (S_ISDIR (st.st_mode))
+				ret = add_directory (list, type, inputs[i]);
+			else
+				ret = file_list_add (list, inputs[i]);
+		} else if (strpbrk (inputs[i], "*?[")) {
+			if (glob (inputs[i], 0, NULL, &g) != 0)
+				continue;
+			/* like a directory, only what the conversion reads */
+			for (j = 0; j < g.gl_pathc && !ret; j++)
+				if (has_input_suffix (type, g.gl_pathv[j])
+				    && stat (g.gl_pathv[j], &st) == 0 && S_ISREG (st.st_mode))
+					ret = file_list_add (list, g.gl_pathv[j]);
+			globfree (&g);
+		} else {
+			/* a missing file is reported as a failed conversion */
+			ret = file_list_add (list, inputs[i]);
+		}
+	}
+
+	return ret;
+}
+
+/* in with its suffix replaced, under out_dir if there is one */
+static char *output_name (convert_type type, const char *in, const char *out_dir)
+{
+	const char *base = in, *slash, *dot, *ext = type == CONVERT_BMP2PNG ? ".png" : ".bmp";
+	size_t dir_len = 0, base_len;
+	char *out;
+
+	slash = strrchr (in, '/');
+	if (out_dir) {
+		if (slash)
+			base = slash + 1;
+		dir_len = strlen (out_dir) + 1;
+	}
+	dot = strrchr (base, '.');
+	if (!dot || (slash && dot < slash))
+		dot = base + strlen (base);
+	base_len = dot - base;
+
+	out = (char *)malloc(dir_len + base_len + strlen (ext) + 1);
+	if (!out)
+		return NULL;
+	if (out_dir)
+		sprintf (out, "%s/", out_dir);
+	memcpy (out + dir_len, base, base_len);
+	strcpy (out + dir_len + base_len, ext);
+	return out;
+}
+
+static int compare_outputs (const void *a, const void *b)
+{
+	const convert_job *ja = *(convert_job * const *)a, *jb = *(convert_job * const *)b;
+	int c = strcmp (ja->out, jb->out);
+
+	return c ? c : (ja > jb) - (ja < jb);
+}
+
+/* in and out name one file, say an a.bmp given to jpg2bmp */
+static int same_file (const char *in, const char *out)
+{
+	struct stat a, b;
+
+	if (!strcmp (in, out))
+		return 1;
+	return stat (in, &a) == 0 && stat (out, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+/*
+  Flag every job that would write over its own input, then every job
+  whose output an earlier one already writes, say a.jpg and a.jpeg, or
+  two dirs with an x.bmp each under one out_dir; those fail instead of
+  converting over each other
+*/
+static int mark_clashes (convert_job *jobs, int n_jobs)
+{
+	convert_job **sorted;
+	int i, n = 0;
+
+	sorted = (convert_job **)malloc(n_jobs * sizeof(convert_job *));
+	if (!sorted)
+		return -1;
+	for (i = 0; i < n_jobs; i++) {
+		if (same_file (jobs[i].in, jobs[i].out))
+			jobs[i].refuse = -3;
+		else
+			sorted[n++] = &jobs[i];
+	}
+	qsort (sorted, n, sizeof(convert_job *), compare_outputs);
+	for (i = 1; i < n; i++)
+		if (!strcmp (sorted[i - 1]->out, sorted[i]->out))
+			sorted[i]->refuse = -2;
+	free (sorted);
+	return 0;
+}
+
+/* ------------------------------------------------------------------ */
+
+/*
+  Decoded bytes a conversion holds, read from the image header; 0 when
+  the header cannot be read, the conversion then fails quickly anyway.
+  Streaming conversions hold a block of rows where they can stream.
+*/
+static unsigned long long stream_size (unsigned long long size, unsigned long long rowbytes)
+{
+	unsigned long long block = rowbytes > STREAM_BLOCK ? rowbytes : STREAM_BLOCK;
+
+	return size < block ? size : block;
+}
+
+static unsigned long long bmp_decoded_size (FILE *fp, int stream)
+{
+	unsigned char h[34];
+	unsigned long long w, rows;
+	int bpp, compression = 0;
+
+	if (fread (h, 1, sizeof(h), fp) != sizeof(h) || h[0] != 'B' || h[1] != 'M')
+		return 0;
+	if ((h[14] | h[15] << 8) == 12) {	/* OS/2 */
+		w = h[18] | h[19] << 8;
+		rows = h[20] | h[21] << 8;
+		bpp = h[24] | h[25] << 8;
+	} else {
+		w = (unsigned int)(h[18] | h[19] << 8 | h[20] << 16 | (unsigned int)h[21] << 24);
+		rows = (unsigned int)(h[22] | h[23] << 8 | h[24] << 16 | (unsigned int)h[25] << 24);
+		if (rows & 0x80000000u)
+			rows = 0x100000000ULL - rows;
+		bpp = h[28] | h[29] << 8;
+		compression = h[30] | h[31] << 8 | h[32] << 16 | (unsigned int)h[33] << 24;
+	}
+	if (bpp == 16)
+		bpp = 24;
+	/* uncompressed BI_RGB rows are read straight from a mapping */
+	if (stream && compression == 0 && (h[28] | h[29] << 8) != 16)
+		return stream_size ((w * bpp + 31) / 32 * 4 * rows, (w * bpp + 31) / 32 * 4);
+	return (w * bpp + 31) / 32 * 4 * rows;
+}
+
+static unsigned long long png_decoded_size (FILE *fp, int stream)
+{
+	static const unsigned char sig[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+	unsigned char h[29];
+	unsigned long long w, rows;
+	int bpp;
+
+	if (fread (h, 1, sizeof(h), fp) != sizeof(h) || memcmp (h, sig, 8) || memcmp (h + 12, "IHDR", 4))
+		return 0;
+	w = (unsigned int)((unsigned int)h[16] << 24 | h[17] << 16 | h[18] << 8 | h[19]);
+	rows = (unsigned int)((unsigned int)h[20] << 24 | h[21] << 16 | h[22] << 8 | h[23]);
+	/* png2bmp: 16 bit is stripped, alpha and gray+alpha go to 32 bit */
+	switch (h[25]) {
+	case PNG_COLOR_TYPE_RGB:
+		bpp = 24;
+		break;
+	case PNG_COLOR_TYPE_RGB_ALPHA:
+	case PNG_COLOR_TYPE_GRAY_ALPHA:
+		bpp = 32;
+		break;
+	default:
+		bpp = h[24] > 8 ? 8 : h[24];
+		break;
+	}
+	/* interlaced ones are held whole */
+	if (stream && h[28] == 0)
+		return stream_size ((w * bpp + 31) / 32 * 4 * rows, (w * bpp + 31) / 32 * 4);
+	return (w * bpp + 31) / 32 * 4 * rows;
+}
+
+static unsigned long long jpeg_decoded_size (FILE *fp, int scale, int topdown)
+{
+	unsigned char h[8];
+	unsigned long long w, rows, rowbytes;
+	int c, marker;
+	long len;
+
+	if (scale < 1)		/* jpg2bmp_scaled() turns it down */
+		scale = 1;
+	if (fgetc (fp) != 0xff || fgetc (fp) != 0xd8)
+		return 0;
+	for (;;) {
+		while ((c = fgetc (fp)) != 0xff)
+			if (c == EOF)
+				return 0;
+		while ((marker = fgetc (fp)) == 0xff)
+			;
+		if (marker == EOF || marker == 0xd9 || marker == 0xda)
+			return 0;
+		if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+			continue;
+		if (fread (h, 1, 2, fp) != 2)
+			return 0;
+		len = (h[0] << 8 | h[1]) - 2;
+		/* SOF0..SOF15 but DHT, JPG and DAC */
+		if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+			if (fread (h, 1, 6, fp) != 6)
+				return 0;
+			/* the whole picture sits in a virtual array, as BGR or gray,
+			   at the scaled size; top-down output holds a row of it */
+			rows = ((h[1] << 8 | h[2]) + scale - 1) / scale;
+			w = ((h[3] << 8 | h[4]) + scale - 1) / scale;
+			rowbytes = (w * (h[5] == 1 ? 1 : 3) + 3) / 4 * 4;
+			return rowbytes * (topdown ? 1 : rows);
+		}
+		if (len < 0 || fseek (fp, len, SEEK_CUR) != 0)
+			return 0;
+	}
+}
+
+static unsigned long long decoded_size (convert_type type, const char *fn,
+					const convert_batch_options *options)
+{
+	unsigned long long size = 0;
+	FILE *fp;
+
+	fp = fopen (fn, "rb");
+	if (!fp)
+		return 0;
+	switch (type) {
+	case CONVERT_BMP2PNG:
+		size = bmp_decoded_size (fp, options->stream);
+		break;
+	case CONVERT_PNG2BMP:
+		size = png_decoded_size (fp, options->stream);
+		break;
+	case CONVERT_JPG2BMP:
+		size = jpeg_decoded_size (fp, options->jpeg_scale, options->topdown);
+		break;
+	}
+	fclose (fp);
+	return size;
+}
+
+/* ------------------------------------------------------------------ */
+
+static void budget_acquire (convert_batch_data *b, unsigned long long need)
+{
+	unsigned long long max = b->options->max_inflight ? b->options->max_inflight : BATCH_MAX_INFLIGHT;
+
+	pthread_mutex_lock (&b->lock);
+	while (b->inflight > 0 && b->inflight + need > max)
+		pthread_cond_wait (&b->released, &b->lock);
+	b->inflight += need;
+	pthread_mutex_unlock (&b->lock);
+}
+
+static unsigned long long file_size (const char *fn)
+{
+	struct stat st;
+
+	return stat (fn, &st) == 0 ? (unsigned long long)st.st_size : 0;
+}
+
+static void convert_task (void *data, void *usr_data)
+{
+	convert_job *job = (convert_job *)data;
+	convert_batch_data *b = (convert_batch_data *)usr_data;
+	convert_result r;
+	CONVCTX ctx;
+	double t0;
+
+	r.in = job->in;
+	r.out = job->out;
+	if (job->refuse) {
+		r.status = job->refuse;
+		r.ms = 0;
+		r.in_bytes = file_size (job->in);
+		r.out_bytes = 0;
+		goto done;
+	}
+
+	job->need = decoded_size (b->type, job->in, b->options);
+	budget_acquire (b, job->need);
+
+	t0 = now_ms ();
+	convctx_init (&ctx);
+	ctx.quiet = 1;
+	ctx.stream = b->options->stream;
+	ctx.topdown = b->options->topdown;
+	if (b->options->complevel >= 0)
+		ctx.complevel = b->options->complevel;
+	switch (b->type) {
+	case CONVERT_BMP2PNG:
+		r.status = bmp2png_ctx (&ctx, job->in, job->out);
+		break;
+	case CONVERT_PNG2BMP:
+		r.status = png2bmp_ctx (&ctx, job->in, job->out);
+		break;
+	default:
+		r.status = jpg2bmp_scaled (job->in, job->out, b->options->jpeg_scale, b->options->topdown);
+		break;
+	}
+	r.ms = now_ms () - t0;
+	r.in_bytes = file_size (job->in);
+	r.out_bytes = r.status == 0 ? file_size (job->out) : 0;
+
+done:
+	pthread_mutex_lock (&b->lock);
+	b->inflight -= job->need;
+	pthread_cond_broadcast (&b->released);
+	if (r.status != 0)
+		b->stats->n_failed++;
+	b->stats->in_bytes += r.in_bytes;
+	b->stats->out_bytes += r.out_bytes;
+	pthread_mutex_unlock (&b->lock);
+
+	/* a slow callback must not hold up workers waiting on the budget */
+	if (b->options->progress) {
+		pthread_mutex_lock (&b->progress_lock);
+		b->options->progress (&r, b->options->usr_data);
+		pthread_mutex_unlock (&b->progress_lock);
+	}
+}
+
+int convert_batch (convert_type type, char **inputs, int n_inputs,
+		   const convert_batch_options *options, convert_batch_stats *stats)
+{
+	convert_batch_options defaults;
+	convert_batch_stats local;
+	convert_batch_data b;
+	convert_job *jobs = NULL;
+	void **data = NULL;
+	file_list list;
+	XssPool *pool = NULL;
+	double t0 = now_ms ();
+	int i, ret = -1;
+
+	if (!options) {
+		convert_batch_options_init (&defaults);
+		options = &defaults;
+	}
+	if (!stats)
+		stats = &local;
+	memset (stats, 0, sizeof(convert_batch_stats));
+	memset (&list, 0, sizeof(file_list));
+
+	if (expand_inputs (&list, type, inputs, n_inputs) < 0)
+		goto out;
+	if (list.n_files == 0) {
+		ret = 0;
+		goto out;
+	}
+
+	jobs = (convert_job *)calloc(list.n_files, sizeof(convert_job));
+	data = (void **)malloc(list.n_files * sizeof(void *));
+	if (!jobs || !data)
+		goto out;
+	for (i = 0; i < list.n_files; i++) {
+		jobs[i].in = list.files[i];
+		jobs[i].out = output_name (type, list.files[i], options->out_dir);
+		if (!jobs[i].out)
+			goto out;
+		data[i] = &jobs[i];
+	}
+	if (mark_clashes (jobs, list.n_files) < 0)
+		goto out;
+
+	if (options->n_threads != 1) {
+		pool = xss_pool_new (options->n_threads);
+		if (!pool)
+			goto out;
+	}
+
+	b.type = type;
+	b.options = options;
+	b.inflight = 0;
+	b.stats = stats;
+	pthread_mutex_init (&b.lock, NULL);
+	pthread_cond_init (&b.released, NULL);
+	pthread_mutex_init (&b.progress_lock, NULL);
+	xss_pool_run (pool, convert_task, data, list.n_files, &b);
+	pthread_mutex_destroy (&b.progress_lock);
+	pthread_cond_destroy (&b.released);
+	pthread_mutex_destroy (&b.lock);
+
+	stats->n_files = list.n_files;
+	ret = stats->n_failed;
+
+out:
+	stats->ms = now_ms () - t0;
+	xss_pool_free (pool);
+	if (jobs)
+		for (i = 0; i < list.n_files; i++)
+			free (jobs[i].out);
+	free (jobs);
+	free (data);
+	file_list_free (&list);
+	return ret;
+}
@@ -0,0 +1,169 @@
+/*
+  xssconv --- convert many images at once
+
+  xssconv [-j threads] [-m MB] [-o dir] [-l list] [-s] [-t] [-d n] [-0..-9] mode inputs...
+
+  mode is bmp2png, png2bmp or jpg2bmp. Inputs are files, directories or
+  glob patterns; -l reads more of them, one per line, from a file or
+  from stdin for "-". Prints a line per file and the totals.
+*/
+
+#include "transform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage (void)
+{
+	fprintf (stderr,
+		 "usage: xssconv [-j threads] [-m MB] [-o dir] [-l list|-] [-s] [-t] [-d 1|2|4|8] [-0..-9] {bmp2png|png2bmp|jpg2bmp} inputs...\n"
+		 "  -j  worker threads, default one per processor\n"
+		 "  -m  decoded megabytes in flight, default 512\n"
+		 "  -o  output directory, default next to each input\n"
+		 "  -l  read more inputs from a file, one per line, - for stdin\n"
+		 "  -s  stream bmp2png/png2bmp, a few rows in memory\n"
+		 "  -t  top-down BMPs from png2bmp/jpg2bmp, jpg2bmp then streams\n"
+		 "  -d  jpg2bmp decodes at 1/n of the size, for thumbnails\n"
+		 "  -0..-9  zlib level for bmp2png\n");
+	exit (2);
+}
+
+static double mb_per_s (unsigned long long bytes, double ms)
+{
+	return ms > 0 ? bytes / 1048576.0 / (ms / 1e3) : 0;
+}
+
+static void report (const convert_result *r, void *usr_data)
+{
+	(void)usr_data;
+	if (r->status == -2) {
+		printf ("FAIL %s: %s is written by an earlier file\n", r->in, r->out);
+		return;
+	}
+	if (r->status == -3) {
+		printf ("FAIL %s: would be written over\n", r->in);
+		return;
+	}
+	if (r->status != 0) {
+		printf ("FAIL %s\n", r->in);
+		return;
+	}
+	printf ("ok   %s -> %s  %.1f ms  %.1f MB/s\n", r->in, r->out, r->ms, mb_per_s (r->in_bytes, r->ms));
+}
+
+/* append each line of fn to *inputs */
+static int read_list (const char *fn, char ***inputs, int *n_inputs)
+{
+	char line[FILENAME_MAX], **grown;
+	size_t len;
+	FILE *fp;
+
+	fp = strcmp (fn, "-") ? fopen (fn, "r") : stdin;
+	if (!fp)
+		return -1;
+	while (fgets (line, sizeof(line), fp)) {
+		len = strcspn (line, "\r\n");
+		line[len] = '\0';
+		if (!len)
+			continue;
+		grown = (char **)realloc(*inputs, (*n_inputs + 1) * sizeof(char *));
+		if (!grown || !(grown[*n_inputs] = strdup (line))) {
+			if (grown)
+				*inputs = grown;
+			break;
+		}
+		*inputs = grown;
+		(*n_inputs)++;
+	}
+	if (fp != stdin)
+		fclose (fp);
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	convert_batch_options options;
+	convert_batch_stats stats;
+	convert_type type;
+	char **inputs = NULL, *mode;
+	const char *list = NULL;
+	int c, i, n_inputs = 0, ret;
+
+	convert_batch_options_init (&options);
+	while ((c = getopt (argc, argv, "j:m:o:l:std:0123456789")) != -1) {
+		switch (c) {
+		case 'j':
+			options.n_threads = atoi (optarg);
+			break;
+		case 'm':
+			options.max_inflight = strtoull (optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'o':
+			options.out_dir = optarg;
+			break;
+		case 'l':
+			list = optarg;
+			break;
+		case 's':
+			options.stream = 1;
+			break;
+		case 't':
+			options.topdown = 1;
+			break;
+		case 'd':
+			options.jpeg_scale = atoi (optarg);
+			if (options.jpeg_scale != 1 && options.jpeg_scale != 2 &&
+			    options.jpeg_scale != 4 && options.jpeg_scale != 8)
+				usage ();
+			break;
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9':
+			options.complevel = c - '0';
+			break;
+		default:
+			usage ();
+		}
+	}
+	if (optind >= argc)
+		usage ();
+
+	mode = argv[optind++];
+	if (!strcmp (mode, "bmp2png"))
+		type = CONVERT_BMP2PNG;
+	else if (!strcmp (mode, "png2bmp"))
+		type = CONVERT_PNG2BMP;
+	else if (!strcmp (mode, "jpg2bmp"))
+		type = CONVERT_JPG2BMP;
+	else
+		usage ();
+
+	inputs = (char **)malloc((argc - optind + 1) * sizeof(char *));
+	if (!inputs)
+		return 1;
+	for (i = optind; i < argc; i++)
+		inputs[n_inputs++] = strdup (argv[i]);
+	if (list && read_list (list, &inputs, &n_inputs) < 0) {
+		fprintf (stderr, "xssconv: cannot read %s\n", list);
+		return 1;
+	}
+	if (!n_inputs)
+		usage ();
+
+	options.progress = report;
+	ret = convert_batch (type, inputs, n_inputs, &options, &stats);
+	if (ret < 0) {
+		fprintf (stderr, "xssconv: cannot start the batch\n");
+		return 1;
+	}
+
+	printf ("%d files, %d failed, %.1f MB in, %.1f MB out, %.2f s, %.1f MB/s, %.1f images/s\n",
+		stats.n_files, stats.n_failed, stats.in_bytes / 1048576.0, stats.out_bytes / 1048576.0,
+		stats.ms / 1e3, mb_per_s (stats.in_bytes, stats.ms),
+		stats.ms > 0 ? stats.n_files / (stats.ms / 1e3) : 0);
+
+	for (i = 0; i < n_inputs; i++)
+		free (inputs[i]);
+	free (inputs);
+	return ret ? 1 : 0;
+}
@@ -12,20 +12,6 @@
 #define BMP2PNG_VERSION		"1.62 (Sep 4, 2005)"
 #define BMP2PNG_COPYRIGHT	"Copyright (C) 1999-2005 MIYASAKA Masaru"
 
-char outnam[FILENAME_MAX];
-char outdir[FILENAME_MAX];
-int  complevel = 6;
-int  interlace = 0;
-int  filters   = 0;
-int  alpha_bmp = 0;
-
-#define B2P_TRANSPARENT_NONE	0
-#define B2P_TRANSPARENT_RGB		1
-#define B2P_TRANSPARENT_PALETTE	2
-
-int trans_type = B2P_TRANSPARENT_NONE;
-png_color_16 trans_values;
-
 	/* error messages */
 
 const char wrn_invalidtrans[]   =
@@ -60,22 +46,29 @@ const char err_invalid_bpp[] = "SKIPPED: Invalid bit depth in BMP file - %s\n";
 const char err_no_palette[]  = "SKIPPED: Palette is missing - %s\n";
 
 
-static int transparent_color(png_color_16p, const char *);
+static int transparent_color(CONVCTX *, png_color_16p, const char *);
 static int png_filters(const char *);
-static BOOL read_bmp(char *, IMAGE *);
-static BOOL is_4th_alpha(IMAGE *);
+static BOOL is_4th_alpha(IMAGE *, BOOL);
+static LONG stream_rows(IMAGE *);
 static const char *read_rgb_bits(IMAGE *, FILE *);
 static const char *read_bitfield_bits(IMAGE *, FILE *, DWORD *, UINT);
 static const char *decompress_rle_bits(IMAGE *, FILE *);
 static unsigned long mgetdwl(void *);
 static unsigned int mgetwl(void *);
-static BOOL write_png(char *, IMAGE *);
 
 int bmp2png(char *in, char *out)
+{
+	CONVCTX ctx;
+
+	convctx_init(&ctx);
+	return bmp2png_ctx(&ctx, in, out);
+}
+
+int bmp2png_ctx(CONVCTX *ctx, char *in, char *out)
 {
 	IMAGE image;
-	if (!read_bmp(in, &image)) return -1;
-	if (!write_png(out, &image)) return -1;
+	if (!read_bmp(ctx, in, &image)) return -1;
+	if (!write_png(ctx, out, &image)) return -1;
 	return 0;
 }
 
@@ -113,7 +106,7 @@ static int png_filters(const char *arg)
 }
 
 
-static int transparent_color(png_color_16p trans_values, const char *arg)
+static int transparent_color(CONVCTX *ctx, png_color_16p trans_values, const char *arg)
 {
 	char c, buf[32];
 	int i, n;
@@ -146,7 +139,7 @@ static int transparent_color(png_color_16p trans_values, const char *arg)
 		}
 	}
 
-	xxprintf(wrn_invalidtrans, arg);
+	xxprintf(ctx, wrn_invalidtrans, arg);
 
 	return B2P_TRANSPARENT_NONE;
 }
@@ -154,7 +147,7 @@ static int transparent_color(png_color_16p trans_values, const char *arg)
 
 #define ERROR_ABORT(s) do { errmsg = (s); goto error_abort; } while (0)
 
-static BOOL read_bmp(char *fn, IMAGE *img)
+BOOL read_bmp(CONVCTX *ctx, char *fn, IMAGE *img)
 {
 	BYTE bfh[FILEHED_SIZE + BMPV5HED_SIZE];
 	BYTE *const bih = bfh + FILEHED_SIZE;
@@ -178,7 +171,7 @@ static BOOL read_bmp(char *fn, IMAGE *img)
 	}
 	if (fp == NULL) ERROR_ABORT(err_ropenfail);
 
-	set_status("Reading %.80s", basname(fn));
+	set_status(ctx, "Reading %.80s", basname(fn));
 
 	/* ------------------------------------------------------ */
 
@@ -200,8 +193,8 @@ static BOOL read_bmp(char *fn, IMAGE *img)
 		ERROR_ABORT(ferror(fp) ? err_readerr : err_readeof);
 
 	if (bihsize >= INFOHED_SIZE) {		/* Windows-style BMP */
-		img->width    = mgetdwl(bih + BIH_LWIDTH);
-		img->height   = mgetdwl(bih + BIH_LHEIGHT);
+		img->width    = (INT)mgetdwl(bih + BIH_LWIDTH);	/* signed 32bit */
+		img->height   = (INT)mgetdwl(bih + BIH_LHEIGHT);
 		img->pixdepth = mgetwl(bih + BIH_WBITCOUNT);
 		img->topdown  = FALSE;
 		compression   = mgetdwl(bih + BIH_DCOMPRESSION);
@@ -232,7 +225,7 @@ static BOOL read_bmp(char *fn, IMAGE *img)
 		    img->pixdepth != 24 && img->pixdepth != 32)
 			ERROR_ABORT(err_invalid_bpp);
 
-		if (img->pixdepth == 32 && alpha_bmp)
+		if (img->pixdepth == 32 && ctx->alpha_bmp)
 			alpha_check = TRUE;
 
 		if (img->pixdepth == 16) {
@@ -260,7 +253,7 @@ static BOOL read_bmp(char *fn, IMAGE *img)
 		color_mask[1] = mgetdwl(bih + B4H_DGREENMASK);		/* green */
 		color_mask[0] = mgetdwl(bih + B4H_DBLUEMASK);		/* blue */
 
-		if (img->pixdepth == 32 && alpha_bmp &&
+		if (img->pixdepth == 32 && ctx->alpha_bmp &&
 		    bihsize >= INFOHED_SIZE + 16) {
 			color_mask[3] = mgetdwl(bih + B4H_DALPHAMASK);	/* alpha */
 			if (color_mask[3] != 0x00000000)
@@ -303,7 +296,7 @@ static BOOL read_bmp(char *fn, IMAGE *img)
 	} else {
 		img->palnum = 0;
 	}
-	if (!imgbuf_alloc(img)) ERROR_ABORT(err_outofmemory);
+	if (!imgbuf_alloc_palette(img)) ERROR_ABORT(err_outofmemory);
 
 	/* ------------------------------------------------------ */
 
@@ -314,11 +307,18 @@ static BOOL read_bmp(char *fn, IMAGE *img)
 		pal->green = rgbq[RGBQ_GREEN];
 		pal->blue  = rgbq[RGBQ_BLUE];
 	}
-	for ( ; skip > 0; skip--) {
+	if (skip > 0 && fseek(fp, skip, SEEK_CUR) == 0)
+		skip = 0;
+	for ( ; skip > 0; skip--) {		/* pipe */
 		if (fgetc(fp) == EOF)
 			ERROR_ABORT(ferror(fp) ? err_readerr : err_readeof);
 	}
 
+	/* uncompressed bits need no copy, map them when fp is a file */
+	if (compression != BI_RGB || !imgbuf_map(img, fp)) {
+		if (!imgbuf_alloc_bits(img)) ERROR_ABORT(err_outofmemory);
+	}
+
 	/* ------------------------------------------------------ */
 
 	img->sigbit.red  = img->sigbit.green = img->sigbit.blue = 8;
@@ -326,7 +326,7 @@ static BOOL read_bmp(char *fn, IMAGE *img)
 
 	switch (compression) {
 	case BI_RGB:
-		errmsg = read_rgb_bits(img, fp);
+		errmsg = (img->mapbase == NULL) ? read_rgb_bits(img, fp) : NULL;
 		break;
 	case BI_BITFIELDS:
 		errmsg = read_bitfield_bits(img, fp, color_mask, true_pixdepth);
@@ -341,21 +341,21 @@ static BOOL read_bmp(char *fn, IMAGE *img)
 	if (errmsg != NULL) ERROR_ABORT(errmsg);
 
 	if (alpha_check) {
-		img->alpha = is_4th_alpha(img);
+		img->alpha = is_4th_alpha(img, ctx->stream);
 		if (!img->alpha)
-			xxprintf(wrn_alphaallzero, fn);
+			xxprintf(ctx, wrn_alphaallzero, fn);
 	}
 
 	/* ------------------------------------------------------ */
 
-	set_status("Read OK %.80s", basname(fn));
+	set_status(ctx, "Read OK %.80s", basname(fn));
 
 	if (fp != stdin) fclose(fp);
 
 	return TRUE;
 
 error_abort:				/* error */
-	xxprintf(errmsg, fn);
+	xxprintf(ctx, errmsg, fn);
 	if (fp != stdin && fp != NULL) fclose(fp);
 	imgbuf_free(img);
 
@@ -363,21 +363,38 @@ error_abort:				/* error */
 }
 
 
-static BOOL is_4th_alpha(IMAGE *img)
+static BOOL is_4th_alpha(IMAGE *img, BOOL stream)
 {
-	LONG w, h;
+	LONG w, y, y0;
 	BYTE *p;
 
 	if (img->pixdepth == 32) {		/* failsafe */
-		for (h = img->height, p = img->bmpbits + 3; --h >= 0; )
-			for (w = img->width; --w >= 0; p += 4)
+		for (y = y0 = 0; y < img->height; y++) {
+			for (w = img->width, p = img->rowptr[y] + 3; --w >= 0; p += 4)
 				if (*p != 0) return TRUE;
+			if (stream && y + 1 - y0 >= stream_rows(img)) {
+				imgbuf_release(img, y0, y + 1);
+				y0 = y + 1;
+			}
+		}
+		if (stream) imgbuf_release(img, y0, y);
 	}
 
 	return FALSE;
 }
 
 
+/*
+**		rows a streaming conversion handles at a time
+*/
+static LONG stream_rows(IMAGE *img)
+{
+	LONG n = STREAM_BLOCK / img->rowbytes;
+
+	return (n > 0) ? n : 1;
+}
+
+
 static const char *read_rgb_bits(IMAGE *img, FILE *fp)
 {
 #if 1
@@ -604,7 +621,7 @@ static unsigned int mgetwl(void *ptr)
 	return ((unsigned int)p[0]) + ((unsigned int)p[1] << 8);
 }
 
-BOOL write_png(char *fn, IMAGE *img)
+BOOL write_png(CONVCTX *ctx, char *fn, IMAGE *img)
 {
 	png_structp png_ptr;
 	png_infop info_ptr;
@@ -613,6 +630,8 @@ BOOL write_png(char *fn, IMAGE *img)
 	int interlace_type;
 	png_byte trans[256];
 	unsigned i;
+	int passes, pass;
+	LONG y, y0;
 	const char *errmsg;
 	FILE *fp;
 
@@ -624,11 +643,12 @@ BOOL write_png(char *fn, IMAGE *img)
 	}
 	if (fp == NULL) ERROR_ABORT(err_wopenfail);
 
-	set_status("Writing %.80s", basname(fn));
+	set_status(ctx, "Writing %.80s", basname(fn));
 
 	/* ------------------------------------------------------ */
 
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, fn,
+	ctx->fn = fn;
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, ctx,
 	                                    png_my_error, png_my_warning);
 	if (png_ptr == NULL) {
 		ERROR_ABORT(err_outofmemory);
@@ -644,9 +664,9 @@ BOOL write_png(char *fn, IMAGE *img)
 		ERROR_ABORT(NULL);
 	}
 	png_init_io(png_ptr, fp);
-	png_set_compression_level(png_ptr, complevel);
-	if (filters != 0)
-		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, filters);
+	png_set_compression_level(png_ptr, ctx->complevel);
+	if (ctx->filters != 0)
+		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, ctx->filters);
 
 	/* ------------------------------------------------------ */
 
@@ -660,7 +680,7 @@ BOOL write_png(char *fn, IMAGE *img)
 		color_type = PNG_COLOR_TYPE_PALETTE;
 		png_set_PLTE(png_ptr, info_ptr, img->palette, img->palnum);
 	}
-	interlace_type = (interlace) ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE;
+	interlace_type = (ctx->interlace) ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE;
 
 	png_set_IHDR(png_ptr, info_ptr, img->width, img->height, bit_depth,
 	             color_type, interlace_type, PNG_COMPRESSION_TYPE_DEFAULT,
@@ -670,14 +690,14 @@ BOOL write_png(char *fn, IMAGE *img)
 	    || (color_type == PNG_COLOR_TYPE_RGB_ALPHA && img->sigbit.alpha != 8))
 		png_set_sBIT(png_ptr, info_ptr, &img->sigbit);
 
-	switch (trans_type) {
+	switch (ctx->trans_type) {
 	case B2P_TRANSPARENT_RGB:
 		switch (color_type) {
 		case PNG_COLOR_TYPE_PALETTE:
 			for (i = 0; i < img->palnum; i++) {
-				if (img->palette[i].red   == trans_values.red   &&
-				    img->palette[i].green == trans_values.green &&
-				    img->palette[i].blue  == trans_values.blue) {
+				if (img->palette[i].red   == ctx->trans_values.red   &&
+				    img->palette[i].green == ctx->trans_values.green &&
+				    img->palette[i].blue  == ctx->trans_values.blue) {
 					trans[i++] = 0x00;
 					break;
 				}
@@ -686,33 +706,33 @@ BOOL write_png(char *fn, IMAGE *img)
 			if (trans[i-1] == 0x00) {
 				png_set_tRNS(png_ptr, info_ptr, trans, i, NULL);
 			} else {
-				xxprintf(wrn_notranscolor, fn);
+				xxprintf(ctx, wrn_notranscolor, fn);
 			}
 			break;
 		case PNG_COLOR_TYPE_RGB:
-			png_set_tRNS(png_ptr, info_ptr, NULL, 0, &trans_values);
+			png_set_tRNS(png_ptr, info_ptr, NULL, 0, &ctx->trans_values);
 			break;
 		case PNG_COLOR_TYPE_RGB_ALPHA:
-			xxprintf(wrn_imagehasalpha, fn);
+			xxprintf(ctx, wrn_imagehasalpha, fn);
 			break;
 		}
 		break;
 	case B2P_TRANSPARENT_PALETTE:
 		switch (color_type) {
 		case PNG_COLOR_TYPE_PALETTE:
-			if (trans_values.index < img->palnum) {
-				for (i = 0; i < trans_values.index; i++) trans[i] = 0xFF;
+			if (ctx->trans_values.index < img->palnum) {
+				for (i = 0; i < ctx->trans_values.index; i++) trans[i] = 0xFF;
 				trans[i++] = 0x00;
 				png_set_tRNS(png_ptr, info_ptr, trans, i, NULL);
 			} else {
-				xxprintf(wrn_notranscolor, fn);
+				xxprintf(ctx, wrn_notranscolor, fn);
 			}
 			break;
 		case PNG_COLOR_TYPE_RGB:
-			xxprintf(wrn_transtruecolor, fn);
+			xxprintf(ctx, wrn_transtruecolor, fn);
 			break;
 		case PNG_COLOR_TYPE_RGB_ALPHA:
-			xxprintf(wrn_imagehasalpha, fn);
+			xxprintf(ctx, wrn_imagehasalpha, fn);
 			break;
 		}
 		break;
@@ -731,17 +751,32 @@ BOOL write_png(char *fn, IMAGE *img)
 	/* ------------------------------------------------------ */
 
 	png_set_write_status_fn(png_ptr, row_callback);
-	init_progress_meter(png_ptr, img->width, img->height);
-
-	png_write_image(png_ptr, img->rowptr);
+	init_progress_meter(ctx, png_ptr, img->width, img->height);
+
+	if (ctx->stream) {
+		/* rows already written leave memory, once per pass */
+		passes = png_set_interlace_handling(png_ptr);
+		for (pass = 0; pass < passes; pass++) {
+			for (y = y0 = 0; y < img->height; y++) {
+				png_write_row(png_ptr, img->rowptr[y]);
+				if (y + 1 - y0 >= stream_rows(img)) {
+					imgbuf_release(img, y0, y + 1);
+					y0 = y + 1;
+				}
+			}
+			imgbuf_release(img, y0, y);
+		}
+	} else {
+		png_write_image(png_ptr, img->rowptr);
+	}
 
 	png_write_end(png_ptr, info_ptr);
 	png_destroy_write_struct(&png_ptr, &info_ptr);
 
 	/* ------------------------------------------------------ */
 
-	set_status("OK      %.80s", basname(fn));
-	feed_line();
+	set_status(ctx, "OK      %.80s", basname(fn));
+	feed_line(ctx);
 
 	fflush(fp);
 	if (fp != stdout) fclose(fp);
@@ -750,19 +785,10 @@ BOOL write_png(char *fn, IMAGE *img)
 	return TRUE;
 
 error_abort:				/* error */
-	if (errmsg != NULL) xxprintf(errmsg, fn);
+	if (errmsg != NULL) xxprintf(ctx, errmsg, fn);
 	if (fp != stdout && fp != NULL) fclose(fp);
 	imgbuf_free(img);
 
 	return FALSE;
 }
 
-#if (PNG_LIBPNG_VER >= 10007)
-/*
- * **	dummy - see png_reset_zstream() in png.c
- * */
-int inflateReset(z_streamp z)
-{
-	return Z_OK;
-}
-#endif
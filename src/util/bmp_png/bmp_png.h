@@ -13,6 +13,26 @@ int bmp2png(char *in, char *out);
 
 int png2bmp(char *in, char *out);
 
+/*
+  The same with the options and progress state in ctx, set up by
+  convctx_init(); conversions with separate contexts can run at once.
+  The halves are there for callers that keep the IMAGE in between;
+  write_png() and write_bmp() free it.
+
+  With ctx->stream set, only a block of rows (STREAM_BLOCK bytes) is in
+  memory at a time: bmp2png writes from a mapping of the BMP and drops
+  the rows behind it, png2bmp decodes a block of rows and writes it in
+  place. BMPs that cannot be mapped and interlaced PNGs are still held
+  whole.
+*/
+int bmp2png_ctx(CONVCTX *ctx, char *in, char *out);
+int png2bmp_ctx(CONVCTX *ctx, char *in, char *out);
+
+BOOL read_bmp(CONVCTX *ctx, char *fn, IMAGE *img);
+BOOL write_png(CONVCTX *ctx, char *fn, IMAGE *img);
+BOOL read_png(CONVCTX *ctx, char *fn, IMAGE *img);
+BOOL write_bmp(CONVCTX *ctx, char *fn, IMAGE *img);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -41,111 +41,121 @@ char errlogfile[] = "./p2berror.log";
 #define STATUS_LEN	22
 #define PROGBAR_MAX	(LINE_LEN - STATUS_LEN - 1)
 
-static char status_msg[128];
-static int  progbar_scale = 0;
-static int  progbar_len   = 0;
-static int  progbar_pos   = -1;
-
 int quietmode = 0;		/* -Q option */
 int errorlog  = 0;		/* -L option */
 
 
-static void print_status(void)
+/*
+**		initialize a conversion context with the default options
+*/
+void convctx_init(CONVCTX *ctx)
+{
+	memset(ctx, 0, sizeof(CONVCTX));
+	ctx->complevel    = 6;
+	ctx->trans_type   = B2P_TRANSPARENT_NONE;
+	ctx->alpha_format = P2B_ALPHABMP_NONE;
+	ctx->quiet        = quietmode;
+	ctx->progbar_pos  = -1;
+}
+
+static void print_status(CONVCTX *ctx)
 {
-	fprintf(stderr, "\r%-*.*s ", STATUS_LEN, STATUS_LEN, status_msg);
+	fprintf(stderr, "\r%-*.*s ", STATUS_LEN, STATUS_LEN, ctx->status_msg);
 	fflush(stderr);
-	progbar_pos = 0;
+	ctx->progbar_pos = 0;
 }
 
-static void put_dots(int dotchar, int num)
+static void put_dots(CONVCTX *ctx, int dotchar, int num)
 {
 	int i;
 
 	if (num > PROGBAR_MAX) num = PROGBAR_MAX;
-	if (progbar_pos == -1) print_status();
+	if (ctx->progbar_pos == -1) print_status(ctx);
 
-	for (i = progbar_pos; i < num; i++)
+	for (i = ctx->progbar_pos; i < num; i++)
 		fputc(dotchar, stderr);
 
-	if (progbar_pos < num) {
-		progbar_pos = num;
+	if (ctx->progbar_pos < num) {
+		ctx->progbar_pos = num;
 		fflush(stderr);
 	}
 }
 
-static void print_scale(void)
+static void print_scale(CONVCTX *ctx)
 {
-	if (progbar_pos != 0) print_status();
-	put_dots('.', progbar_len);
-	print_status();
-	progbar_scale = 1;
+	if (ctx->progbar_pos != 0) print_status(ctx);
+	put_dots(ctx, '.', ctx->progbar_len);
+	print_status(ctx);
+	ctx->progbar_scale = 1;
 }
 
-static void init_progress_bar(int max)
+static void init_progress_bar(CONVCTX *ctx, int max)
 {
-	if (quietmode) return;
+	if (ctx->quiet) return;
 
-	progbar_len = max;
-	print_scale();
+	ctx->progbar_len = max;
+	print_scale(ctx);
 }
 
-static void update_progress_bar(int num)
+static void update_progress_bar(CONVCTX *ctx, int num)
 {
-	if (quietmode) return;
+	if (ctx->quiet) return;
 
-	if (!progbar_scale) print_scale();
-	put_dots('o', num);
+	if (!ctx->progbar_scale) print_scale(ctx);
+	put_dots(ctx, 'o', num);
 }
 
-static void clear_line(void)
+static void clear_line(CONVCTX *ctx)
 {
-	if (quietmode) return;
+	if (ctx->quiet) return;
 
 	fprintf(stderr, "\r%*c\r", LINE_LEN, ' ');
-	progbar_scale = 0;
-	progbar_pos   = -1;
+	ctx->progbar_scale = 0;
+	ctx->progbar_pos   = -1;
 }
 
-void xxprintf(const char *fmt, ...)
+void xxprintf(CONVCTX *ctx, const char *fmt, ...)
 {
-	va_list ap;
+	va_list ap, aq;
 	FILE *f;
 
 	va_start(ap, fmt);
+	va_copy(aq, ap);
 
-	clear_line();
+	clear_line(ctx);
 	vfprintf(stderr, fmt, ap);
 	fflush(stderr);
 
 	if (errorlog && (f = fopen(errlogfile, "a")) != NULL) {
-		vfprintf(f, fmt, ap);
+		vfprintf(f, fmt, aq);
 		fclose(f);
 	}
 
+	va_end(aq);
 	va_end(ap);
 }
 
-void set_status(const char *fmt, ...)
+void set_status(CONVCTX *ctx, const char *fmt, ...)
 {
 	va_list ap;
 
-	if (quietmode) return;
+	if (ctx->quiet) return;
 
 	va_start(ap, fmt);
-	vsprintf(status_msg, fmt, ap);
+	vsnprintf(ctx->status_msg, sizeof(ctx->status_msg), fmt, ap);
 	va_end(ap);
 
-	print_status();
+	print_status(ctx);
 }
 
-void feed_line(void)
+void feed_line(CONVCTX *ctx)
 {
-	if (quietmode) return;
+	if (ctx->quiet) return;
 
 	fputc('\n', stderr);
 	fflush(stderr);
-	progbar_scale = 0;
-	progbar_pos   = -1;
+	ctx->progbar_scale = 0;
+	ctx->progbar_pos   = -1;
 }
 
 
@@ -189,11 +199,6 @@ void feed_line(void)
  * -------------------------------------------------------------
  */
 
-static png_uint_32 counter;
-static png_uint_32 maxcount;
-static int         barlen;
-
-
 static png_uint_32
  maxcount_adam7(png_uint_32 width, png_uint_32 height)
 {
@@ -214,32 +219,34 @@ static png_uint_32
 /*
 **		initialize the progress meter
 */
-void init_progress_meter(png_structp png_ptr, png_uint_32 width,
-                         png_uint_32 height)
+void init_progress_meter(CONVCTX *ctx, png_structp png_ptr,
+                         png_uint_32 width, png_uint_32 height)
 {
 	enum { W = 1024, H = 768 };
 
 	if (png_set_interlace_handling(png_ptr) == 7) {
-		maxcount = maxcount_adam7(width, height);	/* interlaced image */
+		ctx->maxcount = maxcount_adam7(width, height);	/* interlaced image */
 	} else {
-		maxcount = height;							/* non-interlaced image */
+		ctx->maxcount = height;							/* non-interlaced image */
 	}
 	if (height > ((png_uint_32)W * H) / width) {
-		barlen = PROGBAR_MAX;
+		ctx->barlen = PROGBAR_MAX;
 	} else {
-		barlen = (PROGBAR_MAX * width * height + (W * H - 1)) / (W * H);
+		ctx->barlen = (PROGBAR_MAX * width * height + (W * H - 1)) / (W * H);
 	}
-	counter = 0;
-	init_progress_bar(barlen);
+	ctx->counter = 0;
+	init_progress_bar(ctx, ctx->barlen);
 }
 
 
 /*
 **		row callback function for progress meter
+**		(the context is the error pointer of png_ptr)
 */
 void row_callback(png_structp png_ptr, png_uint_32 row, int pass)
 {
 /*	static const png_byte step[] = { 1, 1, 2, 2, 4, 4, 8 }; */
+	CONVCTX *ctx = (CONVCTX *)png_get_error_ptr(png_ptr);
 
 	if (row == 0) pass--;
 	/*
@@ -249,8 +256,8 @@ void row_callback(png_structp png_ptr, png_uint_32 row, int pass)
 	 *	  be equal to current_pass.
 	 */
 
-	counter += (1 << (pass >> 1));	/* step[pass]; */
-	update_progress_bar(barlen * counter / maxcount);
+	ctx->counter += (1 << (pass >> 1));	/* step[pass]; */
+	update_progress_bar(ctx, ctx->barlen * ctx->counter / ctx->maxcount);
 }
 
 
@@ -263,8 +270,9 @@ void row_callback(png_structp png_ptr, png_uint_32 row, int pass)
 */
 void png_my_error(png_structp png_ptr, png_const_charp message)
 {
-	xxprintf("ERROR(libpng): %s - %s\n", message,
-	             (char *)png_get_error_ptr(png_ptr));
+	CONVCTX *ctx = (CONVCTX *)png_get_error_ptr(png_ptr);
+
+	xxprintf(ctx, "ERROR(libpng): %s - %s\n", message, ctx->fn);
 	longjmp(png_jmpbuf(png_ptr), 1);
 }
 
@@ -274,8 +282,9 @@ void png_my_error(png_structp png_ptr, png_const_charp message)
 */
 void png_my_warning(png_structp png_ptr, png_const_charp message)
 {
-	xxprintf("WARNING(libpng): %s - %s\n", message,
-	             (char *)png_get_error_ptr(png_ptr));
+	CONVCTX *ctx = (CONVCTX *)png_get_error_ptr(png_ptr);
+
+	xxprintf(ctx, "WARNING(libpng): %s - %s\n", message, ctx->fn);
 }
 
 
@@ -288,23 +297,37 @@ void png_my_warning(png_structp png_ptr, png_const_charp message)
 */
 BOOL imgbuf_alloc(IMAGE *img)
 {
-	BYTE *bp, **rp;
-	LONG n;
+	if (!imgbuf_alloc_palette(img)) {
+		imgbuf_init(img); return FALSE;
+	}
+	if (!imgbuf_alloc_bits(img)) {
+		imgbuf_free(img); imgbuf_init(img); return FALSE;
+	}
+
+	return TRUE;
+}
 
+
+/*
+**		the two halves of imgbuf_alloc(), so that read_bmp() can map
+**		the bits with imgbuf_map() instead
+*/
+BOOL imgbuf_alloc_palette(IMAGE *img)
+{
 	if (img->palnum > 0) {
 		img->palette = malloc((size_t)img->palnum * sizeof(PALETTE));
-		if (img->palette == NULL) { imgbuf_init(img); return FALSE; }
+		if (img->palette == NULL) return FALSE;
 	} else {
 		img->palette = NULL;
 	}
-	img->rowbytes = ((DWORD)img->width * img->pixdepth + 31) / 32 * 4;
-	img->imgbytes = img->rowbytes * img->height;
-	img->rowptr   = malloc((size_t)img->height * sizeof(BYTE *));
-	img->bmpbits  = malloc((size_t)img->imgbytes);
 
-	if (img->rowptr == NULL || img->bmpbits == NULL) {
-		imgbuf_free(img); imgbuf_init(img); return FALSE;
-	}
+	return TRUE;
+}
+
+static void imgbuf_set_rows(IMAGE *img, BOOL zero_padding)
+{
+	BYTE *bp, **rp;
+	LONG n;
 
 	n  = img->height;
 	rp = img->rowptr;
@@ -320,23 +343,133 @@ BOOL imgbuf_alloc(IMAGE *img)
 		bp += img->imgbytes;
 		while (--n >= 0) {
 			/* fill zeros to padding bytes (for write_bmp()) */
-			((DWORD *)bp)[-1] = 0;
+			if (zero_padding)
+				((png_uint_32 *)bp)[-1] = 0;	/* DWORD is 8 bytes on LP64 */
 			bp -= img->rowbytes;
 			*(rp++) = bp;
 		}
 	}
+}
+
+/*
+**		rowbytes and imgbytes from width, height and pixdepth
+*/
+void imgbuf_size(IMAGE *img)
+{
+	img->rowbytes = ((DWORD)img->width * img->pixdepth + 31) / 32 * 4;
+	img->imgbytes = img->rowbytes * img->height;
+}
+
+BOOL imgbuf_alloc_bits(IMAGE *img)
+{
+	imgbuf_size(img);
+	img->rowptr   = malloc((size_t)img->height * sizeof(BYTE *));
+	img->bmpbits  = malloc((size_t)img->imgbytes);
+	img->mapbase  = NULL;
+
+	if (img->rowptr == NULL || img->bmpbits == NULL) {
+		free(img->rowptr);  img->rowptr  = NULL;
+		free(img->bmpbits); img->bmpbits = NULL;
+		return FALSE;
+	}
+	imgbuf_set_rows(img, TRUE);
 
 	return TRUE;
 }
 
 
 /*
-**		free image buffer allocated by imgbuf_alloc()
+**		point the rows into a private mapping of the file instead of
+**		reading them, for uncompressed bits laid out as IMAGE keeps them;
+**		the bits start at the current position of fp. FALSE for pipes
+**		and short files, the bits must be read then. The padding bytes
+**		are left as they are in the file.
+*/
+BOOL imgbuf_map(IMAGE *img, FILE *fp)
+{
+#ifdef USE_MMAP
+	struct stat st;
+	off_t pos, start;
+	BYTE *base;
+	size_t len;
+
+	imgbuf_size(img);
+
+	pos = ftello(fp);
+	if (pos < 0 || fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size - pos < (off_t)img->imgbytes) return FALSE;
+
+	start = pos - pos % sysconf(_SC_PAGESIZE);
+	len   = (size_t)(pos - start) + img->imgbytes;
+	/* writable copy-on-write pages: callers may change the pixels */
+	base  = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	             fileno(fp), start);
+	if (base == MAP_FAILED) return FALSE;
+#ifdef MADV_SEQUENTIAL
+	madvise(base, len, MADV_SEQUENTIAL);
+#endif
+
+	img->rowptr = malloc((size_t)img->height * sizeof(BYTE *));
+	if (img->rowptr == NULL) {
+		munmap(base, len);
+		return FALSE;
+	}
+	img->mapbase = base;
+	img->maplen  = len;
+	img->bmpbits = base + (pos - start);
+	imgbuf_set_rows(img, FALSE);
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+
+/*
+**		drop rows y0 .. y1-1 of a mapped image from memory, for streaming
+**		conversions that go through rowptr in order; rows before y0 must
+**		be done with too. They are read from the file again if touched.
+*/
+void imgbuf_release(IMAGE *img, LONG y0, LONG y1)
+{
+#if defined(USE_MMAP) && defined(MADV_DONTNEED)
+	size_t page, lo, hi;
+
+	if (img->mapbase == NULL || y0 >= y1) return;
+
+	page = sysconf(_SC_PAGESIZE);
+	/* the page shared with row y1 stays, the one shared with y0-1 goes */
+	if (img->rowptr[y0] <= img->rowptr[y1 - 1]) {	/* top-down */
+		lo = (size_t)(img->rowptr[y0] - img->mapbase) / page * page;
+		hi = (size_t)(img->rowptr[y1 - 1] + img->rowbytes - img->mapbase);
+		hi = (y1 < img->height) ? hi / page * page : img->maplen;
+	} else {										/* bottom-up */
+		hi = (size_t)(img->rowptr[y0] + img->rowbytes - img->mapbase);
+		hi = (hi + page - 1) / page * page;
+		lo = (size_t)(img->rowptr[y1 - 1] - img->mapbase);
+		lo = (y1 < img->height) ? (lo + page - 1) / page * page : 0;
+	}
+	if (hi > img->maplen) hi = img->maplen;
+	if (lo < hi)
+		madvise(img->mapbase + lo, hi - lo, MADV_DONTNEED);
+#endif
+}
+
+
+/*
+**		free image buffer allocated by imgbuf_alloc() or imgbuf_map()
 */
 void imgbuf_free(IMAGE *img)
 {
 	free(img->palette);
 	free(img->rowptr);
+#ifdef USE_MMAP
+	if (img->mapbase != NULL) {
+		munmap(img->mapbase, img->maplen);
+		return;
+	}
+#endif
 	free(img->bmpbits);
 }
 
@@ -349,6 +482,7 @@ void imgbuf_init(IMAGE *img)
 	img->palette = NULL;
 	img->rowptr  = NULL;
 	img->bmpbits = NULL;
+	img->mapbase = NULL;
 }
 
 
@@ -62,6 +62,13 @@
 #  include <sys/stat.h>
 # endif
 # define MKDIR(d,m) mkdir(d,m)
+#endif
+
+	/* for mmap() */
+#if !defined(_MSC_VER) && !defined(__BORLANDC__) && !defined(__MINGW32__) && \
+    !defined(__LCC__) && !defined(__DJGPP__) && !defined(__GO32__)
+# include <sys/mman.h>
+# define USE_MMAP
 #endif
 
 #if !defined(BINSTDIO_FDOPEN) && !defined(BINSTDIO_SETMODE)
@@ -106,7 +113,7 @@
 #define png_get_io_ptr(png_ptr) ((png_ptr)->io_ptr)
 #endif
 
-#if PNG_LIBPNG_VER == 10510
+#if PNG_LIBPNG_VER >= 10510
 #include <zlib.h>
 #endif
 
@@ -167,22 +174,73 @@ typedef struct tagIMAGE {
 	PALETTE *palette;
 	BYTE    **rowptr;
 	BYTE    *bmpbits;
+	BYTE    *mapbase;		/* mapping bmpbits points into, or NULL */
+	size_t  maplen;
 	/* ----------- */
 	png_color_8 sigbit;
 } IMAGE;
 
+#define B2P_TRANSPARENT_NONE	0
+#define B2P_TRANSPARENT_RGB		1
+#define B2P_TRANSPARENT_PALETTE	2
+
+#define P2B_ALPHABMP_NONE		0
+#define P2B_ALPHABMP_ARGB		1	/* -a option; 32bit ARGB(RGB) BMP */
+#define P2B_ALPHABMP_BITFIELD	2	/* -b option; 32bit Bitfield BMP  */
+
+#define STREAM_BLOCK			(1024*1024)	/* bytes of rows CONVCTX.stream holds */
+
+/*
+**  Everything one conversion reads or changes, so that conversions
+**  can run side by side. Set up with convctx_init(), then adjust the
+**  options; a context serves one conversion at a time.
+*/
+typedef struct tagCONVCTX {
+	/* bmp2png options */
+	int     complevel;
+	int     interlace;
+	int     filters;		/* PNG_FILTER_* bits, 0 for libpng's choice */
+	int     alpha_bmp;		/* keep the 4th channel of 32bit BMPs */
+	int     trans_type;		/* B2P_TRANSPARENT_* */
+	png_color_16 trans_values;
+	/* png2bmp options */
+	int     alpha_format;	/* P2B_ALPHABMP_* */
+	int     expand_trans;	/* tRNS to alpha, with alpha_format */
+	int     topdown;		/* write top-down BMPs (negative height) */
+	/* -- */
+	int     quiet;			/* no status line or progress bar */
+	int     stream;			/* hold a few rows, not the whole image */
+	/* ----------- */
+	const char *fn;			/* file being read or written, for messages */
+	char    outnam[FILENAME_MAX];
+	/* progress meter */
+	png_uint_32 counter;
+	png_uint_32 maxcount;
+	int     barlen;
+	char    status_msg[128];
+	int     progbar_scale;
+	int     progbar_len;
+	int     progbar_pos;
+} CONVCTX;
+
 extern int quietmode;
 extern int errorlog;
 extern char errlogfile[];
 
-void xxprintf(const char *, ...);
-void set_status(const char *, ...);
-void feed_line(void);
-void init_progress_meter(png_structp, png_uint_32, png_uint_32);
+void convctx_init(CONVCTX *);
+void xxprintf(CONVCTX *, const char *, ...);
+void set_status(CONVCTX *, const char *, ...);
+void feed_line(CONVCTX *);
+void init_progress_meter(CONVCTX *, png_structp, png_uint_32, png_uint_32);
 void row_callback(png_structp, png_uint_32, int);
 void png_my_error(png_structp, png_const_charp);
 void png_my_warning(png_structp, png_const_charp);
 BOOL imgbuf_alloc(IMAGE *);
+BOOL imgbuf_alloc_palette(IMAGE *);
+BOOL imgbuf_alloc_bits(IMAGE *);
+BOOL imgbuf_map(IMAGE *, FILE *);
+void imgbuf_size(IMAGE *);
+void imgbuf_release(IMAGE *, LONG, LONG);
 void imgbuf_free(IMAGE *);
 void imgbuf_init(IMAGE *);
 int parsearg(int *, char **, int, char **, char *);
@@ -14,16 +14,6 @@
 #define PNG2BMP_VERSION		"1.62 (Sep 4, 2005)"
 #define PNG2BMP_COPYRIGHT	"Copyright (C) 1999-2005 MIYASAKA Masaru"
 
-char outnam[FILENAME_MAX];
-char outdir[FILENAME_MAX];
-
-#define P2B_ALPHABMP_NONE		0
-#define P2B_ALPHABMP_ARGB		1	/* -a option; 32bit ARGB(RGB) BMP */
-#define P2B_ALPHABMP_BITFIELD	2	/* -b option; 32bit Bitfield BMP  */
-
-int alpha_format = P2B_ALPHABMP_NONE;
-int expand_trans = 0;
-
 
 
 
@@ -38,21 +28,31 @@ const char err_writeerr[]    = "SKIPPED: Write operation failed - %s\n";
 const char err_not_a_png[]   = "SKIPPED: Not a PNG file - %s\n";
 
 
-static BOOL read_png(char *, IMAGE *);
 static int skip_macbinary(png_structp);
+static int setup_read(CONVCTX *, png_structp, png_infop, IMAGE *);
 static void to4bpp(png_structp, png_row_infop, png_bytep);
-static BOOL write_bmp(char *, IMAGE *);
-static const char *write_rgb_bits(IMAGE *, FILE *);
+static int png2bmp_stream(CONVCTX *, char *, char *);
+static const char *write_bmp_head(CONVCTX *, IMAGE *, FILE *, DWORD *);
+static const char *write_rgb_bits(CONVCTX *, IMAGE *, FILE *);
 static void mputdwl(void *, unsigned long);
 static void mputwl(void *, unsigned int);
 static void usage_exit(char *, int);
 
 
 int png2bmp(char *in, char *out)
+{
+	CONVCTX ctx;
+
+	convctx_init(&ctx);
+	return png2bmp_ctx(&ctx, in, out);
+}
+
+int png2bmp_ctx(CONVCTX *ctx, char *in, char *out)
 {
 	IMAGE image;
-	if (!read_png(in, &image)) return -1;
-	if (!write_bmp(out, &image)) return -1;
+	if (ctx->stream) return png2bmp_stream(ctx, in, out);
+	if (!read_png(ctx, in, &image)) return -1;
+	if (!write_bmp(ctx, out, &image)) return -1;
 	return 0;
 }
 
@@ -60,13 +60,10 @@ int png2bmp(char *in, char *out)
 #define ERROR_ABORT(s) do { errmsg = (s); goto error_abort; } while (0)
 
 
-static BOOL read_png(char *fn, IMAGE *img)
+BOOL read_png(CONVCTX *ctx, char *fn, IMAGE *img)
 {
 	png_structp png_ptr;
 	png_infop info_ptr, end_info;
-	png_uint_32 width, height;
-	int bit_depth, color_type;
-	int xbit_depth, xcolor_type, xchannels;
 	const char *errmsg;
 	FILE *fp;
 
@@ -80,11 +77,12 @@ static BOOL read_png(char *fn, IMAGE *img)
 	}
 	if (fp == NULL) ERROR_ABORT(err_ropenfail);
 
-	set_status("Reading %.80s", basname(fn));
+	set_status(ctx, "Reading %.80s", basname(fn));
 
 	/* ------------------------------------------------------ */
 
-	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, fn,
+	ctx->fn = fn;
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, ctx,
 	                                   png_my_error, png_my_warning);
 	if (png_ptr == NULL) {
 		ERROR_ABORT(err_outofmemory);
@@ -105,6 +103,49 @@ static BOOL read_png(char *fn, IMAGE *img)
 
 	/* ------------------------------------------------------ */
 
+	if (setup_read(ctx, png_ptr, info_ptr, img) < 0 || !imgbuf_alloc_bits(img)) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
+		ERROR_ABORT(err_outofmemory);
+	}
+
+	/* ------------------------------------------------------ */
+
+	png_set_read_status_fn(png_ptr, row_callback);
+	init_progress_meter(ctx, png_ptr, img->width, img->height);
+
+	png_read_image(png_ptr, img->rowptr);
+
+	png_read_end(png_ptr, end_info);
+	png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
+
+	/* ------------------------------------------------------ */
+
+	set_status(ctx, "Read OK %.80s", basname(fn));
+
+	if (fp != stdin) fclose(fp);
+
+	return TRUE;
+
+error_abort:				/* error */
+	if (errmsg != NULL) xxprintf(ctx, errmsg, fn);
+	if (fp != stdin && fp != NULL) fclose(fp);
+	imgbuf_free(img);
+
+	return FALSE;
+}
+
+/*
+**		read the PNG header, set the transforms for BMP rows and fill
+**		in img and its palette; the number of passes, -1 without memory
+*/
+static int setup_read(CONVCTX *ctx, png_structp png_ptr, png_infop info_ptr,
+                      IMAGE *img)
+{
+	png_uint_32 width, height;
+	int bit_depth, color_type;
+	int xbit_depth, xcolor_type, xchannels;
+	int passes;
+
 	png_read_info(png_ptr, info_ptr);
 
 	png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth,
@@ -113,12 +154,12 @@ static BOOL read_png(char *fn, IMAGE *img)
 	/* ------------------------------------------------------ */
 
 	if (color_type & PNG_COLOR_MASK_ALPHA) {
-		if (alpha_format == P2B_ALPHABMP_NONE) {
+		if (ctx->alpha_format == P2B_ALPHABMP_NONE) {
 			png_set_strip_alpha(png_ptr);
 			color_type &= ~PNG_COLOR_MASK_ALPHA;
 		}
 	} else if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
-		if (alpha_format != P2B_ALPHABMP_NONE && expand_trans) {
+		if (ctx->alpha_format != P2B_ALPHABMP_NONE && ctx->expand_trans) {
 			png_set_tRNS_to_alpha(png_ptr);
 			color_type |=  PNG_COLOR_MASK_ALPHA;
 			color_type &= ~PNG_COLOR_MASK_PALETTE;
@@ -137,6 +178,8 @@ static BOOL read_png(char *fn, IMAGE *img)
 	}
 	if (bit_depth == 16)
 		png_set_strip_16(png_ptr);
+	/* libpng 1.6 wants this before the update, not from the progress meter */
+	passes = png_set_interlace_handling(png_ptr);
 
 	png_read_update_info(png_ptr, info_ptr);
 
@@ -153,10 +196,7 @@ static BOOL read_png(char *fn, IMAGE *img)
 	img->topdown  = FALSE;
 	img->alpha    = (xcolor_type & PNG_COLOR_MASK_ALPHA) ? TRUE : FALSE;
 
-	if (!imgbuf_alloc(img)) {
-		png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-		ERROR_ABORT(err_outofmemory);
-	}
+	if (!imgbuf_alloc_palette(img)) return -1;
 
 	if (img->palnum > 0) {
 		if (xcolor_type == PNG_COLOR_TYPE_PALETTE) {
@@ -173,32 +213,10 @@ static BOOL read_png(char *fn, IMAGE *img)
 		}
 	}
 
-	/* ------------------------------------------------------ */
-
-	png_set_read_status_fn(png_ptr, row_callback);
-	init_progress_meter(png_ptr, img->width, img->height);
-
-	png_read_image(png_ptr, img->rowptr);
-
-	png_read_end(png_ptr, end_info);
-	png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-
-	/* ------------------------------------------------------ */
-
-	set_status("Read OK %.80s", basname(fn));
-
-	if (fp != stdin) fclose(fp);
-
-	return TRUE;
-
-error_abort:				/* error */
-	if (errmsg != NULL) xxprintf(errmsg, fn);
-	if (fp != stdin && fp != NULL) fclose(fp);
-	imgbuf_free(img);
-
-	return FALSE;
+	return passes;
 }
 
+
 static void png_read_data_private (png_structp png_ptr, png_bytep data, png_size_t length)
 {
     png_size_t check; 
@@ -222,6 +240,7 @@ static int skip_macbinary(png_structp png_ptr)
 	enum { PNG_BYTES_TO_CHECK = 8, MACBIN_SIZE = 128 };	/* ^ in pngrio.c */
 	png_byte buf[MACBIN_SIZE];
 	png_bytep sig;
+	CONVCTX *ctx = (CONVCTX *)png_get_error_ptr(png_ptr);
 
 	png_read_data_private(png_ptr, buf,/* PNG_BYTES_TO_CHECK*/8);
 	if (png_sig_cmp(buf, 0, /*PNG_BYTES_TO_CHECK*/8) == 0)
@@ -232,7 +251,7 @@ static int skip_macbinary(png_structp png_ptr)
 	if (png_sig_cmp(sig, 0, /*PNG_BYTES_TO_CHECK*/8) == 0)
 								return /*PNG_BYTES_TO_CHECK*/8;
 
-	xxprintf(err_not_a_png, (char *)png_get_error_ptr(png_ptr));
+	xxprintf(ctx, err_not_a_png, ctx->fn);
 	longjmp(png_jmpbuf(png_ptr), 1);
 
 	return 0;	/* to quiet compiler warnings */
@@ -278,17 +297,11 @@ static void to4bpp(png_structp png_ptr, png_row_infop row_info, png_bytep data)
 /*
 **		.bmp եν񤭹
 */
-static BOOL write_bmp(char *fn, IMAGE *img)
+BOOL write_bmp(CONVCTX *ctx, char *fn, IMAGE *img)
 {
-	BYTE bfh[FILEHED_SIZE + BMPV4HED_SIZE];
-	BYTE *const bih = bfh + FILEHED_SIZE;
-	BYTE rgbq[RGBQUAD_SIZE];
-	BOOL alpha_bitfield;
-	DWORD bihsize, offbits, filesize;
-	PALETTE *pal;
 	const char *errmsg;
+	DWORD offbits;
 	FILE *fp;
-	UINT i;
 
 	if (fn == NULL) {
 		fn = " (stdout)";
@@ -298,24 +311,64 @@ static BOOL write_bmp(char *fn, IMAGE *img)
 	}
 	if (fp == NULL) ERROR_ABORT(err_wopenfail);
 
-	set_status("Writing %.80s", basname(fn));
+	set_status(ctx, "Writing %.80s", basname(fn));
 
 	/* ------------------------------------------------------ */
 
-	alpha_bitfield = (img->alpha && alpha_format == P2B_ALPHABMP_BITFIELD);
+	if ((errmsg = write_bmp_head(ctx, img, fp, &offbits)) != NULL)
+		ERROR_ABORT(errmsg);
+
+	if ((errmsg = write_rgb_bits(ctx, img, fp)) != NULL) ERROR_ABORT(errmsg);
+
+	/* ------------------------------------------------------ */
+
+	set_status(ctx, "OK      %.80s", basname(fn));
+	feed_line(ctx);
+
+	fflush(fp);
+	if (fp != stdout) fclose(fp);
+	imgbuf_free(img);
+
+	return TRUE;
+
+error_abort:				/* error */
+	xxprintf(ctx, errmsg, fn);
+	if (fp != stdout && fp != NULL) fclose(fp);
+	imgbuf_free(img);
+
+	return FALSE;
+}
+
+
+/*
+**		file header, info header and palette; *offbits gets where the
+**		bits start. Needs imgbytes, from imgbuf_alloc() or imgbuf_size().
+*/
+static const char *write_bmp_head(CONVCTX *ctx, IMAGE *img, FILE *fp,
+                                  DWORD *offbits)
+{
+	BYTE bfh[FILEHED_SIZE + BMPV4HED_SIZE];
+	BYTE *const bih = bfh + FILEHED_SIZE;
+	BYTE rgbq[RGBQUAD_SIZE];
+	BOOL alpha_bitfield;
+	DWORD bihsize, filesize;
+	PALETTE *pal;
+	UINT i;
+
+	alpha_bitfield = (img->alpha && ctx->alpha_format == P2B_ALPHABMP_BITFIELD);
 	bihsize = (alpha_bitfield) ? BMPV4HED_SIZE : INFOHED_SIZE;
-	offbits = FILEHED_SIZE + bihsize + RGBQUAD_SIZE * img->palnum;
-	filesize = offbits + img->imgbytes;
+	*offbits = FILEHED_SIZE + bihsize + RGBQUAD_SIZE * img->palnum;
+	filesize = *offbits + img->imgbytes;
 
 	memset(bfh, 0, sizeof(bfh));
 
 	mputwl( bfh + BFH_WTYPE   , BMP_SIGNATURE);
 	mputdwl(bfh + BFH_DSIZE   , filesize);
-	mputdwl(bfh + BFH_DOFFBITS, offbits);
+	mputdwl(bfh + BFH_DOFFBITS, *offbits);
 
 	mputdwl(bih + BIH_DSIZE     , bihsize);
 	mputdwl(bih + BIH_LWIDTH    , (DWORD)img->width);
-	mputdwl(bih + BIH_LHEIGHT   , (DWORD)img->height);
+	mputdwl(bih + BIH_LHEIGHT   , (DWORD)(ctx->topdown ? -img->height : img->height));
 	mputwl( bih + BIH_WPLANES   , 1);
 	mputwl( bih + BIH_WBITCOUNT , img->pixdepth);
 	mputdwl(bih + BIH_DSIZEIMAGE, img->imgbytes);
@@ -329,7 +382,7 @@ static BOOL write_bmp(char *fn, IMAGE *img)
 	}
 
 	if (fwrite(bfh, (FILEHED_SIZE + bihsize), 1, fp) != 1)
-		ERROR_ABORT(err_writeerr);
+		return err_writeerr;
 
 	/* ------------------------------------------------------ */
 
@@ -340,42 +393,30 @@ static BOOL write_bmp(char *fn, IMAGE *img)
 		rgbq[RGBQ_GREEN] = pal->green;
 		rgbq[RGBQ_BLUE]  = pal->blue;
 		if (fwrite(rgbq, RGBQUAD_SIZE, 1, fp) != 1)
-			ERROR_ABORT(err_writeerr);
+			return err_writeerr;
 	}
 
-	/* ------------------------------------------------------ */
-
-	if ((errmsg = write_rgb_bits(img, fp)) != NULL) ERROR_ABORT(errmsg);
-
-	/* ------------------------------------------------------ */
-
-	set_status("OK      %.80s", basname(fn));
-	feed_line();
-
-	fflush(fp);
-	if (fp != stdout) fclose(fp);
-	imgbuf_free(img);
-
-	return TRUE;
-
-error_abort:				/* error */
-	xxprintf(errmsg, fn);
-	if (fp != stdout && fp != NULL) fclose(fp);
-	imgbuf_free(img);
-
-	return FALSE;
+	return NULL;
 }
 
 
 /*
 **		BI_RGB (̵) βǡ
 */
-static const char *write_rgb_bits(IMAGE *img, FILE *fp)
+static const char *write_rgb_bits(CONVCTX *ctx, IMAGE *img, FILE *fp)
 {
-#if 1
 	DWORD wr  = 16*1024*1024;
 	DWORD num = img->imgbytes;
 	BYTE *ptr = img->bmpbits;
+	LONG y;
+
+	if (ctx->topdown) {		/* rows in PNG order */
+		for (y = 0; y < img->height; y++) {
+			if (fwrite(img->rowptr[y], img->rowbytes, 1, fp) != 1)
+				return err_writeerr;
+		}
+		return NULL;
+	}
 
 	while (num > 0) {
 		if (wr > num) wr = num;
@@ -385,14 +426,149 @@ static const char *write_rgb_bits(IMAGE *img, FILE *fp)
 
 		ptr += wr; num -= wr;
 	}
-#else
-	if (fwrite(img->bmpbits, img->imgbytes, 1, fp) != 1)
-		return err_writeerr;
-#endif
+
 	return NULL;
 }
 
 
+/*
+**		PNG to BMP a block of rows at a time: bottom-up BMPs get each
+**		block at its place with a seek, top-down ones in order. Takes
+**		the whole image for interlaced PNGs and for bottom-up output
+**		that cannot seek.
+*/
+static int png2bmp_stream(CONVCTX *ctx, char *in, char *out)
+{
+	png_structp png_ptr = NULL;
+	png_infop info_ptr = NULL, end_info = NULL;
+	IMAGE img;
+	BYTE *volatile block = NULL;
+	FILE *volatile fp = NULL;
+	FILE *volatile wp = NULL;
+	const char *volatile errmsg = NULL;
+	struct stat st;
+	DWORD offbits;
+	LONG y, i, n, rows;
+	int passes;
+	char *volatile fn = in;
+
+	imgbuf_init(&img);
+
+	if (in == NULL) {
+		fn = " (stdin)";
+		fp = binary_stdio(fileno(stdin));
+	} else {
+		fp = fopen(in, "rb");
+	}
+	if (fp == NULL) ERROR_ABORT(err_ropenfail);
+
+	set_status(ctx, "Reading %.80s", basname(fn));
+
+	ctx->fn = fn;
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, ctx,
+	                                   png_my_error, png_my_warning);
+	if (png_ptr == NULL) ERROR_ABORT(err_outofmemory);
+	info_ptr = png_create_info_struct(png_ptr);
+	end_info = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL || end_info == NULL) ERROR_ABORT(err_outofmemory);
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		/* libpng has told why */
+		errmsg = NULL;
+		goto error_abort;
+	}
+	png_init_io(png_ptr, fp);
+	png_set_sig_bytes(png_ptr, skip_macbinary(png_ptr));
+
+	passes = setup_read(ctx, png_ptr, info_ptr, &img);
+	if (passes < 0) ERROR_ABORT(err_outofmemory);
+	imgbuf_size(&img);
+
+	/* ------------------------------------------------------ */
+
+	if (out == NULL) {
+		fn = " (stdout)";
+		wp = binary_stdio(fileno(stdout));
+	} else {
+		fn = out;
+		wp = fopen(out, "wb");
+	}
+	if (wp == NULL) ERROR_ABORT(err_wopenfail);
+
+	set_status(ctx, "Writing %.80s", basname(fn));
+
+	if ((errmsg = write_bmp_head(ctx, &img, wp, &offbits)) != NULL)
+		goto error_abort;
+
+	png_set_read_status_fn(png_ptr, row_callback);
+	init_progress_meter(ctx, png_ptr, img.width, img.height);
+
+	if (passes > 1 || (!ctx->topdown &&
+	    (fstat(fileno(wp), &st) != 0 || !S_ISREG(st.st_mode)))) {
+		if (!imgbuf_alloc_bits(&img)) ERROR_ABORT(err_outofmemory);
+		png_read_image(png_ptr, img.rowptr);
+		if ((errmsg = write_rgb_bits(ctx, &img, wp)) != NULL)
+			goto error_abort;
+	} else {
+		rows = STREAM_BLOCK / img.rowbytes;
+		if (rows < 1) rows = 1;
+		if (rows > img.height) rows = img.height;
+		/* zeroed once: the padding at the end of each row stays zero */
+		block = calloc(rows, img.rowbytes);
+		if (block == NULL) ERROR_ABORT(err_outofmemory);
+
+		for (y = 0; y < img.height; y += n) {
+			n = (img.height - y < rows) ? img.height - y : rows;
+			if (ctx->topdown) {
+				for (i = 0; i < n; i++)
+					png_read_row(png_ptr, block + i * img.rowbytes, NULL);
+			} else {
+				/* bottom row of the block first in the file */
+				for (i = 0; i < n; i++)
+					png_read_row(png_ptr, block + (n - 1 - i) * img.rowbytes, NULL);
+				if (fseeko(wp, (off_t)offbits +
+				           (off_t)(img.height - y - n) * img.rowbytes, SEEK_SET) != 0)
+					ERROR_ABORT(err_writeerr);
+			}
+			if (fwrite(block, img.rowbytes, n, wp) != (size_t)n)
+				ERROR_ABORT(err_writeerr);
+		}
+	}
+	png_read_end(png_ptr, end_info);
+
+	if (fflush(wp) != 0) ERROR_ABORT(err_writeerr);
+
+	/* ------------------------------------------------------ */
+
+	set_status(ctx, "OK      %.80s", basname(fn));
+	feed_line(ctx);
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
+	free(block);
+	imgbuf_free(&img);
+	if (fp != stdin) fclose(fp);
+	if (wp != stdout && fclose(wp) != 0) {
+		xxprintf(ctx, err_writeerr, fn);
+		return -1;
+	}
+
+	return 0;
+
+error_abort:				/* error */
+	if (errmsg != NULL) xxprintf(ctx, errmsg, fn);
+	if (png_ptr != NULL)
+		png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
+	free(block);
+	imgbuf_free(&img);
+	if (fp != stdin && fp != NULL) fclose(fp);
+	if (wp != stdout && wp != NULL) {
+		fclose(wp);
+		remove(out);		/* no half written BMPs */
+	}
+
+	return -1;
+}
+
+
 /*
 **	 little-endien  4Х̵
 */
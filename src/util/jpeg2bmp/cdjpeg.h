@@ -98,6 +98,7 @@ struct cdjpeg_progress_mgr {
 typedef struct cdjpeg_progress_mgr * cd_progress_ptr;
 
 int jpg2bmp(const char *in, const char *out);
+int jpg2bmp_scaled(const char *in, const char *out, int scale_denom, int topdown);
 
 
 /* Short forms of external names for systems with brain-damaged linkers. */
@@ -6,6 +6,7 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <setjmp.h>
 #include "cdjpeg.h"		/* Common decls for cjpeg/djpeg applications */
 
 typedef struct _bmp_dest_struct_{
@@ -16,6 +17,8 @@ typedef struct _bmp_dest_struct_{
   JDIMENSION row_width;		/* physical width of one row in the BMP file */
   int pad_bytes;		/* number of padding bytes needed per row */
   JDIMENSION cur_output_row;	/* next row# to write to virtual array */
+  boolean topdown;		/* rows go straight to the file, top row first */
+  JSAMPROW row_buffer;		/* one BMP row, when topdown */
 } bmp_dest_struct;
 
 typedef bmp_dest_struct * bmp_dest_ptr;
@@ -23,6 +26,7 @@ typedef bmp_dest_struct * bmp_dest_ptr;
 
 /* Forward declarations */
 static void write_colormap JPP((j_decompress_ptr cinfo, bmp_dest_ptr dest, int map_colors, int map_entry_size));
+static void write_row(j_decompress_ptr cinfo, bmp_dest_ptr dest);
 static void put_pixel_rows (j_decompress_ptr cinfo, djpeg_dest_ptr dinfo, JDIMENSION rows_supplied);
 static void put_gray_rows(j_decompress_ptr cinfo, djpeg_dest_ptr dinfo, JDIMENSION rows_supplied);
 static void start_output_bmp(j_decompress_ptr cinfo, djpeg_dest_ptr dinfo);
@@ -30,42 +34,89 @@ static void write_bmp_header(j_decompress_ptr cinfo, bmp_dest_ptr dest);
 static void write_os2_header(j_decompress_ptr cinfo, bmp_dest_ptr dest);
 static void write_colormap(j_decompress_ptr cinfo, bmp_dest_ptr dest, int map_colors, int map_entry_size);
 static void finish_output_bmp(j_decompress_ptr cinfo, djpeg_dest_ptr dinfo);
-static djpeg_dest_ptr jinit_write_bmp(j_decompress_ptr cinfo, boolean is_os2);
+static djpeg_dest_ptr jinit_write_bmp(j_decompress_ptr cinfo, boolean is_os2, boolean topdown);
 
+/* errors come back to jpg2bmp() instead of ending the process */
+struct jpg2bmp_error_mgr {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+};
+
+static void jpg2bmp_error_exit (j_common_ptr cinfo)
+{
+  struct jpg2bmp_error_mgr *err = (struct jpg2bmp_error_mgr *)cinfo->err;
+
+  (*cinfo->err->output_message) (cinfo);
+  longjmp(err->setjmp_buffer, 1);
+}
+
+/* returns 0, or -1 when a file cannot be opened or the JPEG is bad */
 int jpg2bmp(const char *in, const char *out)
+{
+  return jpg2bmp_scaled(in, out, 1, 0);
+}
+
+/*
+ * Same, decoded at 1/scale_denom of the size (1, 2, 4 or 8) by the
+ * scaled IDCT, which is much cheaper than decoding in full and resizing.
+ * A topdown BMP (negative height) is written as the rows are decoded,
+ * with no need to hold the whole picture to turn it upside down.
+ */
+int jpg2bmp_scaled(const char *in, const char *out, int scale_denom, int topdown)
 {
   int isWin = 1;
   struct jpeg_decompress_struct cinfo;
-  struct jpeg_error_mgr jerr;
+  struct jpg2bmp_error_mgr jerr;
 
-  int file_index;
   djpeg_dest_ptr dest_mgr = NULL;
-  FILE * input_file;
-  FILE * output_file;
+  FILE * volatile input_file = NULL;
+  FILE * volatile output_file = NULL;
   JDIMENSION num_scanlines;
 
-  /* Initialize the JPEG decompression object with default error handling. */
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_decompress(&cinfo);
-
-  if ((input_file = fopen(in, "rb")) == NULL) {
-      exit(EXIT_FAILURE);
+  if (scale_denom != 1 && scale_denom != 2 && scale_denom != 4 && scale_denom != 8)
+    return -1;
+
+  /* Initialize the JPEG decompression object, errors return here. */
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpg2bmp_error_exit;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    if (input_file)
+      fclose(input_file);
+    if (output_file) {
+      /* don't leave a truncated BMP behind */
+      fclose(output_file);
+      remove(out);
+    }
+    return -1;
   }
+  jpeg_create_decompress(&cinfo);
 
-  if ((output_file = fopen(out, "wb")) == NULL) {
-     exit(EXIT_FAILURE);
+  if ((input_file = fopen(in, READ_BINARY)) == NULL) {
+    jpeg_destroy_decompress(&cinfo);
+    return -1;
   }
 
   /* Specify data source for decompression */
   jpeg_stdio_src(&cinfo, input_file);
 
-  /* Read file header, set default decompression parameters */
+  /* Read file header, set default decompression parameters; only a
+   * JPEG gets its output created, so out is never emptied for nothing
+   */
   (void) jpeg_read_header(&cinfo, TRUE);
 
+  if ((output_file = fopen(out, WRITE_BINARY)) == NULL) {
+    jpeg_destroy_decompress(&cinfo);
+    fclose(input_file);
+    return -1;
+  }
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = scale_denom;
+
   if (isWin)
-     dest_mgr = jinit_write_bmp(&cinfo, FALSE);
+     dest_mgr = jinit_write_bmp(&cinfo, FALSE, topdown);
   else
-     dest_mgr = jinit_write_bmp(&cinfo, TRUE);
+     dest_mgr = jinit_write_bmp(&cinfo, TRUE, FALSE);
 
    dest_mgr->output_file = output_file;
 
@@ -93,12 +144,13 @@ int jpg2bmp(const char *in, const char *out)
   jpeg_destroy_decompress(&cinfo);
 
   /* Close files, if we opened them */
-  if (input_file != stdin)
-    fclose(input_file);
-  if (output_file != stdout)
-    fclose(output_file);
+  fclose(input_file);
+  if (fclose(output_file) != 0) {
+    remove(out);
+    return -1;
+  }
 
-  return 0;			/* suppress no-return-value warnings */
+  return 0;
 }
 
 /*
@@ -156,6 +208,14 @@ static void write_colormap(j_decompress_ptr cinfo, bmp_dest_ptr dest, int map_co
       		putc(0, outfile);
   	}
 }
+
+/* Topdown: the row just filled goes straight to the file */
+static void write_row(j_decompress_ptr cinfo, bmp_dest_ptr dest)
+{
+  if (JFWRITE(dest->pub.output_file, dest->row_buffer, dest->row_width) != (size_t) dest->row_width)
+    ERREXIT(cinfo, JERR_FILE_WRITE);
+}
+
 /*
  * Write some pixel data.
  * In this module rows_supplied will always be 1.
@@ -170,8 +230,11 @@ static void put_pixel_rows (j_decompress_ptr cinfo, djpeg_dest_ptr dinfo, JDIMEN
   register JDIMENSION col;
   int pad;
 
-  /* Access next row in virtual array */
-  image_ptr = (*cinfo->mem->access_virt_sarray)((j_common_ptr) cinfo, dest->whole_image, dest->cur_output_row, (JDIMENSION) 1, TRUE);
+  /* Access next row in virtual array, or the row going out now */
+  if (dest->topdown)
+    image_ptr = &dest->row_buffer;
+  else
+    image_ptr = (*cinfo->mem->access_virt_sarray)((j_common_ptr) cinfo, dest->whole_image, dest->cur_output_row, (JDIMENSION) 1, TRUE);
   dest->cur_output_row++;
 
   /* Transfer data.  Note destination values must be in BGR order
@@ -190,6 +253,9 @@ static void put_pixel_rows (j_decompress_ptr cinfo, djpeg_dest_ptr dinfo, JDIMEN
   pad = dest->pad_bytes;
   while (--pad >= 0)
     *outptr++ = 0;
+
+  if (dest->topdown)
+    write_row(cinfo, dest);
 }
 
 /* This version is for grayscale OR quantized color output */
@@ -201,8 +267,11 @@ static void put_gray_rows(j_decompress_ptr cinfo, djpeg_dest_ptr dinfo, JDIMENSI
   register JDIMENSION col;
   int pad;
 
-  /* Access next row in virtual array */
-  image_ptr = (*cinfo->mem->access_virt_sarray)((j_common_ptr) cinfo, dest->whole_image, dest->cur_output_row, (JDIMENSION) 1, TRUE);
+  /* Access next row in virtual array, or the row going out now */
+  if (dest->topdown)
+    image_ptr = &dest->row_buffer;
+  else
+    image_ptr = (*cinfo->mem->access_virt_sarray)((j_common_ptr) cinfo, dest->whole_image, dest->cur_output_row, (JDIMENSION) 1, TRUE);
   dest->cur_output_row++;
 
   /* Transfer data. */
@@ -216,17 +285,23 @@ static void put_gray_rows(j_decompress_ptr cinfo, djpeg_dest_ptr dinfo, JDIMENSI
   pad = dest->pad_bytes;
   while (--pad >= 0)
     *outptr++ = 0;
+
+  if (dest->topdown)
+    write_row(cinfo, dest);
 }
 
 
 /*
  * Startup: normally writes the file header.
- * In this module we may as well postpone everything until finish_output.
+ * Bottom-up, we may as well postpone everything until finish_output.
  */
 
 static void start_output_bmp(j_decompress_ptr cinfo, djpeg_dest_ptr dinfo)
 {
-  /* no work here */
+  	bmp_dest_ptr dest = (bmp_dest_ptr) dinfo;
+
+  	if (dest->topdown)
+    	write_bmp_header(cinfo, dest);
 }
 
 
@@ -291,7 +366,10 @@ static void write_bmp_header(j_decompress_ptr cinfo, bmp_dest_ptr dest)
   /* Fill the info header (Microsoft calls this a BITMAPINFOHEADER) */
   	PUT_2B(bmpinfoheader, 0, 40);	/* biSize */
   	PUT_4B(bmpinfoheader, 4, cinfo->output_width); /* biWidth */
-  	PUT_4B(bmpinfoheader, 8, cinfo->output_height); /* biHeight */
+  	if (dest->topdown)	/* negative biHeight: top row first */
+    	PUT_4B(bmpinfoheader, 8, -(INT32) cinfo->output_height);
+  	else
+    	PUT_4B(bmpinfoheader, 8, cinfo->output_height); /* biHeight */
   	PUT_2B(bmpinfoheader, 12, 1);	/* biPlanes - must be 1 */
   	PUT_2B(bmpinfoheader, 14, bits_per_pixel); /* biBitCount */
   /* we leave biCompression = 0, for none */
@@ -380,29 +458,32 @@ static void finish_output_bmp(j_decompress_ptr cinfo, djpeg_dest_ptr dinfo)
   	register JDIMENSION col;
   	cd_progress_ptr progress = (cd_progress_ptr) cinfo->progress;
 
-  /* Write the header and colormap */
-  	if (dest->is_os2)
-    	write_os2_header(cinfo, dest);
-  	else
-    	write_bmp_header(cinfo, dest);
-
-  /* Write the file body from our virtual array */
-  	for (row = cinfo->output_height; row > 0; row--) {
-    	if (progress != NULL) {
-      		progress->pub.pass_counter = (long) (cinfo->output_height - row);
-      		progress->pub.pass_limit = (long) cinfo->output_height;
-      		(*progress->pub.progress_monitor) ((j_common_ptr) cinfo);
-    	}
-    	image_ptr = (*cinfo->mem->access_virt_sarray)((j_common_ptr) cinfo, dest->whole_image, row-1, (JDIMENSION) 1, FALSE);
-    	data_ptr = image_ptr[0];
-    	for (col = dest->row_width; col > 0; col--) {
-      		putc(GETJSAMPLE(*data_ptr), outfile);
-      		data_ptr++;
-    	}
+  /* Topdown, the header and every row are out already */
+  	if (!dest->topdown) {
+  	/* Write the header and colormap */
+  		if (dest->is_os2)
+    		write_os2_header(cinfo, dest);
+  		else
+    		write_bmp_header(cinfo, dest);
+
+  	/* Write the file body from our virtual array */
+  		for (row = cinfo->output_height; row > 0; row--) {
+    		if (progress != NULL) {
+      			progress->pub.pass_counter = (long) (cinfo->output_height - row);
+      			progress->pub.pass_limit = (long) cinfo->output_height;
+      			(*progress->pub.progress_monitor) ((j_common_ptr) cinfo);
+    		}
+    		image_ptr = (*cinfo->mem->access_virt_sarray)((j_common_ptr) cinfo, dest->whole_image, row-1, (JDIMENSION) 1, FALSE);
+    		data_ptr = image_ptr[0];
+    		for (col = dest->row_width; col > 0; col--) {
+      			putc(GETJSAMPLE(*data_ptr), outfile);
+      			data_ptr++;
+    		}
+  		}
+  		if (progress != NULL)
+    		progress->completed_extra_passes++;
   	}
-  	if (progress != NULL)
-    	progress->completed_extra_passes++;
-	
+
   /* Make sure we wrote the output file OK */
   	fflush(outfile);
   	if (ferror(outfile))
@@ -414,7 +495,7 @@ static void finish_output_bmp(j_decompress_ptr cinfo, djpeg_dest_ptr dinfo)
  * The module selection routine for BMP format output.
  */
 
-static djpeg_dest_ptr jinit_write_bmp(j_decompress_ptr cinfo, boolean is_os2)
+static djpeg_dest_ptr jinit_write_bmp(j_decompress_ptr cinfo, boolean is_os2, boolean topdown)
 {
   	bmp_dest_ptr dest;
   	JDIMENSION row_width;
@@ -424,6 +505,7 @@ static djpeg_dest_ptr jinit_write_bmp(j_decompress_ptr cinfo, boolean is_os2)
   	dest->pub.start_output = start_output_bmp;
   	dest->pub.finish_output = finish_output_bmp;
   	dest->is_os2 = is_os2;
+  	dest->topdown = topdown;	/* Windows header only, OS/2 has no sign */
 
   	if (cinfo->out_color_space == JCS_GRAYSCALE) {
     	dest->pub.put_pixel_rows = put_gray_rows;
@@ -448,10 +530,19 @@ static djpeg_dest_ptr jinit_write_bmp(j_decompress_ptr cinfo, boolean is_os2)
   	dest->row_width = row_width;
   	dest->pad_bytes = (int) (row_width - dest->data_width);
 
-  /* Allocate space for inversion array, prepare for write pass */
-  	dest->whole_image = (*cinfo->mem->request_virt_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE, FALSE, row_width, cinfo->output_height, (JDIMENSION) 1);
+  /* Allocate space for inversion array, prepare for write pass;
+   * topdown needs only the row being written.
+   */
   	dest->cur_output_row = 0;
-  	if (cinfo->progress != NULL) {
+  	if (topdown) {
+    	dest->whole_image = NULL;
+    	dest->row_buffer = (*cinfo->mem->alloc_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE, row_width, (JDIMENSION) 1)[0];
+  	}
+  	else {
+    	dest->whole_image = (*cinfo->mem->request_virt_sarray)((j_common_ptr) cinfo, JPOOL_IMAGE, FALSE, row_width, cinfo->output_height, (JDIMENSION) 1);
+    	dest->row_buffer = NULL;
+  	}
+  	if (cinfo->progress != NULL && !topdown) {
     	cd_progress_ptr progress = (cd_progress_ptr) cinfo->progress;
     	progress->total_extra_passes++; /* count file input as separate pass */
   	}
@@ -0,0 +1,172 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct _GBatch {
+	XssTaskFunc func;
+	void **data;
+	void *usr_data;
+	int n_tasks;
+	int next;			/* next task nobody has claimed yet */
+	int done;
+	pthread_cond_t finished;
+	struct _GBatch *next_batch;
+}GBatch;
+
+struct _XssPool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	GBatch *batches;		/* batches with unclaimed tasks */
+	int quit;
+	int n_threads;
+	pthread_t *threads;
+};
+
+int xss_get_num_processors(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? (int)n : 1;
+}
+
+/* claim a task of batch, unlinking it once all are handed out; lock held */
+static int claim_task(XssPool *pool, GBatch *batch)
+{
+	GBatch **p;
+	int i = batch->next++;
+
+	if (batch->next == batch->n_tasks) {
+		for (p = &pool->batches; *p; p = &(*p)->next_batch) {
+			if (*p == batch) {
+				*p = batch->next_batch;
+				break;
+			}
+		}
+	}
+	return i;
+}
+
+/* run task i of batch without the lock, then account for it */
+static void run_task(XssPool *pool, GBatch *batch, int i)
+{
+	pthread_mutex_unlock(&pool->lock);
+	batch->func(batch->data ? batch->data[i] : NULL, batch->usr_data);
+	pthread_mutex_lock(&pool->lock);
+	if (++batch->done == batch->n_tasks)
+		pthread_cond_signal(&batch->finished);
+}
+
+static void *worker(void *arg)
+{
+	XssPool *pool = (XssPool *)arg;
+	GBatch *batch;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->batches && !pool->quit)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->quit)
+			break;
+		batch = pool->batches;
+		run_task(pool, batch, claim_task(pool, batch));
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/* max_threads workers, 0 for one per processor */
+XssPool *xss_pool_new(int max_threads)
+{
+	XssPool *pool;
+	int i;
+
+	if (max_threads <= 0)
+		max_threads = xss_get_num_processors();
+
+	pool = (XssPool *)malloc(sizeof(XssPool));
+	if (!pool)
+		return NULL;
+	pool->threads = (pthread_t *)malloc(max_threads * sizeof(pthread_t));
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pool->batches = NULL;
+	pool->quit = 0;
+
+	/* the thread calling xss_pool_run() is one of the workers */
+	pool->n_threads = 0;
+	for (i = 0; i < max_threads - 1; i++) {
+		if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0)
+			break;
+		pool->n_threads++;
+	}
+
+	return pool;
+}
+
+int xss_pool_get_max_threads(XssPool *pool)
+{
+	return pool->n_threads + 1;
+}
+
+void xss_pool_run(XssPool *pool, XssTaskFunc func, void **data, int n_tasks, void *usr_data)
+{
+	GBatch batch;
+	int i;
+
+	if (n_tasks <= 0)
+		return;
+
+	if (!pool || pool->n_threads == 0 || n_tasks == 1) {
+		for (i = 0; i < n_tasks; i++)
+			func(data ? data[i] : NULL, usr_data);
+		return;
+	}
+
+	batch.func = func;
+	batch.data = data;
+	batch.usr_data = usr_data;
+	batch.n_tasks = n_tasks;
+	batch.next = 0;
+	batch.done = 0;
+	pthread_cond_init(&batch.finished, NULL);
+
+	pthread_mutex_lock(&pool->lock);
+	batch.next_batch = pool->batches;
+	pool->batches = &batch;
+	pthread_cond_broadcast(&pool->work);
+
+	while (batch.next < batch.n_tasks)
+		run_task(pool, &batch, claim_task(pool, &batch));
+	while (batch.done < batch.n_tasks)
+		pthread_cond_wait(&batch.finished, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_cond_destroy(&batch.finished);
+}
+
+void xss_pool_free(XssPool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->n_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
@@ -0,0 +1,25 @@
+#ifndef _GG_POOL_H
+#define _GG_POOL_H
+
+/*
+  Fixed set of worker threads running batches of independent tasks.
+  xss_pool_run() returns once every task of its batch is done; the
+  calling thread works on its own batch too, so several threads (or a
+  task itself) can share one pool without deadlocking.
+*/
+
+typedef struct _XssPool XssPool;
+
+typedef void (*XssTaskFunc)(void *data, void *usr_data);
+
+XssPool *xss_pool_new(int max_threads);
+
+int xss_pool_get_max_threads(XssPool *pool);
+
+void xss_pool_run(XssPool *pool, XssTaskFunc func, void **data, int n_tasks, void *usr_data);
+
+void xss_pool_free(XssPool *pool);
+
+int xss_get_num_processors(void);
+
+#endif
@@ -0,0 +1,271 @@
+#include "qoi.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define QOI_OP_INDEX	0x00	/* 00xxxxxx */
+#define QOI_OP_DIFF	0x40	/* 01xxxxxx */
+#define QOI_OP_LUMA	0x80	/* 10xxxxxx */
+#define QOI_OP_RUN	0xc0	/* 11xxxxxx */
+#define QOI_OP_RGB	0xfe	/* 11111110 */
+#define QOI_OP_RGBA	0xff	/* 11111111 */
+#define QOI_MASK_2	0xc0
+
+#define QOI_MAGIC	"qoif"
+
+/* the decoder keeps pixels as r | g << 8 | b << 16 | a << 24 */
+#define QOI_HASH(r, g, b, a)	(((r) * 3 + (g) * 5 + (b) * 7 + (a) * 11) & 63)
+
+static const unsigned char qoi_padding[QOI_PADDING_SIZE] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+void qoi_state_init (qoi_state *s)
+{
+	memset (s->index, 0, sizeof(s->index));
+	/* opaque black in any channel order */
+	s->px = 0xff000000u;
+	s->run = 0;
+}
+
+static void put_be32 (unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static unsigned int get_be32 (const unsigned char *p)
+{
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+void qoi_write_header (unsigned char *out, const qoi_desc *desc)
+{
+	memcpy (out, QOI_MAGIC, 4);
+	put_be32 (out + 4, desc->width);
+	put_be32 (out + 8, desc->height);
+	out[12] = desc->channels;
+	out[13] = desc->colorspace;
+}
+
+int qoi_read_header (const unsigned char *in, qoi_desc *desc)
+{
+	if (memcmp (in, QOI_MAGIC, 4) != 0)
+		return -1;
+	desc->width = get_be32 (in + 4);
+	desc->height = get_be32 (in + 8);
+	desc->channels = in[12];
+	desc->colorspace = in[13];
+	if (!desc->width || !desc->height || desc->height > QOI_PIXELS_MAX / desc->width)
+		return -1;
+	if ((desc->channels != 3 && desc->channels != 4) || desc->colorspace > 1)
+		return -1;
+	return 0;
+}
+
+/*
+  The encoder compares pixels as loaded, r and b at bit rs and bs, a in
+  the top byte (0xff without alpha), so BGRX rows need no swizzle. The
+  constant arguments turn every caller into its own loop.
+*/
+static inline unsigned char *encode_pixels (qoi_state *s, const unsigned char *p, int n,
+					    int step, int rs, int bs, int alpha, unsigned char *o)
+{
+	unsigned int *index = s->index;
+	unsigned int px, prev = s->px;
+	unsigned int r, g, b, a, h;
+	int run = s->run;
+	signed char vr, vg, vb, vg_r, vg_b;
+
+	for (; n > 0; n--, p += step) {
+		if (step == 3)
+			px = p[0] | p[1] << 8 | p[2] << 16 | 0xff000000u;
+		else if (alpha)
+			px = p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+		else
+			px = (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24) | 0xff000000u;
+
+		if (px == prev) {
+			if (++run == 62) {
+				*o++ = QOI_OP_RUN | 61;
+				run = 0;
+			}
+			continue;
+		}
+		if (run) {
+			*o++ = QOI_OP_RUN | (run - 1);
+			run = 0;
+		}
+
+		r = px >> rs & 0xff;
+		g = px >> 8 & 0xff;
+		b = px >> bs & 0xff;
+		a = px >> 24;
+		h = QOI_HASH (r, g, b, a);
+		if (index[h] == px) {
+			*o++ = QOI_OP_INDEX | h;
+			prev = px;
+			continue;
+		}
+		index[h] = px;
+
+		if ((px ^ prev) >> 24) {
+			o[0] = QOI_OP_RGBA;
+			o[1] = r;
+			o[2] = g;
+			o[3] = b;
+			o[4] = a;
+			o += 5;
+			prev = px;
+			continue;
+		}
+
+		vr = r - (prev >> rs & 0xff);
+		vg = g - (prev >> 8 & 0xff);
+		vb = b - (prev >> bs & 0xff);
+		vg_r = vr - vg;
+		vg_b = vb - vg;
+		if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+			*o++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+		} else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+			o[0] = QOI_OP_LUMA | (vg + 32);
+			o[1] = (vg_r + 8) << 4 | (vg_b + 8);
+			o += 2;
+		} else {
+			o[0] = QOI_OP_RGB;
+			o[1] = r;
+			o[2] = g;
+			o[3] = b;
+			o += 4;
+		}
+		prev = px;
+	}
+
+	s->px = prev;
+	s->run = run;
+	return o;
+}
+
+unsigned char *qoi_encode_rows (qoi_state *s, const unsigned char *pixels, int rowstride, int width, int rows,
+				int step, int bgr, int alpha, unsigned char *out)
+{
+	int y;
+
+	for (y = 0; y < rows; y++, pixels += rowstride) {
+		if (step == 3)
+			out = bgr ? encode_pixels (s, pixels, width, 3, 16, 0, 0, out)
+				  : encode_pixels (s, pixels, width, 3, 0, 16, 0, out);
+		else if (bgr)
+			out = alpha ? encode_pixels (s, pixels, width, 4, 16, 0, 1, out)
+				    : encode_pixels (s, pixels, width, 4, 16, 0, 0, out);
+		else
+			out = alpha ? encode_pixels (s, pixels, width, 4, 0, 16, 1, out)
+				    : encode_pixels (s, pixels, width, 4, 0, 16, 0, out);
+	}
+
+	return out;
+}
+
+unsigned char *qoi_encode_finish (qoi_state *s, unsigned char *out)
+{
+	if (s->run) {
+		*out++ = QOI_OP_RUN | (s->run - 1);
+		s->run = 0;
+	}
+	memcpy (out, qoi_padding, QOI_PADDING_SIZE);
+
+	return out + QOI_PADDING_SIZE;
+}
+
+const unsigned char *qoi_decode_row (qoi_state *s, const unsigned char *in, const unsigned char *end,
+				     unsigned char *row, int width, int channels)
+{
+	unsigned int *index = s->index;
+	unsigned int px = s->px;
+	unsigned int r, g, b, a, b1, b2;
+	int run = s->run, vg;
+
+	for (; width > 0; width--, row += channels) {
+		if (run > 0) {
+			run--;
+		} else {
+			/* the longest op reads 5 bytes, all inside the padding at worst */
+			if (in >= end)
+				return NULL;
+			b1 = *in++;
+			r = px & 0xff;
+			g = px >> 8 & 0xff;
+			b = px >> 16 & 0xff;
+			a = px >> 24;
+			if (b1 == QOI_OP_RGB) {
+				r = in[0];
+				g = in[1];
+				b = in[2];
+				in += 3;
+			} else if (b1 == QOI_OP_RGBA) {
+				r = in[0];
+				g = in[1];
+				b = in[2];
+				a = in[3];
+				in += 4;
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+				px = index[b1];
+				r = px & 0xff;
+				g = px >> 8 & 0xff;
+				b = px >> 16 & 0xff;
+				a = px >> 24;
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+				r = (r + (b1 >> 4 & 3) - 2) & 0xff;
+				g = (g + (b1 >> 2 & 3) - 2) & 0xff;
+				b = (b + (b1 & 3) - 2) & 0xff;
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+				b2 = *in++;
+				vg = (b1 & 0x3f) - 32;
+				r = (r + vg - 8 + (b2 >> 4 & 0x0f)) & 0xff;
+				g = (g + vg) & 0xff;
+				b = (b + vg - 8 + (b2 & 0x0f)) & 0xff;
+			} else {
+				run = b1 & 0x3f;
+			}
+			px = r | g << 8 | b << 16 | a << 24;
+			index[QOI_HASH (r, g, b, a)] = px;
+		}
+
+		row[0] = px;
+		row[1] = px >> 8;
+		row[2] = px >> 16;
+		if (channels == 4)
+			row[3] = px >> 24;
+	}
+
+	s->px = px;
+	s->run = run;
+	return in;
+}
+
+unsigned char *qoi_read_file (FILE *fp, size_t *size)
+{
+	unsigned char *buf = NULL, *tmp;
+	size_t len = 0, alloc = 0, n;
+
+	do {
+		if (len == alloc) {
+			alloc = alloc ? alloc * 2 : 64 * 1024;
+			tmp = (unsigned char *)realloc(buf, alloc);
+			if (!tmp) {
+				free (buf);
+				return NULL;
+			}
+			buf = tmp;
+		}
+		n = fread (buf + len, 1, alloc - len, fp);
+		len += n;
+	} while (n > 0);
+
+	if (ferror (fp) || len < QOI_HEADER_SIZE + QOI_PADDING_SIZE) {
+		free (buf);
+		return NULL;
+	}
+	*size = len;
+
+	return buf;
+}
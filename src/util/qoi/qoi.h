@@ -0,0 +1,72 @@
+#ifndef _QOI_H
+#define _QOI_H
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdio.h>
+
+/*
+  QOI, the "Quite OK Image" format (qoiformat.org): a 14 byte header,
+  one byte aligned chunk stream and an 8 byte end marker. Encoder and
+  decoder keep their state in a qoi_state, so an image can go through
+  them a few rows at a time.
+*/
+
+#define QOI_HEADER_SIZE		14
+#define QOI_PADDING_SIZE	8
+/* the spec's limit, keeps width * height * 4 in 32 bits */
+#define QOI_PIXELS_MAX		400000000u
+/* bytes one row of width pixels can take at worst (all QOI_OP_RGBA) */
+#define QOI_ROW_BOUND(width)	((size_t)(width) * 5)
+
+typedef struct {
+	unsigned int width;
+	unsigned int height;
+	unsigned char channels;		/* 3 RGB, 4 RGBA */
+	unsigned char colorspace;	/* 0 sRGB with linear alpha, 1 all linear */
+} qoi_desc;
+
+typedef struct {
+	unsigned int index[64];		/* recently seen pixels */
+	unsigned int px;		/* previous pixel */
+	int run;			/* pending repeats of px */
+} qoi_state;
+
+void qoi_state_init (qoi_state *s);
+
+void qoi_write_header (unsigned char *out, const qoi_desc *desc);
+/* 0 when in holds a valid header for an image of at most QOI_PIXELS_MAX */
+int qoi_read_header (const unsigned char *in, qoi_desc *desc);
+
+/*
+  Encode rows of width pixels step (3 or 4) bytes apart. bgr says blue
+  comes first, as in BGRX captures; alpha says the 4th byte is alpha,
+  otherwise it is ignored. Returns the end of the output, which needs
+  room for QOI_ROW_BOUND(width) bytes per row.
+*/
+unsigned char *qoi_encode_rows (qoi_state *s, const unsigned char *pixels, int rowstride, int width, int rows,
+				int step, int bgr, int alpha, unsigned char *out);
+/* flush a pending run and append the end marker, at most 9 bytes */
+unsigned char *qoi_encode_finish (qoi_state *s, unsigned char *out);
+
+/*
+  Decode one row of width pixels into channels (3 or 4) byte RGB(A).
+  end is the end of the chunk data; the QOI_PADDING_SIZE bytes after it
+  must be readable. Returns where the next row starts, NULL if the data
+  runs out.
+*/
+const unsigned char *qoi_decode_row (qoi_state *s, const unsigned char *in, const unsigned char *end,
+				     unsigned char *row, int width, int channels);
+
+/* read a whole QOI file into memory; *size gets its length */
+unsigned char *qoi_read_file (FILE *fp, size_t *size);
+
+int qoi2png (char *in, char *out);
+int png2qoi (char *in, char *out);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+#endif
@@ -0,0 +1,210 @@
+/*
+ * **  qoi2png --- conversion from QOI to PNG
+ * **  png2qoi --- conversion from PNG to QOI
+ * **
+ * **  Both stream: one row of pixels in flight plus the QOI data, so
+ * **  only an interlaced PNG is held whole. NULL names mean stdin/stdout.
+ * */
+
+#include "qoi.h"
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+#ifndef png_jmpbuf
+# define png_jmpbuf(png_ptr) ((png_ptr)->jmpbuf)
+#endif
+
+static FILE *open_in (const char *fn)
+{
+	return fn ? fopen (fn, "rb") : stdin;
+}
+
+static FILE *open_out (const char *fn)
+{
+	return fn ? fopen (fn, "wb") : stdout;
+}
+
+static int close_file (FILE *fp, const char *fn)
+{
+	if (!fn)
+		return fflush (fp);
+	return fclose (fp);
+}
+
+int qoi2png (char *in, char *out)
+{
+	png_structp png_ptr = NULL;
+	png_infop info_ptr = NULL;
+	qoi_desc desc;
+	qoi_state s;
+	const unsigned char *p, *end;
+	unsigned char *data, *volatile row = NULL;
+	size_t size;
+	unsigned int y;
+	FILE *fp;
+	int ret = -1;
+
+	fp = open_in (in);
+	if (!fp)
+		return -1;
+	data = qoi_read_file (fp, &size);
+	if (in)
+		fclose (fp);
+	if (!data)
+		return -1;
+	if (qoi_read_header (data, &desc) < 0) {
+		free (data);
+		return -1;
+	}
+
+	fp = open_out (out);
+	if (!fp) {
+		free (data);
+		return -1;
+	}
+
+	row = (unsigned char *)malloc(desc.width * desc.channels);
+	if (!row)
+		goto done;
+	png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr)
+		goto done;
+	info_ptr = png_create_info_struct (png_ptr);
+	if (!info_ptr)
+		goto done;
+	if (setjmp (png_jmpbuf (png_ptr)))
+		goto done;
+
+	png_init_io (png_ptr, fp);
+	png_set_IHDR (png_ptr, info_ptr, desc.width, desc.height, 8,
+		      desc.channels == 4 ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB,
+		      PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	if (desc.colorspace == 0)
+		png_set_sRGB (png_ptr, info_ptr, PNG_sRGB_INTENT_PERCEPTUAL);
+	png_write_info (png_ptr, info_ptr);
+
+	qoi_state_init (&s);
+	p = data + QOI_HEADER_SIZE;
+	end = data + size - QOI_PADDING_SIZE;
+	for (y = 0; y < desc.height; y++) {
+		p = qoi_decode_row (&s, p, end, row, desc.width, desc.channels);
+		if (!p)
+			goto done;
+		png_write_row (png_ptr, row);
+	}
+	png_write_end (png_ptr, info_ptr);
+	ret = 0;
+
+done:
+	if (png_ptr)
+		png_destroy_write_struct (&png_ptr, info_ptr ? &info_ptr : NULL);
+	free (row);
+	free (data);
+	if (close_file (fp, out) != 0)
+		ret = -1;
+	/* no half written file left behind */
+	if (ret != 0 && out)
+		remove (out);
+	return ret;
+}
+
+/* write what out holds so far and start over at buf */
+static int flush_out (FILE *fp, unsigned char *buf, unsigned char *out)
+{
+	size_t n = out - buf;
+
+	return fwrite (buf, 1, n, fp) == n ? 0 : -1;
+}
+
+int png2qoi (char *in, char *out)
+{
+	png_structp png_ptr;
+	png_infop info_ptr = NULL;
+	png_uint_32 width, height, y;
+	int bit_depth, color_type, interlace, channels, passes, pass;
+	unsigned char *volatile image = NULL, *volatile buf = NULL;
+	unsigned char *row, *o;
+	qoi_desc desc;
+	qoi_state s;
+	FILE *fp, *volatile ofp = NULL;
+	volatile int ret = -1;
+
+	fp = open_in (in);
+	if (!fp)
+		return -1;
+
+	png_ptr = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr)
+		goto done;
+	info_ptr = png_create_info_struct (png_ptr);
+	if (!info_ptr)
+		goto done;
+	if (setjmp (png_jmpbuf (png_ptr)))
+		goto done;
+
+	png_init_io (png_ptr, fp);
+	png_read_info (png_ptr, info_ptr);
+	png_get_IHDR (png_ptr, info_ptr, &width, &height, &bit_depth, &color_type, &interlace, NULL, NULL);
+	if (height > QOI_PIXELS_MAX / width)
+		goto done;
+
+	/* everything becomes 8 bit RGB, or RGBA when there is any transparency */
+	png_set_strip_16 (png_ptr);
+	png_set_expand (png_ptr);
+	if (!(color_type & PNG_COLOR_MASK_COLOR))
+		png_set_gray_to_rgb (png_ptr);
+	passes = png_set_interlace_handling (png_ptr);
+	png_read_update_info (png_ptr, info_ptr);
+	channels = png_get_channels (png_ptr, info_ptr);
+
+	image = (unsigned char *)malloc((size_t)width * channels * (passes > 1 ? height : 1));
+	buf = (unsigned char *)malloc(QOI_ROW_BOUND (width) > QOI_HEADER_SIZE ? QOI_ROW_BOUND (width) : QOI_HEADER_SIZE);
+	if (!image || !buf)
+		goto done;
+	ofp = open_out (out);
+	if (!ofp)
+		goto done;
+
+	desc.width = width;
+	desc.height = height;
+	desc.channels = channels;
+	desc.colorspace = 0;
+	qoi_write_header (buf, &desc);
+	if (flush_out (ofp, buf, buf + QOI_HEADER_SIZE) < 0)
+		goto done;
+
+	qoi_state_init (&s);
+	/* Adam7 needs the whole picture before any row is final */
+	for (pass = passes > 1 ? 0 : passes; pass < passes; pass++)
+		for (y = 0, row = image; y < height; y++, row += (size_t)width * channels)
+			png_read_row (png_ptr, row, NULL);
+	for (y = 0; y < height; y++) {
+		if (passes > 1)
+			row = image + (size_t)y * width * channels;
+		else {
+			row = image;
+			png_read_row (png_ptr, row, NULL);
+		}
+		o = qoi_encode_rows (&s, row, 0, width, 1, channels, 0, channels == 4, buf);
+		if (flush_out (ofp, buf, o) < 0)
+			goto done;
+	}
+	o = qoi_encode_finish (&s, buf);
+	if (flush_out (ofp, buf, o) < 0)
+		goto done;
+	png_read_end (png_ptr, NULL);
+	ret = 0;
+
+done:
+	if (png_ptr)
+		png_destroy_read_struct (&png_ptr, info_ptr ? &info_ptr : NULL, NULL);
+	free (image);
+	free (buf);
+	if (in)
+		fclose (fp);
+	if (ofp && close_file (ofp, out) != 0)
+		ret = -1;
+	if (ret != 0 && ofp && out)
+		remove (out);
+	return ret;
+}